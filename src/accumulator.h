@@ -0,0 +1,100 @@
+#pragma once
+
+#include "network.h"
+
+// Caches the pre-activation of a network's first layer so that inputs differing by a few
+// features from the previous evaluation cost O(changed * hidden) instead of O(inputs * hidden)
+struct Accumulator {
+    Network& net;
+
+    // Pre-activations of the first layer, stack[depth] is the current one
+    MultiVector<float, 2> stack;
+    usize depth = 0;
+
+    // Weights of the first layer by input feature, so that the column of a feature is contiguous
+    MultiVector<float, 2> featureWeights;
+
+    explicit Accumulator(Network& net) : net(net) {
+        assert(net.layers.size() > 1);
+        assert(net.layers[1].type == DENSE);
+        stack.push_back(net.layers[1].biases);
+        transposeWeights();
+    }
+
+    vector<float>& current() { return stack[depth]; }
+
+    // Recomputes the accumulator from scratch and clears the undo stack
+    void refresh(const SparseInput& input) {
+        transposeWeights();
+        depth = 0;
+        current() = net.layers[1].biases;
+        for (usize idx = 0; idx < input.indices.size(); idx++)
+            add(input.indices[idx], input.value(idx));
+    }
+
+    void refresh(const InputLayer& input) {
+        assert(input.size() == net.layers[0].size);
+        transposeWeights();
+        depth = 0;
+        current() = net.layers[1].biases;
+        for (usize feature = 0; feature < input.size(); feature++)
+            if (input[feature] != 0)
+                add(feature, input[feature]);
+    }
+
+    void add(u32 feature, float value = 1) {
+        assert(feature < net.layers[0].size);
+        const float* column = featureWeights[feature].data();
+        float* acc = current().data();
+        const usize size = current().size();
+        #pragma omp simd
+        for (usize i = 0; i < size; i++)
+            acc[i] += value * column[i];
+    }
+
+    void remove(u32 feature, float value = 1) {
+        add(feature, -value);
+    }
+
+    // Saves the current state so that a later pop() undoes every update made in between
+    void push() {
+        if (depth + 1 == stack.size())
+            stack.push_back(current());
+        else
+            stack[depth + 1] = current();
+        depth++;
+    }
+
+    void pop() {
+        assert(depth > 0);
+        depth--;
+    }
+
+    // Recomputes only the layers after the first one
+    const vector<float>& evaluate() {
+        Layer& first = net.layers[1];
+        first.preActivation = current();
+        if (first.activation == SOFTMAX) {
+            first.activated = activations::softmax(first.preActivation, net.mathMode);
+        } else {
+            first.activated.resize(first.size);
+            kernels::dispatch(first.activation, net.mathMode, [&]<Activation kAct, MathMode kMode>() {
+                kernels::activate<kAct, kMode>(first.preActivation.data(), first.activated.data(), first.size);
+            });
+        }
+        net.forwardPass(2);
+        return net.output();
+    }
+
+  private:
+    // Copies the weights of the first layer into featureWeights, reusing its storage
+    void transposeWeights() {
+        const Layer& first = net.layers[1];
+        featureWeights.resize(net.layers[0].size);
+        for (usize feature = 0; feature < featureWeights.size(); feature++) {
+            featureWeights[feature].resize(first.size);
+            for (usize i = 0; i < first.size; i++)
+                featureWeights[feature][i] = first.weights[i][feature];
+        }
+    }
+};
@@ -0,0 +1,232 @@
+#pragma once
+
+#include "network.h"
+#include "threadpool.h"
+#include "stopwatch.h"
+#include "numa.h"
+
+#include <fmt/fmt/format.h>
+
+#include <functional>
+#include <optional>
+#include <fstream>
+#include <sstream>
+
+// Settings of Learner that change how fast it trains but not what it learns
+struct TuningResult {
+    usize threads = 0;
+    usize sampleGrain = 0;     // Samples per pool task
+    usize accumulateTile = 0;  // Columns per tile of the weight gradient outer products, 0 for whole rows
+    double samplesPerSec = 0;
+};
+
+// Picks the TuningResult of a network from timed trials of its training steps. The thread count is tuned
+// first, then the grain with the best thread count and last the tile, each trial running batches on the
+// trial samples for trialSeconds. Results are cached in cachePath keyed by the layer shapes, the batch size,
+// the NUMA topology and the CPU model, so later runs of the same model on the same machine skip the trials
+struct Autotuner {
+    string cachePath = "autotune.cache";
+    double trialSeconds = 0.1;
+    bool pinThreads = false; // Pins the workers of the trial pools like Learner::pinThreads
+    bool verbose = true;     // Prints every trial
+
+    // Trains a replica on one sample and adds its gradients to the accumulators with the given column tile
+    using TrainSample = std::function<void(Network&, const DataPoint&, MultiVector<float, 3>&, MultiVector<float, 2>&, usize)>;
+
+    // Tunes for batches of batchSize samples drawn from loadSamples, which is only called when the cache has
+    // no result. The trials run on pool and keep its size if given, else on pools of up to maxThreads workers
+    // or exactly fixedThreads if it is non zero
+    TuningResult tune(const Network& net, usize batchSize, ThreadPool* pool, usize maxThreads, usize fixedThreads,
+                      const std::function<vector<DataPoint>()>& loadSamples, const TrainSample& trainSample) {
+        if (maxThreads == 0)
+            maxThreads = std::max(1u, std::thread::hardware_concurrency());
+        if (pool)
+            fixedThreads = pool->size();
+
+        const string key = cacheKey(net, batchSize, fixedThreads);
+        if (const std::optional<TuningResult> cached = load(key)) {
+            cout << fmt::format("Autotune: {} threads, grain {}, tile {} from {}", cached->threads, cached->sampleGrain, cached->accumulateTile, cachePath) << endl;
+            return *cached;
+        }
+
+        const vector<DataPoint> samples = loadSamples();
+        if (samples.empty())
+            exitWithMsg("Autotuning needs at least one sample", -1);
+
+        cout << "Autotuning threads, grain and tile on " << samples.size() << " samples" << endl;
+        TuningResult best;
+
+        // Each setting defaults to what Learner would use until it is tuned
+        const auto defaultGrain = [&](usize threads) { return std::max<usize>(1, batchSize / (threads * 4)); };
+        const auto measure = [&](usize threads, usize grain, usize tile) {
+            std::optional<ThreadPool> ownPool;
+            if (!pool)
+                ownPool.emplace(threads, pinThreads);
+            const double samplesPerSec = trial(pool ? *pool : *ownPool, net, samples, batchSize, grain, tile, trainSample);
+            if (verbose)
+                cout << fmt::format("  {:>4} threads  grain {:>5}  tile {:>5}  {:>12.1f} samples per sec", threads, grain, tile, samplesPerSec) << endl;
+            if (samplesPerSec > best.samplesPerSec)
+                best = TuningResult{ threads, grain, tile, samplesPerSec };
+        };
+
+        for (usize threads : threadCandidates(batchSize, maxThreads, fixedThreads))
+            measure(threads, defaultGrain(threads), 0);
+
+        const TuningResult byThreads = best;
+        for (usize grain : grainCandidates(batchSize, byThreads.threads))
+            if (grain != byThreads.sampleGrain)
+                measure(byThreads.threads, grain, 0);
+
+        const TuningResult byGrain = best;
+        for (usize tile : tileCandidates(net))
+            measure(byGrain.threads, byGrain.sampleGrain, tile);
+
+        cout << fmt::format("Autotune: {} threads, grain {}, tile {} at {:.1f} samples per sec", best.threads, best.sampleGrain, best.accumulateTile, best.samplesPerSec) << endl;
+        store(key, best);
+        return best;
+    }
+
+    // Identifies the machine, such as "Intel(R) Xeon(R) ... | 2 nodes 16+16 cpus"
+    static string machineKey() {
+        string model = "unknown CPU";
+        std::ifstream cpuinfo("/proc/cpuinfo");
+        string line;
+        while (std::getline(cpuinfo, line)) {
+            const usize colon = line.find(':');
+            if (colon == string::npos || (line.rfind("model name", 0) != 0 && line.rfind("Model", 0) != 0))
+                continue;
+            model = line.substr(line.find_first_not_of(" \t", colon + 1));
+            break;
+        }
+
+        const NumaTopology topology = NumaTopology::detect();
+        string cpus;
+        for (const vector<u32>& node : topology.nodeCpus)
+            cpus += (cpus.empty() ? "" : "+") + std::to_string(node.size());
+        return fmt::format("{} | {} nodes {} cpus", model, topology.nodes(), cpus);
+    }
+
+  private:
+    // Shapes of the layers and the batch, such as "784 DENSE256RELU DENSE10SOFTMAX FAST batch 64"
+    static string cacheKey(const Network& net, usize batchSize, usize fixedThreads) {
+        string shape = std::to_string(net.layers[0].size);
+        for (usize l = 1; l < net.layers.size(); l++) {
+            const Layer& layer = net.layers[l];
+            shape += fmt::format(" {}{}{}", layerTypeNames[layer.type], layer.size, activNames[layer.activation]);
+            if (layer.type == FACTORIZED)
+                shape += fmt::format("r{}", layer.rank);
+            if (layer.type == CONV2D || layer.type == MAX_POOL || layer.type == AVG_POOL)
+                shape += fmt::format("k{}s{}p{}", layer.kernelSize, layer.stride, layer.padding);
+        }
+        shape += fmt::format(" {} batch {}", net.mathMode == FAST_MATH ? "FAST" : "EXACT", batchSize);
+        if (fixedThreads)
+            shape += fmt::format(" threads {}", fixedThreads);
+        return shape + " | " + machineKey();
+    }
+
+    // Lines of the cache are the key and the result separated by tabs
+    std::optional<TuningResult> load(const string& key) const {
+        std::ifstream file(cachePath);
+        string line;
+        while (std::getline(file, line)) {
+            const usize tab = line.find('\t');
+            if (tab == string::npos || line.substr(0, tab) != key)
+                continue;
+
+            TuningResult result;
+            std::istringstream values(line.substr(tab + 1));
+            if (values >> result.threads >> result.sampleGrain >> result.accumulateTile >> result.samplesPerSec && result.threads > 0)
+                return result;
+        }
+        return std::nullopt;
+    }
+
+    void store(const string& key, const TuningResult& result) const {
+        std::ofstream file(cachePath, std::ios::app);
+        if (!file) {
+            cerr << "Failed to write autotune cache " << cachePath << endl;
+            return;
+        }
+        file << key << '\t' << result.threads << ' ' << result.sampleGrain << ' ' << result.accumulateTile << ' ' << result.samplesPerSec << '\n';
+    }
+
+    // Powers of two up to maxThreads and maxThreads itself, no more than there are samples in a batch
+    static vector<usize> threadCandidates(usize batchSize, usize maxThreads, usize fixedThreads) {
+        if (fixedThreads)
+            return { fixedThreads };
+        const usize most = std::min(maxThreads, batchSize);
+        vector<usize> candidates;
+        for (usize threads = 1; threads < most; threads *= 2)
+            candidates.push_back(threads);
+        candidates.push_back(most);
+        return candidates;
+    }
+
+    // From one task per thread to single samples, stopping at 16 tasks per thread
+    static vector<usize> grainCandidates(usize batchSize, usize threads) {
+        vector<usize> candidates;
+        for (usize tasksPerThread = 1; tasksPerThread <= 16; tasksPerThread *= 2) {
+            const usize grain = std::max<usize>(1, batchSize / (threads * tasksPerThread));
+            if (candidates.empty() || grain != candidates.back())
+                candidates.push_back(grain);
+        }
+        return candidates;
+    }
+
+    // Tiles narrower than the widest dense input, none when no input is wider than 256 floats
+    static vector<usize> tileCandidates(const Network& net) {
+        usize widest = 0;
+        for (usize l = 1; l < net.layers.size(); l++)
+            if (net.layers[l].type == DENSE || net.layers[l].type == FACTORIZED)
+                widest = std::max(widest, net.layers[l - 1].size);
+
+        vector<usize> candidates;
+        for (usize tile = 256; tile < widest; tile *= 4)
+            candidates.push_back(tile);
+        return candidates;
+    }
+
+    // Samples per second of training steps as Learner runs them: replica refresh, a batch on the pool, and
+    // the reduction of the per worker accumulators. One step warms up before the timed ones
+    double trial(ThreadPool& workers, const Network& net, const vector<DataPoint>& samples, usize batchSize, usize grain, usize tile, const TrainSample& trainSample) const {
+        MultiVector<float, 3> weightGradAccum;
+        MultiVector<float, 2> biasGradAccum;
+        for (usize l = 1; l < net.layers.size(); l++) {
+            weightGradAccum.push_back(zerosLike(net.layers[l].weights));
+            biasGradAccum.push_back(zerosLike(net.layers[l].biases));
+        }
+        vector<MultiVector<float, 3>> threadWeightGradAccum(workers.size(), weightGradAccum);
+        vector<MultiVector<float, 2>> threadBiasGradAccum(workers.size(), biasGradAccum);
+        vector<Network> networks(workers.size(), net);
+
+        usize next = 0;
+        const auto step = [&]() {
+            deepFill(networks, net);
+            workers.parallelFor(0, batchSize, [&](usize idx, usize worker) {
+                trainSample(networks[worker], samples[(next + idx) % samples.size()], threadWeightGradAccum[worker], threadBiasGradAccum[worker], tile);
+            }, grain);
+            next += batchSize;
+
+            for (usize t = 0; t < workers.size(); t++) {
+                for (usize l = 0; l < weightGradAccum.size(); l++) {
+                    for (usize i = 0; i < weightGradAccum[l].size(); i++)
+                        for (usize j = 0; j < weightGradAccum[l][i].size(); j++)
+                            weightGradAccum[l][i][j] += threadWeightGradAccum[t][l][i][j];
+                    for (usize i = 0; i < biasGradAccum[l].size(); i++)
+                        biasGradAccum[l][i] += threadBiasGradAccum[t][l][i];
+                }
+            }
+            deepFill(threadWeightGradAccum, 0);
+            deepFill(threadBiasGradAccum, 0);
+        };
+
+        step();
+        Stopwatch<std::chrono::microseconds> stopwatch;
+        usize steps = 0;
+        do {
+            step();
+            steps++;
+        } while (stopwatch.elapsed() < trialSeconds * 1e6);
+        return steps * batchSize / (stopwatch.elapsed() / 1e6);
+    }
+};
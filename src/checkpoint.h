@@ -0,0 +1,213 @@
+#pragma once
+
+#include "dataloader.h"
+#include "optim.h"
+#include "stopwatch.h"
+
+#include <condition_variable>
+#include <filesystem>
+#include <optional>
+#include <fstream>
+#include <cstdio>
+#include <thread>
+#include <mutex>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+constexpr u64 CHECKPOINT_MAGIC = 0x504B434F5255454E; // "NEUROCKP"
+constexpr u32 CHECKPOINT_VERSION = 1;
+
+// Where a training run is, enough to continue it from the next batch
+struct TrainingProgress {
+    u64 epoch = 0;
+    u64 batch = 0; // Batches of epoch that are done
+    float trainLossSum = 0;
+    u64 trainCorrect = 0;
+    u64 trainTotal = 0;
+};
+
+// Periodically snapshots weights, optimizer state, data loader state and progress into memory on the
+// training thread and writes them to path on a background thread. Files are written to a temporary
+// file that is flushed to the disk and only then renamed over the previous checkpoint, so a crash, power
+// loss or failed write never loses the last one
+struct Checkpointer {
+    string path;
+    u64 everyBatches; // 0 to only save on time
+    u64 everySeconds; // 0 to only save on batches
+
+    Checkpointer(const string& path, u64 everyBatches, u64 everySeconds = 0)
+        : path(path), everyBatches(everyBatches), everySeconds(everySeconds), writer([this]() { writeLoop(); }) {}
+
+    Checkpointer(const Checkpointer&) = delete;
+    Checkpointer& operator=(const Checkpointer&) = delete;
+
+    // Writes out the last snapshot before returning
+    ~Checkpointer() {
+        {
+            std::lock_guard lock(mut);
+            stopping = true;
+        }
+        cv.notify_all();
+        writer.join();
+    }
+
+    // Whether a checkpoint is due after another finished batch
+    bool due() {
+        batchesSinceSave++;
+        return (everyBatches && batchesSinceSave >= everyBatches) || (everySeconds && sinceSave.elapsed() >= everySeconds);
+    }
+
+    // loaderState is the output of DataLoader::saveState taken before the next batch started loading
+    void save(const TrainingProgress& progress, const Network& net, const optimizers::Optimizer& optimizer, const string& loaderState) {
+        // Snapshots keep their size, reserving it avoids regrowing the buffer on every save
+        string buffer;
+        buffer.reserve(lastSnapshotBytes);
+        std::ostringstream out(std::move(buffer), std::ios::binary);
+        serialization::write(out, CHECKPOINT_MAGIC);
+        serialization::write(out, CHECKPOINT_VERSION);
+        serialization::write(out, progress);
+
+        serialization::write(out, static_cast<u64>(net.layers.size()));
+        for (const Layer& l : net.layers) {
+            serialization::write(out, l.weights);
+            serialization::write(out, l.biases);
+        }
+
+        optimizer.saveState(out);
+        serialization::write(out, loaderState);
+
+        {
+            std::lock_guard lock(mut);
+            // A snapshot the writer has not started on yet is superseded
+            pending = std::move(out).str();
+            lastSnapshotBytes = pending->size();
+        }
+        cv.notify_all();
+
+        batchesSinceSave = 0;
+        sinceSave.reset();
+    }
+
+    // Blocks until every snapshot taken so far is on disk
+    void flush() {
+        std::unique_lock lock(mut);
+        cv.wait(lock, [this]() { return !pending && !writing; });
+    }
+
+    // Restores a checkpoint into a network and optimizer of the same shape, returns the progress to continue from
+    static TrainingProgress load(const string& path, Network& net, optimizers::Optimizer& optimizer, DataLoader& dataLoader) {
+        std::ifstream in(path, std::ios::binary);
+        if (!in)
+            exitWithMsg("Checkpoint not found " + path, -1);
+
+        u64 magic = 0;
+        u32 version = 0;
+        serialization::read(in, magic);
+        serialization::read(in, version);
+        if (magic != CHECKPOINT_MAGIC || version != CHECKPOINT_VERSION)
+            exitWithMsg(path + " is not a checkpoint of this version", -1);
+
+        TrainingProgress progress;
+        serialization::read(in, progress);
+
+        u64 numLayers = 0;
+        serialization::read(in, numLayers);
+        if (numLayers != net.layers.size())
+            exitWithMsg("Checkpoint " + path + " does not match the network", -1);
+        for (Layer& l : net.layers) {
+            serialization::read(in, l.weights);
+            serialization::read(in, l.biases);
+        }
+
+        optimizer.loadState(in);
+
+        string loaderState;
+        serialization::read(in, loaderState);
+        std::istringstream loaderIn(loaderState, std::ios::binary);
+        dataLoader.loadState(loaderIn);
+
+        if (!in)
+            exitWithMsg("Checkpoint is truncated: " + path, -1);
+        return progress;
+    }
+
+    static bool exists(const string& path) { return std::filesystem::exists(path); }
+
+  private:
+    std::mutex mut;
+    std::condition_variable cv;
+    std::optional<string> pending;
+    bool writing = false;
+    bool stopping = false;
+
+    usize lastSnapshotBytes = 0;
+    u64 batchesSinceSave = 0;
+    Stopwatch<std::chrono::seconds> sinceSave;
+
+    std::thread writer;
+
+    void writeLoop() {
+        std::unique_lock lock(mut);
+        while (true) {
+            cv.wait(lock, [this]() { return pending || stopping; });
+            if (!pending)
+                return;
+
+            const string snapshot = std::move(*pending);
+            pending.reset();
+            writing = true;
+            lock.unlock();
+
+            trace::setThreadName("Checkpoint writer");
+            trace::Scope scope("Write checkpoint", "checkpoint");
+            const string tmpPath = path + ".tmp";
+            std::error_code err;
+            if (!writeDurably(tmpPath, snapshot)) {
+                // The previous checkpoint is kept rather than replaced by a partial one, such as on a full disk
+                cerr << "Failed to write checkpoint " << tmpPath << ", keeping the previous one" << endl;
+                std::filesystem::remove(tmpPath, err);
+            }
+            else {
+                std::filesystem::rename(tmpPath, path, err);
+                if (err)
+                    cerr << "Failed to replace checkpoint " << path << ": " << err.message() << endl;
+                else
+                    syncDirectory(path);
+            }
+
+            lock.lock();
+            writing = false;
+            cv.notify_all();
+        }
+    }
+
+    // Writes data to path and flushes it to the disk, so a rename over the old file cannot be persisted
+    // before its contents are. Returns false if any of it failed
+    static bool writeDurably(const string& path, const string& data) {
+        std::FILE* file = std::fopen(path.c_str(), "wb");
+        if (!file)
+            return false;
+        bool ok = std::fwrite(data.data(), 1, data.size(), file) == data.size() && std::fflush(file) == 0;
+#ifdef _WIN32
+        ok = ok && _commit(_fileno(file)) == 0;
+#else
+        ok = ok && ::fsync(::fileno(file)) == 0;
+#endif
+        return std::fclose(file) == 0 && ok;
+    }
+
+    // Persists the rename of a file in its directory
+    static void syncDirectory(const string& path) {
+#ifndef _WIN32
+        const std::filesystem::path dir = std::filesystem::path(path).parent_path();
+        const int fd = ::open(dir.empty() ? "." : dir.c_str(), O_RDONLY);
+        if (fd >= 0) {
+            ::fsync(fd);
+            ::close(fd);
+        }
+#endif
+    }
+};
@@ -3,8 +3,6 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include "../external/stb_image.h"
 
-#include <mutex>
-
 InputLayer loadGreyscaleImage(const std::string& path, usize w, usize h) {
     int width, height, channels;
     unsigned char* data = stbi_load(path.data(), &width, &height, &channels, 1);
@@ -69,19 +67,25 @@ ImageDataLoader::ImageDataLoader(const string path, u64 batchSize, float trainSp
 }
 
 void ImageDataLoader::loadBatch(usize batchSize, usize batchIdx) {
+    trace::Scope scope("Load batch", "loader");
     data[batchIdx].clear();
 
     if (types.empty())
         throw std::runtime_error("No types found in data dir: " + dataDir);
 
-    std::mutex dataMut;
-
-    #pragma omp parallel for num_threads(threads)
+    // Samples are drawn up front so the decode tasks do not share the RNG and the batch order does not depend on scheduling
+    vector<usize> typeIdxs(batchSize);
+    vector<double> imgFractions(batchSize);
+    std::uniform_int_distribution<usize> typeDist(0, types.size() - 1);
+    std::uniform_real_distribution<double> fractionDist(0, 1);
     for (usize i = 0; i < batchSize; i++) {
-        // Randomly pick a type
-        std::uniform_int_distribution<usize> typeDist(0, types.size() - 1);
-        usize typeIdx = typeDist(rng);
-        const string& typeDir = types[typeIdx];
+        typeIdxs[i] = typeDist(rng);
+        imgFractions[i] = fractionDist(rng);
+    }
+
+    vector<InputLayer> inputs(batchSize);
+    workers().parallelFor(0, batchSize, [&](usize i, usize) {
+        const string& typeDir = types[typeIdxs[i]];
 
         // Gather image files in that directory
         std::vector<std::filesystem::path> imgs;
@@ -93,17 +97,19 @@ void ImageDataLoader::loadBatch(usize batchSize, usize batchIdx) {
         if (imgs.empty())
             throw std::runtime_error("No images in type dir: " + typeDir);
 
-        // Randomly pick an image
-        std::uniform_int_distribution<usize> imgDist(0, imgs.size() * trainSplit - 1);
-        usize imgIdx = imgDist(rng);
+        // Randomly pick an image among the training share, of those every shardCount-th starting at shardIndex
+        const usize trainImgs = std::max<usize>(imgs.size() * trainSplit, 1);
+        const usize shardImgs = std::max<usize>((trainImgs + shardCount - 1 - std::min(shardIndex, trainImgs - 1)) / shardCount, 1);
+        const usize imgIdx = std::min<usize>(shardIndex + shardCount * std::min<usize>(imgFractions[i] * shardImgs, shardImgs - 1), trainImgs - 1);
 
-        InputLayer input = loadGreyscaleImage(imgs[imgIdx].string(), width, height);
-        Target target(types.size());
-        target[typeIdx] = 1;
+        trace::Scope decode("Decode image", "loader");
+        inputs[i] = loadGreyscaleImage(imgs[imgIdx].string(), width, height);
+    });
 
-        dataMut.lock();
-        data[batchIdx].emplace_back(input, target);
-        dataMut.unlock();
+    for (usize i = 0; i < batchSize; i++) {
+        Target target(types.size());
+        target[typeIdxs[i]] = 1;
+        data[batchIdx].emplace_back(std::move(inputs[i]), target);
     }
 }
 
@@ -141,4 +147,17 @@ DataPoint ImageDataLoader::next() {
     const DataPoint dataPoint = data[currBatch].back();
     data[currBatch].pop_back();
     return dataPoint;
-}
\ No newline at end of file
+}
+
+void ImageDataLoader::saveState(std::ostream& out) const {
+    std::ostringstream rngState;
+    rngState << rng;
+    serialization::write(out, rngState.str());
+}
+
+void ImageDataLoader::loadState(std::istream& in) {
+    string state;
+    serialization::read(in, state);
+    std::istringstream rngState(state);
+    rngState >> rng;
+}
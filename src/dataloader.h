@@ -1,6 +1,8 @@
 #pragma once
 
 #include "layer.h"
+#include "threadpool.h"
+#include "trace.h"
 #include "util.h"
 
 #include <filesystem>
@@ -11,17 +13,26 @@
 
 struct DataPoint {
 	InputLayer input;
+	SparseInput sparseInput;
+	bool sparse = false;
 	Target target;
 
 	DataPoint(const InputLayer& input, const Target& target) {
 		this->input = input;
 		this->target = target;
 	}
+
+	DataPoint(const SparseInput& input, const Target& target) {
+		this->sparseInput = input;
+		this->sparse = true;
+		this->target = target;
+	}
 };
 
 InputLayer loadGreyscaleImage(const std::string& path, usize w, usize h);
 
 struct DataLoader {
+    // 0 loads batches synchronously when they are waited for, otherwise they are loaded on the pool
     u64 threads;
     u64 batchSize;
     float trainSplit;
@@ -32,6 +43,13 @@ struct DataLoader {
     std::future<void> dataFuture;
     array<vector<DataPoint>, 2> data;
 
+    // Part of the training set drawn from when several processes train together, set by Learner::learn
+    usize shardIndex = 0;
+    usize shardCount = 1;
+
+    // Runs batch loading and decoding, defaultThreadPool() if not set. Learner::learn shares its pool here
+    ThreadPool* pool = nullptr;
+
     DataLoader(u64 batchSize, float trainSplit, u64 threads) {
         this->batchSize = batchSize;
         this->trainSplit = trainSplit;
@@ -49,9 +67,14 @@ struct DataLoader {
     virtual bool hasNext() const = 0;
     virtual DataPoint next() = 0;
 
-    // Attempts to load data asynchronously if threads > 0
+    ThreadPool& workers() { return pool ? *pool : defaultThreadPool(); }
+
+    // Attempts to load data asynchronously if threads > 0. A load still running is waited for first, since
+    // both would fill the same buffer and draw from the same sampling state
     virtual void asyncPreloadoadBatch(usize batchSize) {
-        dataFuture = std::async(threads > 0 ? std::launch::async : std::launch::deferred, [this, batchSize]() { this->loadBatch(batchSize, currBatch ^ 1); });
+        waitForBatch();
+        const auto load = [this, batchSize]() { this->loadBatch(batchSize, currBatch ^ 1); };
+        dataFuture = threads > 0 ? workers().async(load) : std::async(std::launch::deferred, load);
     }
 
     virtual void waitForBatch() {
@@ -67,6 +90,10 @@ struct DataLoader {
         currBatch ^= 1;
     }
 
+    // Sampling state such as RNGs, saved in checkpoints so a resumed run draws the same batches
+    virtual void saveState(std::ostream&) const {}
+    virtual void loadState(std::istream&) {}
+
     virtual ~DataLoader() = default;
 };
 
@@ -88,4 +115,8 @@ struct ImageDataLoader : DataLoader {
     bool hasNext() const override;
 
     DataPoint next() override;
+
+    void saveState(std::ostream& out) const override;
+
+    void loadState(std::istream& in) override;
 };
\ No newline at end of file
@@ -0,0 +1,399 @@
+#pragma once
+
+#include <fmt/fmt/format.h>
+
+#include "types.h"
+
+#include <condition_variable>
+#include <cstring>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <deque>
+#include <mutex>
+#include <span>
+
+#ifndef _WIN32
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+// Connection of one training process to the others of a data parallel run. Ranks form a ring, each one
+// sends to the next and receives from the previous, which is all a ring all-reduce needs
+struct Communicator {
+    usize rank = 0;
+    usize worldSize = 1;
+
+    Communicator(usize rank, usize worldSize) : rank(rank), worldSize(worldSize) {}
+    virtual ~Communicator() = default;
+
+    usize next() const { return (rank + 1) % worldSize; }
+    usize prev() const { return (rank + worldSize - 1) % worldSize; }
+
+    // Sends sendBytes to the next rank while receiving recvBytes from the previous one, either may be 0
+    virtual void exchange(const void* sendBuf, usize sendBytes, void* recvBuf, usize recvBytes) = 0;
+
+    // Sums data over all ranks in place with a ring all-reduce: worldSize - 1 steps of reduce-scatter in which
+    // every rank adds the segment it receives to its own, then worldSize - 1 steps passing the summed segments
+    // on. Each rank sends 2 (worldSize - 1) / worldSize of the data whatever the world size, and every rank
+    // ends up with the same bits since each segment is summed in one place
+    void allReduce(float* data, usize count) {
+        if (worldSize == 1 || count == 0)
+            return;
+
+        const auto segmentBegin = [&](usize s) { return s * count / worldSize; };
+        const auto segmentSize = [&](usize s) { return segmentBegin(s + 1) - segmentBegin(s); };
+        scratch.resize(count / worldSize + 1);
+
+        for (usize step = 0; step + 1 < worldSize; step++) {
+            const usize sendSeg = (rank + worldSize - step) % worldSize;
+            const usize recvSeg = (rank + worldSize - step - 1) % worldSize;
+            exchange(data + segmentBegin(sendSeg), segmentSize(sendSeg) * sizeof(float), scratch.data(), segmentSize(recvSeg) * sizeof(float));
+
+            float* dest = data + segmentBegin(recvSeg);
+            for (usize i = 0; i < segmentSize(recvSeg); i++)
+                dest[i] += scratch[i];
+        }
+
+        for (usize step = 0; step + 1 < worldSize; step++) {
+            const usize sendSeg = (rank + worldSize - step + 1) % worldSize;
+            const usize recvSeg = (rank + worldSize - step) % worldSize;
+            exchange(data + segmentBegin(sendSeg), segmentSize(sendSeg) * sizeof(float), data + segmentBegin(recvSeg), segmentSize(recvSeg) * sizeof(float));
+        }
+    }
+
+    // Copies bytes of rank 0 to every other rank, passed along the ring
+    void broadcast(void* data, usize bytes) {
+        if (worldSize == 1)
+            return;
+        if (rank != 0)
+            exchange(nullptr, 0, data, bytes);
+        if (next() != 0)
+            exchange(data, bytes, nullptr, 0);
+    }
+
+    // Returns once every rank called it
+    void barrier() {
+        float token = 0;
+        allReduce(&token, 1);
+    }
+
+    // Communicator described by the environment the launch tool sets: NEURO_RANK, NEURO_WORLD_SIZE and
+    // NEURO_TRANSPORT, which is shm with NEURO_SHM_NAME or tcp with NEURO_ADDRS, a comma separated host:port
+    // per rank. nullptr without NEURO_WORLD_SIZE
+    static std::unique_ptr<Communicator> fromEnvironment();
+
+  private:
+    vector<float> scratch;
+};
+
+#ifndef _WIN32
+// Ranks on one host exchanging through a POSIX shared memory segment with one single producer single
+// consumer byte ring per rank, written by that rank and read by the next
+struct SharedMemoryCommunicator : Communicator {
+    SharedMemoryCommunicator(const string& name, usize rank, usize worldSize, usize ringBytes = 4 << 20) : Communicator(rank, worldSize), capacity(ringBytes) {
+        mappedBytes = sizeof(Header) + worldSize * (sizeof(Ring) + capacity);
+
+        // Every rank creates the segment if it is not there yet. Growing it zero fills, which is a valid empty state
+        const string path = "/" + name;
+        const int fd = ::shm_open(path.c_str(), O_CREAT | O_RDWR, 0600);
+        if (fd < 0 || ::ftruncate(fd, mappedBytes) != 0)
+            exitWithMsg("Failed to create shared memory segment " + path, -1);
+        mapped = static_cast<char*>(::mmap(nullptr, mappedBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+        ::close(fd);
+        if (mapped == MAP_FAILED)
+            exitWithMsg("Failed to map shared memory segment " + path, -1);
+
+        Header& header = *reinterpret_cast<Header*>(mapped);
+        header.attached.fetch_add(1, std::memory_order_acq_rel);
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+        while (header.attached.load(std::memory_order_acquire) < worldSize) {
+            if (std::chrono::steady_clock::now() > deadline)
+                exitWithMsg("Timed out waiting for " + std::to_string(worldSize) + " ranks to attach to " + path, -1);
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        // The mapping outlives the name, so nothing is left behind if a rank dies
+        if (rank == 0)
+            ::shm_unlink(path.c_str());
+    }
+
+    ~SharedMemoryCommunicator() override { ::munmap(mapped, mappedBytes); }
+
+    void exchange(const void* sendBuf, usize sendBytes, void* recvBuf, usize recvBytes) override {
+        Ring& out = ring(rank);
+        Ring& in = ring(prev());
+        const char* src = static_cast<const char*>(sendBuf);
+        char* dest = static_cast<char*>(recvBuf);
+
+        usize idle = 0;
+        while (sendBytes > 0 || recvBytes > 0) {
+            const usize sent = sendBytes ? out.write(src, sendBytes, capacity) : 0;
+            const usize received = recvBytes ? in.read(dest, recvBytes, capacity) : 0;
+            src += sent;
+            sendBytes -= sent;
+            dest += received;
+            recvBytes -= received;
+
+            // Spins briefly as the peer is usually mid copy, then lets other threads run
+            if (sent || received)
+                idle = 0;
+            else if (++idle > 64)
+                std::this_thread::yield();
+        }
+    }
+
+  private:
+    struct alignas(64) Header {
+        std::atomic<u64> attached;
+    };
+
+    // Byte offsets only ever grow, the ring holds head - tail bytes
+    struct alignas(64) Ring {
+        std::atomic<u64> head;             // Written by the producer
+        alignas(64) std::atomic<u64> tail; // Written by the consumer
+
+        char* bytes() { return reinterpret_cast<char*>(this + 1); }
+
+        usize write(const char* src, usize size, usize capacity) {
+            const u64 h = head.load(std::memory_order_relaxed);
+            const usize n = std::min<usize>(size, capacity - (h - tail.load(std::memory_order_acquire)));
+            const usize start = h % capacity;
+            const usize first = std::min(n, capacity - start);
+            std::memcpy(bytes() + start, src, first);
+            std::memcpy(bytes(), src + first, n - first);
+            head.store(h + n, std::memory_order_release);
+            return n;
+        }
+
+        usize read(char* dest, usize size, usize capacity) {
+            const u64 t = tail.load(std::memory_order_relaxed);
+            const usize n = std::min<usize>(size, head.load(std::memory_order_acquire) - t);
+            const usize start = t % capacity;
+            const usize first = std::min(n, capacity - start);
+            std::memcpy(dest, bytes() + start, first);
+            std::memcpy(dest + first, bytes(), n - first);
+            tail.store(t + n, std::memory_order_release);
+            return n;
+        }
+    };
+
+    char* mapped;
+    usize mappedBytes;
+    usize capacity;
+
+    Ring& ring(usize r) { return *reinterpret_cast<Ring*>(mapped + sizeof(Header) + r * (sizeof(Ring) + capacity)); }
+};
+
+// Ranks on any hosts connected by TCP, each rank listens on its own address and connects to the next rank's
+struct TcpCommunicator : Communicator {
+    // addresses holds a host:port per rank
+    TcpCommunicator(const vector<string>& addresses, usize rank) : Communicator(rank, addresses.size()) {
+        const auto [ownHost, ownPort] = splitAddress(addresses[rank]);
+
+        const int listenFd = ::socket(AF_INET, SOCK_STREAM, 0);
+        const int reuse = 1;
+        ::setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(std::stoi(ownPort));
+        if (listenFd < 0 || ::bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(listenFd, 4) != 0)
+            exitWithMsg("Failed to listen on port " + ownPort, -1);
+
+        // Every rank listens before it connects, so the connects complete from the backlog without deadlock
+        sendFd = connectWithRetry(addresses[next()]);
+        const u32 ownRank = rank;
+        if (::send(sendFd, &ownRank, sizeof(ownRank), 0) != sizeof(ownRank))
+            exitWithMsg("Failed to greet rank " + std::to_string(next()), -1);
+
+        recvFd = ::accept(listenFd, nullptr, nullptr);
+        u32 peerRank = ~0u;
+        if (recvFd < 0 || ::recv(recvFd, &peerRank, sizeof(peerRank), MSG_WAITALL) != sizeof(peerRank) || peerRank != prev())
+            exitWithMsg("Expected a connection from rank " + std::to_string(prev()) + " on port " + ownPort, -1);
+        ::close(listenFd);
+
+        for (int fd : { sendFd, recvFd }) {
+            const int noDelay = 1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+            ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+        }
+    }
+
+    ~TcpCommunicator() override {
+        ::close(sendFd);
+        ::close(recvFd);
+    }
+
+    // Polls both sockets so a ring of ranks that all send large messages cannot fill every buffer and stall
+    void exchange(const void* sendBuf, usize sendBytes, void* recvBuf, usize recvBytes) override {
+        const char* src = static_cast<const char*>(sendBuf);
+        char* dest = static_cast<char*>(recvBuf);
+
+        while (sendBytes > 0 || recvBytes > 0) {
+            pollfd fds[2] = { { sendFd, static_cast<short>(sendBytes ? POLLOUT : 0), 0 }, { recvFd, static_cast<short>(recvBytes ? POLLIN : 0), 0 } };
+            if (::poll(fds, 2, -1) < 0)
+                continue;
+
+            if (fds[0].revents & (POLLERR | POLLHUP) || fds[1].revents & POLLERR)
+                exitWithMsg("Lost the connection to a neighbouring rank of rank " + std::to_string(rank), -1);
+            if (sendBytes && fds[0].revents & POLLOUT) {
+                const auto sent = ::send(sendFd, src, sendBytes, MSG_NOSIGNAL);
+                if (sent > 0) {
+                    src += sent;
+                    sendBytes -= sent;
+                }
+            }
+            if (recvBytes && fds[1].revents & (POLLIN | POLLHUP)) {
+                const auto got = ::recv(recvFd, dest, recvBytes, 0);
+                if (got == 0)
+                    exitWithMsg("Rank " + std::to_string(prev()) + " closed its connection", -1);
+                if (got > 0) {
+                    dest += got;
+                    recvBytes -= got;
+                }
+            }
+        }
+    }
+
+  private:
+    int sendFd = -1;
+    int recvFd = -1;
+
+    static std::pair<string, string> splitAddress(const string& address) {
+        const usize colon = address.rfind(':');
+        if (colon == string::npos)
+            exitWithMsg("Expected host:port, got " + address, -1);
+        return { address.substr(0, colon), address.substr(colon + 1) };
+    }
+
+    // The next rank may not be listening yet, so connecting is retried for a minute
+    static int connectWithRetry(const string& address) {
+        const auto [host, port] = splitAddress(address);
+        addrinfo hints{};
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+        while (std::chrono::steady_clock::now() < deadline) {
+            addrinfo* info = nullptr;
+            if (::getaddrinfo(host.c_str(), port.c_str(), &hints, &info) == 0) {
+                const int fd = ::socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+                const bool connected = fd >= 0 && ::connect(fd, info->ai_addr, info->ai_addrlen) == 0;
+                ::freeaddrinfo(info);
+                if (connected)
+                    return fd;
+                if (fd >= 0)
+                    ::close(fd);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+        exitWithMsg("Failed to connect to " + address, -1);
+    }
+};
+#endif
+
+inline std::unique_ptr<Communicator> Communicator::fromEnvironment() {
+    const char* worldSizeVar = std::getenv("NEURO_WORLD_SIZE");
+    if (!worldSizeVar)
+        return nullptr;
+#ifdef _WIN32
+    exitWithMsg("Distributed training is not supported on Windows", -1);
+#else
+    const auto env = [](const char* name) -> string {
+        const char* value = std::getenv(name);
+        if (!value)
+            exitWithMsg(string("Missing environment variable ") + name, -1);
+        return value;
+    };
+
+    const usize worldSize = std::stoull(worldSizeVar);
+    const usize rank = std::stoull(env("NEURO_RANK"));
+    if (rank >= worldSize)
+        exitWithMsg(fmt::format("Rank {} is out of range for a world size of {}", rank, worldSize), -1);
+
+    const string transport = env("NEURO_TRANSPORT");
+    if (transport == "shm")
+        return std::make_unique<SharedMemoryCommunicator>(env("NEURO_SHM_NAME"), rank, worldSize);
+    if (transport != "tcp")
+        exitWithMsg("Unknown transport " + transport + ", expected shm or tcp", -1);
+
+    vector<string> addresses;
+    const string list = env("NEURO_ADDRS");
+    for (usize start = 0; start <= list.size();) {
+        const usize comma = std::min(list.find(',', start), list.size());
+        addresses.push_back(list.substr(start, comma - start));
+        start = comma + 1;
+    }
+    if (addresses.size() != worldSize)
+        exitWithMsg(fmt::format("NEURO_ADDRS lists {} addresses for a world size of {}", addresses.size(), worldSize), -1);
+    return std::make_unique<TcpCommunicator>(addresses, rank);
+#endif
+}
+
+// Runs allReduce calls on a thread of its own in the order they were submitted, so the gradients of one
+// layer travel while the next is still being prepared
+struct AsyncAllReduce {
+    explicit AsyncAllReduce(Communicator& comm) : comm(comm), worker([this]() { work(); }) {}
+
+    AsyncAllReduce(const AsyncAllReduce&) = delete;
+    AsyncAllReduce& operator=(const AsyncAllReduce&) = delete;
+
+    ~AsyncAllReduce() {
+        {
+            std::lock_guard lock(mut);
+            stopping = true;
+        }
+        cv.notify_all();
+        worker.join();
+    }
+
+    // data must stay valid until wait() returns
+    void submit(std::span<float> data) {
+        {
+            std::lock_guard lock(mut);
+            queue.push_back(data);
+            pending++;
+        }
+        cv.notify_all();
+    }
+
+    // Blocks until every submitted all-reduce is done
+    void wait() {
+        std::unique_lock lock(mut);
+        cv.wait(lock, [this]() { return pending == 0; });
+    }
+
+  private:
+    Communicator& comm;
+    std::mutex mut;
+    std::condition_variable cv;
+    std::deque<std::span<float>> queue;
+    usize pending = 0;
+    bool stopping = false;
+    std::thread worker;
+
+    void work() {
+        std::unique_lock lock(mut);
+        while (true) {
+            cv.wait(lock, [this]() { return stopping || !queue.empty(); });
+            if (queue.empty())
+                return;
+
+            const std::span<float> data = queue.front();
+            queue.pop_front();
+            lock.unlock();
+            comm.allReduce(data.data(), data.size());
+            lock.lock();
+            pending--;
+            cv.notify_all();
+        }
+    }
+};
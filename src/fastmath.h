@@ -0,0 +1,71 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+#include <bit>
+
+// Branch free float approximations of transcendental functions that vectorize when applied in a loop.
+// Maximum errors were measured against the double precision libm results over the stated ranges
+namespace fastmath {
+    // Max relative error 8e-8 for x in [-87, 88.37], inputs outside are clamped. Above 88.37 the reduction
+    // rounds n up to 128, whose 2^n does not fit the exponent bits, so larger inputs give exp(88.37)
+    inline float exp(float x) {
+        x = std::clamp(x, -87.3f, 88.37f);
+
+        // x = n ln2 + r with |r| <= ln2 / 2, ln2 split in two for an exact reduction
+        const float n = std::floor(x * 1.44269504f + 0.5f);
+        const float r = x - n * 0.693359375f + n * 2.12194440e-4f;
+
+        const float r2 = r * r;
+        const float p = (((((1.9875691500e-4f * r + 1.3981999507e-3f) * r + 8.3334519073e-3f) * r + 4.1665795894e-2f) * r + 1.6666665459e-1f) * r + 5.0000001201e-1f) * r2 + r + 1;
+
+        // Scale by 2^n through the exponent bits
+        return p * std::bit_cast<float>(static_cast<uint32_t>(static_cast<int32_t>(n) + 127) << 23);
+    }
+
+    // Max relative error 8e-8 for normal x > 0 with |x - 1| > 0.01, use log1p closer to 1
+    inline float log(float x) {
+        const uint32_t bits = std::bit_cast<uint32_t>(x);
+        float e = static_cast<float>(static_cast<int32_t>(bits >> 23) - 126);
+        float m = std::bit_cast<float>((bits & 0x007FFFFFu) | 0x3F000000u); // [0.5, 1)
+
+        // Keep the mantissa in [sqrt(0.5), sqrt(2)) around 1
+        const bool small = m < 0.707106781f;
+        e = small ? e - 1 : e;
+        m = small ? m + m - 1 : m - 1;
+
+        const float m2 = m * m;
+        float y = ((((((((7.0376836292e-2f * m - 1.1514610310e-1f) * m + 1.1676998740e-1f) * m - 1.2420140846e-1f) * m + 1.4249322787e-1f) * m - 1.6668057665e-1f) * m + 2.0000714765e-1f) * m - 2.4999993993e-1f) * m + 3.3333331174e-1f) * m * m2;
+        y += e * -2.12194440e-4f;
+        y -= 0.5f * m2;
+        return m + y + e * 0.693359375f;
+    }
+
+    // Max absolute error 8e-8
+    inline float tanh(float x) {
+        const float ax = std::abs(x);
+
+        // Odd polynomial near zero where 1 - 2 / (e^2x + 1) loses precision
+        const float x2 = x * x;
+        const float small = ((((-5.70498872745e-3f * x2 + 2.06390887954e-2f) * x2 - 5.37397155531e-2f) * x2 + 1.33314422036e-1f) * x2 - 3.33332819422e-1f) * x2 * x + x;
+
+        const float large = 1 - 2 / (exp(2 * ax) + 1);
+        return ax < 0.625f ? small : std::copysign(large, x);
+    }
+
+    // Max absolute error 9e-8
+    inline float sigmoid(float x) { return 1 / (1 + exp(-x)); }
+
+    // Max relative error 1.8e-7, accurate for small x by correcting for the rounding of 1 + x
+    inline float log1p(float x) {
+        const float u = 1 + x;
+        return u == 1 ? x : log(u) * x / (u - 1);
+    }
+
+    // Max relative error 2.2e-7
+    inline float softplus(float x) { return std::max(x, 0.0f) + log1p(exp(-std::abs(x))); }
+
+    // Max absolute error 6e-8
+    inline float gaussian(float x) { return exp(-(x * x)); }
+}
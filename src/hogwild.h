@@ -0,0 +1,300 @@
+#pragma once
+
+#include "learner.h"
+
+#include <condition_variable>
+#include <atomic>
+#include <thread>
+#include <deque>
+
+struct HogwildConfig {
+    usize chunkSize = 16;      // Samples a worker takes from the queue at once
+    u64 maxStaleness = 0;      // Most updates a worker may be ahead of the slowest one, 0 for no bound
+    u64 evalEverySamples = 0;  // Evaluates on the test set this often besides after every epoch, 0 for only after epochs
+};
+
+// Batches from the data loader cut up into samples for the workers
+struct SampleQueue {
+    explicit SampleQueue(usize capacity) : capacity(capacity) {}
+
+    // Blocks while the queue holds capacity samples or more
+    void push(const vector<DataPoint>& batch) {
+        std::unique_lock lock(mut);
+        notFull.wait(lock, [&]() { return samples.size() < capacity; });
+        samples.insert(samples.end(), batch.begin(), batch.end());
+        notEmpty.notify_all();
+    }
+
+    // Moves up to count samples into out, returns false once the queue is closed and empty
+    bool pop(vector<DataPoint>& out, usize count) {
+        std::unique_lock lock(mut);
+        notEmpty.wait(lock, [&]() { return closed || !samples.empty(); });
+        if (samples.empty())
+            return false;
+
+        out.clear();
+        while (out.size() < count && !samples.empty()) {
+            out.push_back(std::move(samples.front()));
+            samples.pop_front();
+        }
+        notFull.notify_all();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard lock(mut);
+        closed = true;
+        notEmpty.notify_all();
+    }
+
+  private:
+    std::mutex mut;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+    std::deque<DataPoint> samples;
+    usize capacity;
+    bool closed = false;
+};
+
+// Asynchronous SGD in the style of Hogwild (Niu et al. 2011). Every worker pulls samples from a queue and
+// applies the update of each one straight to the shared weights without locks or barriers, so updates of
+// different workers may interleave. Rows whose gradient is zero and the columns of inactive sparse input
+// features are not touched, which makes collisions rare for sparse inputs. Dense layers only.
+// The mode is racy by design: workers read and write the weights and the periodic evaluation copies them
+// with plain loads and stores while others update them, which is a data race in C++ terms. Weights are aligned floats
+// that x86 and ARM load and store whole, so a read sees an old or a new value and a lost update only drops
+// one sample's step, the trade off Hogwild makes for running without synchronization
+struct HogwildLearner {
+    Network& net;
+    DataLoader& dataLoader;
+    Loss lossFunc;
+    HogwildConfig config;
+
+    HogwildLearner(Network& net, DataLoader& dataLoader, Loss lossFunc = MSE, HogwildConfig config = {})
+        : net(net), dataLoader(dataLoader), lossFunc(lossFunc), config(config) {}
+
+    void learn(LRSchedule& lrSchedule, usize epochs, usize threads = 0) {
+        // The workers are only joined after the last epoch
+        if (epochs == 0)
+            return;
+        if (threads == 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+
+        for (usize l = 1; l < net.layers.size(); l++)
+            if (net.layers[l].type != DENSE)
+                exitWithMsg("Hogwild training supports DENSE layers only, got " + layerTypeNames[net.layers[l].type], -1);
+
+        const u64 batchSize = dataLoader.batchSize;
+        const u64 batchesPerEpoch = dataLoader.numSamples / batchSize;
+
+        cout << "Hogwild training for " << batchesPerEpoch * epochs << " batches with " << threads << " threads" << endl;
+        cout << "Epoch      Samples    Train loss    Test loss     Train accuracy     Test accuracy" << endl;
+
+        SampleQueue queue(2 * batchSize);
+        lr.store(lrSchedule.lr(0), std::memory_order_relaxed);
+
+        // Activations of each worker, built before any worker starts so net is not copied while it is updated
+        // or evaluated. The weights are only read from net
+        Network shell = net;
+        for (usize l = 1; l < shell.layers.size(); l++) {
+            shell.layers[l].weights = MultiVector<float, 2>();
+            shell.layers[l].biases.clear();
+        }
+        vector<Network> shells(threads, shell);
+
+        workerStates = vector<WorkerState>(threads);
+        vector<std::thread> workers;
+        for (usize t = 0; t < threads; t++)
+            workers.emplace_back([&, t]() { work(t, queue, shells[t]); });
+
+        u64 samplesQueued = 0;
+        u64 nextEval = config.evalEverySamples;
+        WorkerStats reported;
+
+        // Every batch prefetches the next one, which carries over into the next epoch
+        dataLoader.asyncPreloadoadBatch(batchSize);
+
+        for (usize epoch = 0; epoch < epochs; epoch++) {
+            lr.store(lrSchedule.lr(epoch), std::memory_order_relaxed);
+
+            for (u64 batch = 0; batch < batchesPerEpoch; batch++) {
+                dataLoader.waitForBatch();
+                dataLoader.swapBuffers();
+                queue.push(dataLoader.batchData());
+                samplesQueued += batchSize;
+                dataLoader.asyncPreloadoadBatch(batchSize);
+
+                // Evaluates the live weights while the workers keep updating them, the epoch's end has its own report
+                if (config.evalEverySamples && samplesQueued >= nextEval) {
+                    nextEval += config.evalEverySamples;
+                    if (batch + 1 < batchesPerEpoch)
+                        report(epoch, reported);
+                }
+            }
+
+            // The final report waits for the workers to drain the queue
+            if (epoch + 1 == epochs) {
+                queue.close();
+                for (std::thread& worker : workers)
+                    worker.join();
+            }
+            report(epoch, reported);
+        }
+
+        // The batch prefetched last may still be loading on the pool
+        dataLoader.waitForBatch();
+    }
+
+  private:
+    struct WorkerStats {
+        u64 samples = 0;
+        u64 correct = 0;
+        double lossSum = 0;
+    };
+
+    // Written only by its worker, aligned so workers do not share cache lines
+    struct alignas(64) WorkerState {
+        std::atomic<u64> updates = 0; // Updates applied, UINT64_MAX once the worker is done
+        std::atomic<u64> samples = 0;
+        std::atomic<u64> correct = 0;
+        std::atomic<double> lossSum = 0;
+    };
+
+    std::atomic<float> lr;
+    vector<WorkerState> workerStates;
+
+    // Prints the training stats since the last report and the test loss and accuracy of the current weights
+    void report(usize epoch, WorkerStats& reported) {
+        WorkerStats total;
+        for (const WorkerState& s : workerStates) {
+            total.samples += s.samples.load(std::memory_order_relaxed);
+            total.correct += s.correct.load(std::memory_order_relaxed);
+            total.lossSum += s.lossSum.load(std::memory_order_relaxed);
+        }
+        const u64 samples = total.samples - reported.samples;
+        const float trainLoss = samples ? (total.lossSum - reported.lossSum) / samples : 0;
+        const float trainAcc = samples ? static_cast<float>(total.correct - reported.correct) / samples : 0;
+        reported = total;
+
+        // A copy keeps the activations of the evaluation out of net, whose weights the workers keep updating
+        Network snapshot = net;
+        const auto testLA = testLossAccuracy(snapshot, dataLoader, lossFunc);
+        cout << fmt::format("{:>5L}{:>13L}{:>14.5f}{:>13.5f}{:>18.2f}%{:>17.2f}%", epoch, total.samples, trainLoss, testLA.first, trainAcc * 100, testLA.second * 100) << endl;
+    }
+
+    // Waits until no other worker is more than maxStaleness updates behind this one
+    void waitForStragglers(u64 updates) const {
+        while (true) {
+            u64 slowest = std::numeric_limits<u64>::max();
+            for (const WorkerState& s : workerStates)
+                slowest = std::min(slowest, s.updates.load(std::memory_order_acquire));
+            if (slowest == std::numeric_limits<u64>::max() || updates <= slowest + config.maxStaleness)
+                return;
+            std::this_thread::yield();
+        }
+    }
+
+    void work(usize t, SampleQueue& queue, Network& shell) {
+        WorkerState& state = workerStates[t];
+
+        vector<Gradient> grads(net.layers.size());
+        for (usize l = 0; l < net.layers.size(); l++)
+            grads[l].resize(net.layers[l].size);
+
+        WorkerStats stats;
+        vector<DataPoint> chunk;
+        while (queue.pop(chunk, config.chunkSize)) {
+            for (const DataPoint& data : chunk) {
+                shell.load(data);
+                forward(shell);
+
+                const Layer& output = shell.layers.back();
+                stats.lossSum += getLoss(lossFunc, output, data.target);
+                const usize guess = std::max_element(output.activated.begin(), output.activated.end()) - output.activated.begin();
+                const usize goal = std::max_element(data.target.begin(), data.target.end()) - data.target.begin();
+                stats.correct += guess == goal;
+                stats.samples++;
+
+                backward(shell, data.target, grads);
+
+                const u64 updates = state.updates.load(std::memory_order_relaxed) + 1;
+                if (config.maxStaleness)
+                    waitForStragglers(updates);
+                update(shell, grads, lr.load(std::memory_order_relaxed));
+                state.updates.store(updates, std::memory_order_release);
+            }
+
+            state.samples.store(stats.samples, std::memory_order_relaxed);
+            state.correct.store(stats.correct, std::memory_order_relaxed);
+            state.lossSum.store(stats.lossSum, std::memory_order_relaxed);
+        }
+
+        // Finished workers no longer hold the others back
+        state.updates.store(std::numeric_limits<u64>::max(), std::memory_order_release);
+    }
+
+    // Layer::forward with the shared weights
+    void forward(Network& shell) const {
+        for (usize l = 1; l < shell.layers.size(); l++) {
+            const Layer& params = net.layers[l];
+            const Layer& previous = shell.layers[l - 1];
+            Layer& layer = shell.layers[l];
+
+            const Activation fused = layer.activation == SOFTMAX ? NO_ACTIVATION : layer.activation;
+            kernels::dispatch(fused, shell.mathMode, [&]<Activation kAct, MathMode kMode>() {
+                if (previous.sparse)
+                    kernels::dense<kAct, kMode>(params.weights, params.biases.data(), previous.sparseActivated, layer.preActivation.data(), layer.activated.data(), layer.size);
+                else
+                    kernels::dense<kAct, kMode>(params.weights, params.biases.data(), previous.activated.data(), previous.activated.size(), layer.preActivation.data(), layer.activated.data(), layer.size);
+            });
+            if (layer.activation == SOFTMAX)
+                layer.activated = activations::softmax(layer.preActivation, shell.mathMode);
+        }
+    }
+
+    // Learner::backward with the shared weights, leaves the gradients with respect to each layer's pre-activations in grads
+    void backward(const Network& shell, const Target& target, vector<Gradient>& grads) const {
+        const Layer& output = shell.layers.back();
+        outputGradient(lossFunc, output, target, grads.back());
+
+        for (usize l = shell.layers.size() - 1; l > 0; l--) {
+            const Layer& layer = shell.layers[l];
+            const bool applyDerivative = l + 1 < shell.layers.size() || output.activation != SOFTMAX;
+            Gradient* prevGrad = l > 1 ? &grads[l - 1] : nullptr;
+            if (prevGrad)
+                std::fill(prevGrad->begin(), prevGrad->end(), 0);
+
+            kernels::dispatch(applyDerivative ? layer.activation : NO_ACTIVATION, shell.mathMode, [&]<Activation kAct, MathMode kMode>() {
+                kernels::denseBackward<kAct, kMode>(net.layers[l].weights, layer.preActivation.data(), layer.activated.data(), grads[l].data(), layer.size,
+                                                    prevGrad ? prevGrad->data() : nullptr, prevGrad ? prevGrad->size() : 0);
+            });
+        }
+    }
+
+    // Applies the SGD step of one sample to the shared weights
+    void update(const Network& shell, const vector<Gradient>& grads, float lr) {
+        for (usize l = 1; l < net.layers.size(); l++) {
+            Layer& params = net.layers[l];
+            const Layer& previous = shell.layers[l - 1];
+
+            for (usize i = 0; i < params.size; i++) {
+                const float g = lr * grads[l][i];
+                if (g == 0)
+                    continue;
+
+                // Concurrent updates to the same weight may overwrite each other, which Hogwild accepts
+                params.biases[i] -= g;
+                float* row = params.weights[i].data();
+                if (previous.sparse) {
+                    const SparseInput& input = previous.sparseActivated;
+                    for (usize idx = 0; idx < input.indices.size(); idx++)
+                        row[input.indices[idx]] -= g * input.value(idx);
+                }
+                else {
+                    for (usize j = 0; j < previous.activated.size(); j++)
+                        row[j] -= g * previous.activated[j];
+                }
+            }
+        }
+    }
+};
@@ -1,30 +1,385 @@
 #pragma once
 
 #include "network.h"
+#include "kernels.h"
 
 #include <fstream>
+#include <cstring>
+#include <memory>
+#include <span>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Files start with this magic followed by a format version, files without it are
+// from before layer types existed and only hold dense layers
+constexpr u64 WEIGHTS_MAGIC = 0x4F5255454E; // "NEURO"
+constexpr u32 WEIGHTS_VERSION = 3;
+
+// Version 3 files are a Header, one LayerEntry per layer and 64 byte aligned data blocks that the
+// entries point to. Weight matrices are row major with rows padded to whole cache lines, so a memory
+// mapping of the file can be used in place
+namespace weightfile {
+	constexpr usize ALIGNMENT = 64;
+
+	enum Block : u32 {
+		WEIGHTS,      // [currNeuron][prevLayerNeuron], the down projection of FACTORIZED layers
+		UP_WEIGHTS,   // [currNeuron][rank] up projection of FACTORIZED layers
+		BIASES,
+		ROW_PTR,      // BlockSparseMatrix arrays of BLOCK_SPARSE layers
+		BLOCK_IDX,
+		BLOCK_VALUES,
+		NUM_BLOCKS
+	};
+
+	// Offset in bytes from the start of the file, stride in elements. Absent blocks have no rows
+	struct BlockRef {
+		u64 offset;
+		u64 rows;
+		u64 cols;
+		u64 stride;
+	};
+
+	struct Header {
+		u64 magic;
+		u32 version;
+		u32 layerEntryBytes;
+		u64 numLayers;
+		u64 dataOffset;
+		u64 fileBytes;
+		u64 checksum;      // Of the bytes from dataOffset to the end of the file
+		u64 tableChecksum; // Of the layer entries, 0 in files written before it was added
+		u64 reserved;
+	};
+
+	struct LayerEntry {
+		u64 size;
+		i16 activation;
+		i16 type;
+		u32 reserved;
+		u64 channels, height, width;
+		u64 kernelSize, stride, padding;
+		u64 rank;
+		u64 blockRows, blockCols;
+		BlockRef blocks[NUM_BLOCKS];
+	};
+
+	static_assert(sizeof(Header) == ALIGNMENT);
+	static_assert(sizeof(LayerEntry) % 8 == 0);
+
+	constexpr u64 alignBytes(u64 bytes) { return (bytes + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT; }
+
+	// FNV-1a over 64 bit words, blocks are padded so the length is always a multiple of 8
+	inline u64 checksum(const std::byte* data, usize bytes) {
+		u64 hash = 0xCBF29CE484222325;
+		for (usize i = 0; i + 8 <= bytes; i += 8) {
+			u64 word;
+			std::memcpy(&word, data + i, 8);
+			hash = (hash ^ word) * 0x100000001B3;
+		}
+		return hash;
+	}
+}
 
 static inline void saveWeights(const string path, const Network& net) {
-	std::ofstream file(path, std::ios::binary);
+	using namespace weightfile;
+
+	vector<LayerEntry> entries(net.layers.size());
+	vector<std::byte> data;
+
+	const u64 dataOffset = alignBytes(sizeof(Header) + entries.size() * sizeof(LayerEntry));
 
-	const auto write = [&](const auto& val) {
-		file.write(reinterpret_cast<const char*>(&val), sizeof(val));
+	// Appends a cache line aligned block of rows padded to stride elements
+	const auto addBlock = [&](BlockRef& ref, usize rows, usize cols, usize elemBytes, const auto& rowData) {
+		const usize stride = alignBytes(cols * elemBytes) / elemBytes;
+		ref = { dataOffset + data.size(), rows, cols, stride };
+		const usize start = data.size();
+		data.resize(start + alignBytes(rows * stride * elemBytes));
+		for (usize r = 0; r < rows; r++)
+			std::memcpy(data.data() + start + r * stride * elemBytes, rowData(r), cols * elemBytes);
 	};
+	const auto addVector = [&](BlockRef& ref, const auto& vec) {
+		addBlock(ref, 1, vec.size(), sizeof(vec[0]), [&](usize) { return vec.data(); });
+	};
+
+	for (usize i = 0; i < net.layers.size(); i++) {
+		const Layer& l = net.layers[i];
+		LayerEntry& e = entries[i];
+		e = {};
+		e.size = l.size;
+		e.activation = l.activation;
+		e.type = l.type;
+		e.channels = l.channels;
+		e.height = l.height;
+		e.width = l.width;
+		e.kernelSize = l.kernelSize;
+		e.stride = l.stride;
+		e.padding = l.padding;
+		e.rank = l.rank;
 
-	write(net.layers.size());
+		if (i == 0)
+			continue;
 
-	for (const Layer& l : net.layers) {
-		write(l.size);
-		write(l.activation);
-		for (const vector<float>& weights : l.weights)
-			for (const float f : weights)
-				write(f);
+		if (l.type == BLOCK_SPARSE) {
+			const BlockSparseMatrix& m = l.sparseWeights;
+			e.blockRows = m.blockRows;
+			e.blockCols = m.blockCols;
+			addVector(e.blocks[ROW_PTR], m.rowPtr);
+			addVector(e.blocks[BLOCK_IDX], m.blockIdx);
+			addVector(e.blocks[BLOCK_VALUES], m.values);
+		}
+		else if (l.type == FACTORIZED) {
+			addBlock(e.blocks[WEIGHTS], l.rank, net.layers[i - 1].size, sizeof(float), [&](usize r) { return l.weights[r].data(); });
+			addBlock(e.blocks[UP_WEIGHTS], l.size, l.rank, sizeof(float), [&](usize r) { return l.weights[l.rank + r].data(); });
+		}
+		else if (!l.weights.empty())
+			addBlock(e.blocks[WEIGHTS], l.weights.size(), l.weights[0].size(), sizeof(float), [&](usize r) { return l.weights[r].data(); });
 
-		for (const float bias : l.biases)
-			write(bias);
+		addVector(e.blocks[BIASES], l.biases);
 	}
+
+	Header header{};
+	header.magic = WEIGHTS_MAGIC;
+	header.version = WEIGHTS_VERSION;
+	header.layerEntryBytes = sizeof(LayerEntry);
+	header.numLayers = entries.size();
+	header.dataOffset = dataOffset;
+	header.fileBytes = dataOffset + data.size();
+	header.checksum = checksum(data.data(), data.size());
+	header.tableChecksum = checksum(reinterpret_cast<const std::byte*>(entries.data()), entries.size() * sizeof(LayerEntry));
+
+	std::ofstream file(path, std::ios::binary);
+	if (!file)
+		exitWithMsg("Failed to open " + path + " for writing", -1);
+
+	const vector<char> padding(dataOffset - sizeof(Header) - entries.size() * sizeof(LayerEntry));
+	file.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+	file.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(LayerEntry));
+	file.write(padding.data(), padding.size());
+	file.write(reinterpret_cast<const char*>(data.data()), data.size());
+
+	if (!file)
+		exitWithMsg("Failed to write " + path, -1);
 }
 
+// Read only memory mapping of a version 3 weights file. Processes mapping the same file share one
+// page cache copy of the weights, and matrices are handed out as views into the mapping. The layer table
+// and blocks are always checked to lie inside the file, verifyChecksum also hashes the table and the data
+struct MappedWeights {
+	MappedWeights(const string& path, const bool verifyChecksum = false) : path(path) {
+#ifdef _WIN32
+		file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			exitWithMsg("File not found " + path, -1);
+		LARGE_INTEGER fileSize;
+		GetFileSizeEx(file, &fileSize);
+		bytes = static_cast<usize>(fileSize.QuadPart);
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mapping)
+			data = static_cast<const std::byte*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+#else
+		fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			exitWithMsg("File not found " + path, -1);
+		struct stat st;
+		fstat(fd, &st);
+		bytes = static_cast<usize>(st.st_size);
+		void* ptr = bytes ? mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+		if (ptr != MAP_FAILED)
+			data = static_cast<const std::byte*>(ptr);
+#endif
+		if (!data)
+			exitWithMsg("Failed to map " + path, -1);
+
+		if (bytes < sizeof(weightfile::Header) || header().magic != WEIGHTS_MAGIC || header().version != 3)
+			exitWithMsg(path + " is not a version 3 weights file", -1);
+		validate();
+
+		const usize tableBytes = numLayers() * sizeof(weightfile::LayerEntry);
+		const std::byte* table = data + sizeof(weightfile::Header);
+		if (verifyChecksum && (weightfile::checksum(data + header().dataOffset, bytes - header().dataOffset) != header().checksum
+							   || (header().tableChecksum && weightfile::checksum(table, tableBytes) != header().tableChecksum)))
+			exitWithMsg("Weights file checksum mismatch: " + path, -1);
+	}
+
+	MappedWeights(const MappedWeights&) = delete;
+	MappedWeights& operator=(const MappedWeights&) = delete;
+
+	~MappedWeights() {
+#ifdef _WIN32
+		if (data)
+			UnmapViewOfFile(data);
+		if (mapping)
+			CloseHandle(mapping);
+		CloseHandle(file);
+#else
+		if (data)
+			munmap(const_cast<std::byte*>(data), bytes);
+		close(fd);
+#endif
+	}
+
+	const weightfile::Header& header() const { return *reinterpret_cast<const weightfile::Header*>(data); }
+	usize numLayers() const { return header().numLayers; }
+
+	const weightfile::LayerEntry& entry(usize l) const {
+		assert(l < numLayers());
+		return reinterpret_cast<const weightfile::LayerEntry*>(data + sizeof(weightfile::Header))[l];
+	}
+
+	bool hasBlock(usize l, weightfile::Block block) const { return entry(l).blocks[block].rows > 0; }
+
+	kernels::MatrixView matrix(usize l, weightfile::Block block) const {
+		const weightfile::BlockRef& ref = entry(l).blocks[block];
+		return { reinterpret_cast<const float*>(data + ref.offset), ref.rows, ref.cols, ref.stride };
+	}
+
+	template<typename T>
+	std::span<const T> array(usize l, weightfile::Block block) const {
+		const weightfile::BlockRef& ref = entry(l).blocks[block];
+		return { reinterpret_cast<const T*>(data + ref.offset), ref.cols };
+	}
+
+	// Layer l without weights or activation buffers, enough to compile an ExecutionPlan from
+	Layer shape(usize l) const {
+		const weightfile::LayerEntry& e = entry(l);
+		Layer layer;
+		layer.size = e.size;
+		layer.activation = static_cast<Activation>(e.activation);
+		layer.type = static_cast<LayerType>(e.type);
+		layer.channels = e.channels;
+		layer.height = e.height;
+		layer.width = e.width;
+		layer.kernelSize = e.kernelSize;
+		layer.stride = e.stride;
+		layer.padding = e.padding;
+		layer.rank = e.rank;
+		return layer;
+	}
+
+	// The arrays are checked against each other, so the matrix never indexes past them
+	BlockSparseMatrix sparseWeights(usize l) const {
+		BlockSparseMatrix m;
+		m.rows = entry(l).size;
+		m.cols = entry(l - 1).size;
+		m.blockRows = entry(l).blockRows;
+		m.blockCols = entry(l).blockCols;
+		const auto copy = [&]<typename T>(vector<T>& dest, weightfile::Block block) {
+			const std::span<const T> src = array<T>(l, block);
+			dest.assign(src.begin(), src.end());
+		};
+		copy.template operator()<u32>(m.rowPtr, weightfile::ROW_PTR);
+		copy.template operator()<u32>(m.blockIdx, weightfile::BLOCK_IDX);
+		copy.template operator()<float>(m.values, weightfile::BLOCK_VALUES);
+
+		bool valid = m.blockRows > 0 && m.blockCols > 0 && m.rowPtr.size() == m.numBlockRows() + 1 && m.rowPtr.front() == 0
+			&& m.rowPtr.back() == m.blockIdx.size() && m.values.size() == m.blockIdx.size() * m.blockRows * m.blockCols;
+		for (usize r = 0; valid && r + 1 < m.rowPtr.size(); r++)
+			valid = m.rowPtr[r] <= m.rowPtr[r + 1];
+		for (usize i = 0; valid && i < m.blockIdx.size(); i++)
+			valid = m.blockIdx[i] < m.numBlockCols();
+		if (!valid)
+			exitWithMsg("Layer " + std::to_string(l) + " of " + path + " has a corrupt block sparse matrix", -1);
+		return m;
+	}
+
+	// Copies the weights into a trainable Network
+	Network toNetwork() const {
+		vector<Layer> layers;
+		for (usize l = 0; l < numLayers(); l++) {
+			const Layer s = shape(l);
+			if (l == 0) {
+				Layer input(InputLayer(s.size));
+				input.channels = s.channels;
+				input.height = s.height;
+				input.width = s.width;
+				layers.push_back(std::move(input));
+				continue;
+			}
+
+			Layer layer;
+			switch (s.type) {
+			case CONV2D:   layer = Layer::conv2D(s.channels, s.kernelSize, s.activation, s.stride, s.padding); break;
+			case MAX_POOL:
+			case AVG_POOL: layer = Layer::pool(s.type, s.kernelSize, s.stride); break;
+			case FACTORIZED: layer = Layer::factorized(s.size, s.rank, s.activation); break;
+			default:       layer = Layer(s.size, s.activation);
+			}
+
+			if (s.type == BLOCK_SPARSE) {
+				layer.type = BLOCK_SPARSE;
+				layer.sparseWeights = sparseWeights(l);
+			}
+			else {
+				layer.init(layers[l - 1]);
+				if (layer.size != s.size)
+					exitWithMsg("Layer " + std::to_string(l) + " of " + path + " does not match the shape of the previous layer", -1);
+
+				for (usize r = 0; r < layer.weights.size(); r++) {
+					const bool up = s.type == FACTORIZED && r >= s.rank;
+					const kernels::MatrixView m = matrix(l, up ? weightfile::UP_WEIGHTS : weightfile::WEIGHTS);
+					const usize rows = up ? layer.size : s.type == FACTORIZED ? s.rank : layer.weights.size();
+					if (m.rows != rows || m.cols != layer.weights[r].size())
+						exitWithMsg("Layer " + std::to_string(l) + " of " + path + " has weights of the wrong shape", -1);
+					const float* row = m[up ? r - s.rank : r];
+					std::copy(row, row + m.cols, layer.weights[r].begin());
+				}
+			}
+
+			const std::span<const float> biases = array<float>(l, weightfile::BIASES);
+			if (biases.size() != layer.biases.size())
+				exitWithMsg("Layer " + std::to_string(l) + " of " + path + " has biases of the wrong shape", -1);
+			std::copy(biases.begin(), biases.end(), layer.biases.begin());
+
+			layers.push_back(std::move(layer));
+		}
+		return Network(layers);
+	}
+
+  private:
+	// Checks that the layer table and every block lie inside the file, so no view handed out reads past the mapping
+	void validate() const {
+		using namespace weightfile;
+		const Header& h = header();
+		const usize maxLayers = (bytes - sizeof(Header)) / sizeof(LayerEntry);
+		if (h.layerEntryBytes != sizeof(LayerEntry) || h.fileBytes != bytes || h.numLayers == 0 || h.numLayers > maxLayers
+			|| h.dataOffset < sizeof(Header) + h.numLayers * sizeof(LayerEntry) || h.dataOffset > bytes)
+			exitWithMsg("Weights file is truncated or corrupt: " + path, -1);
+
+		for (usize l = 0; l < numLayers(); l++) {
+			const LayerEntry& e = entry(l);
+			// The input layer's activation and type are not used
+			if (l > 0 && (e.activation < 0 || e.activation >= NUM_ACTIVATIONS || e.type < 0 || e.type >= NUM_LAYER_TYPES))
+				exitWithMsg("Layer " + std::to_string(l) + " of " + path + " has an unknown type or activation", -1);
+
+			// Every block holds 4 byte elements, floats or u32 indices
+			for (usize b = 0; b < NUM_BLOCKS; b++) {
+				const BlockRef& ref = e.blocks[b];
+				if (ref.rows == 0)
+					continue;
+				const bool inside = ref.offset >= h.dataOffset && ref.offset <= bytes && ref.offset % ALIGNMENT == 0
+					&& ref.cols <= ref.stride && ref.stride <= bytes / 4 && (ref.stride == 0 || ref.rows <= (bytes - ref.offset) / (ref.stride * 4));
+				if (!inside)
+					exitWithMsg("Layer " + std::to_string(l) + " of " + path + " has a block outside the file", -1);
+			}
+		}
+	}
+
+	string path;
+	const std::byte* data = nullptr;
+	usize bytes = 0;
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+#else
+	int fd = -1;
+#endif
+};
+
 static inline Network loadWeights(const string path) {
     std::vector<Layer> layers;
     std::ifstream file(path, std::ios::binary);
@@ -37,35 +392,98 @@ static inline Network loadWeights(const string path) {
         file.read(reinterpret_cast<char*>(ptr), size);
     };
 
+    u64 magic;
+    u32 version = 0;
+    read(&magic, sizeof(u64));
+    if (magic == WEIGHTS_MAGIC)
+        read(&version, sizeof(u32));
+    else
+        file.seekg(0);
+
+    if (version > WEIGHTS_VERSION)
+        exitWithMsg("Unsupported weights file version " + std::to_string(version) + " in " + path, -1);
+
+    if (version == 3) {
+        file.close();
+        return MappedWeights(path, true).toNetwork();
+    }
+
     usize numLayers;
     read(&numLayers, sizeof(usize));
 
     for (usize i = 0; i < numLayers; ++i) {
         usize lSize;
         Activation lAct;
+        LayerType lType = DENSE;
         read(&lSize, sizeof(usize));
         read(&lAct, sizeof(Activation));
+        if (version >= 1)
+            read(&lType, sizeof(LayerType));
 
         Layer layer(lSize, lAct);
 
-        if (i > 0) {
+        if (version >= 2) {
+            read(&layer.channels, sizeof(usize));
+            read(&layer.height, sizeof(usize));
+            read(&layer.width, sizeof(usize));
+        }
+
+        if (lType == CONV2D || lType == MAX_POOL || lType == AVG_POOL) {
+            usize kernelSize, stride, padding;
+            read(&kernelSize, sizeof(usize));
+            read(&stride, sizeof(usize));
+            read(&padding, sizeof(usize));
+
+            layer = lType == CONV2D ? Layer::conv2D(layer.channels, kernelSize, lAct, stride, padding) : Layer::pool(lType, kernelSize, stride);
             layer.init(layers[i - 1]);
+            if (layer.size != lSize)
+                exitWithMsg("Layer " + std::to_string(i) + " of " + path + " does not match the shape of the previous layer", -1);
 
-            // Read weights
-            for (auto& weights : layer.weights) {
-                for (float& f : weights) {
-                    read(&f, sizeof(float));
+            for (auto& weights : layer.weights)
+                read(weights.data(), weights.size() * sizeof(float));
+            read(layer.biases.data(), layer.biases.size() * sizeof(float));
+        }
+        else if (i > 0) {
+            if (lType == BLOCK_SPARSE) {
+                BlockSparseMatrix& m = layer.sparseWeights;
+                usize numBlocks;
+                read(&m.blockRows, sizeof(usize));
+                read(&m.blockCols, sizeof(usize));
+                read(&numBlocks, sizeof(usize));
+
+                m.rows = lSize;
+                m.cols = layers[i - 1].size;
+                m.rowPtr.resize(m.numBlockRows() + 1);
+                m.blockIdx.resize(numBlocks);
+                m.values.resize(numBlocks * m.blockRows * m.blockCols);
+                read(m.rowPtr.data(), m.rowPtr.size() * sizeof(u32));
+                read(m.blockIdx.data(), m.blockIdx.size() * sizeof(u32));
+                read(m.values.data(), m.values.size() * sizeof(float));
+
+                layer.type = BLOCK_SPARSE;
+            }
+            else {
+                if (lType == FACTORIZED) {
+                    layer = Layer::factorized(lSize, 0, lAct);
+                    read(&layer.rank, sizeof(usize));
+                    layer.bottleneck.resize(layer.rank);
                 }
+                layer.init(layers[i - 1]);
+
+                // Read weights
+                for (auto& weights : layer.weights)
+                    read(weights.data(), weights.size() * sizeof(float));
             }
 
             // Read biases
-            for (float& bias : layer.biases) {
-                read(&bias, sizeof(float));
-            }
+            read(layer.biases.data(), layer.biases.size() * sizeof(float));
         }
 
         layers.push_back(std::move(layer));
     }
 
+    if (!file)
+        exitWithMsg("Weights file is truncated: " + path, -1);
+
     return Network(layers);
-}
\ No newline at end of file
+}
@@ -0,0 +1,287 @@
+#pragma once
+
+#include "types.h"
+
+#include <limits>
+
+// Layer kernels specialized at compile time on the activation, which is applied as the
+// epilogue of the forward product and as the prologue of the backward product
+namespace kernels {
+    // Row major matrix in memory owned elsewhere, consecutive rows are stride floats apart
+    struct MatrixView {
+        const float* data = nullptr;
+        usize rows = 0;
+        usize cols = 0;
+        usize stride = 0;
+
+        const float* operator[](usize row) const { return data + row * stride; }
+    };
+
+    // Geometry of a CONV2D or pooling layer and of its [channel][y][x] input
+    struct WindowShape {
+        usize inChannels, inHeight, inWidth;
+        usize channels, height, width;
+        usize kernelSize, stride, padding;
+    };
+
+    template<Activation act, MathMode mode>
+    inline float activate(float x) {
+        using namespace activations;
+        constexpr bool fast = mode == FAST_MATH;
+
+        if constexpr (act == TANH)          return fast ? fastmath::tanh(x) : tanh(x);
+        else if constexpr (act == RELU)     return ReLU(x);
+        else if constexpr (act == CRELU)    return CReLU(x);
+        else if constexpr (act == SCRELU)   return SCReLU(x);
+        else if constexpr (act == SQRELU)   return SQReLU(x);
+        else if constexpr (act == SIGMOID)  return fast ? fastmath::sigmoid(x) : sigmoid(x);
+        else if constexpr (act == FSIGMOID) return fsigmoid(x);
+        else if constexpr (act == SOFTPLUS) return fast ? fastmath::softplus(x) : softplus(x);
+        else if constexpr (act == GAUSSIAN) return fast ? fastmath::gaussian(x) : gaussian(x);
+        else                                return x;
+    }
+
+    template<Activation act, MathMode mode>
+    inline float derivative(float x, float a) {
+        using namespace activations;
+        constexpr bool fast = mode == FAST_MATH;
+
+        if constexpr (act == TANH)          return dtanh(x, a);
+        else if constexpr (act == RELU)     return dReLU(x, a);
+        else if constexpr (act == CRELU)    return dCReLU(x, a);
+        else if constexpr (act == SCRELU)   return dSCReLU(x, a);
+        else if constexpr (act == SQRELU)   return dSQReLU(x, a);
+        else if constexpr (act == SIGMOID)  return dsigmoid(x, a);
+        else if constexpr (act == FSIGMOID) return dfsigmoid(x, a);
+        else if constexpr (act == SOFTPLUS) return fast ? fastmath::sigmoid(x) : dsoftplus(x, a);
+        else if constexpr (act == GAUSSIAN) return dgaussian(x, a);
+        else                                return 1;
+    }
+
+    // Calls func.template operator()<act, mode>() so that a layer branches on its activation once.
+    // SOFTMAX is not elementwise and has to be handled by the caller
+    template<typename F>
+    inline void dispatch(Activation act, MathMode mode, F&& func) {
+        const auto withMode = [&]<Activation kAct>() {
+            if (mode == FAST_MATH)
+                func.template operator()<kAct, FAST_MATH>();
+            else
+                func.template operator()<kAct, EXACT_MATH>();
+        };
+
+        switch (act) {
+        case TANH:          withMode.template operator()<TANH>(); break;
+        case RELU:          withMode.template operator()<RELU>(); break;
+        case CRELU:         withMode.template operator()<CRELU>(); break;
+        case SCRELU:        withMode.template operator()<SCRELU>(); break;
+        case SQRELU:        withMode.template operator()<SQRELU>(); break;
+        case SIGMOID:       withMode.template operator()<SIGMOID>(); break;
+        case FSIGMOID:      withMode.template operator()<FSIGMOID>(); break;
+        case SOFTPLUS:      withMode.template operator()<SOFTPLUS>(); break;
+        case GAUSSIAN:      withMode.template operator()<GAUSSIAN>(); break;
+        case NO_ACTIVATION: withMode.template operator()<NO_ACTIVATION>(); break;
+        default: exitWithMsg("Activation has no elementwise kernel: " + activNames[act], -1);
+        }
+    }
+
+    // out[i] = act(pre[i])
+    template<Activation act, MathMode mode>
+    inline void activate(const float* pre, float* out, usize size) {
+        for (usize i = 0; i < size; i++)
+            out[i] = activate<act, mode>(pre[i]);
+    }
+
+    // grad[i] *= act'(pre[i])
+    template<Activation act, MathMode mode>
+    inline void applyDerivative(const float* pre, const float* activated, float* grad, usize size) {
+        for (usize i = 0; i < size; i++)
+            grad[i] *= derivative<act, mode>(pre[i], activated[i]);
+    }
+
+    // Numerically stable softmax, in and out may alias
+    template<MathMode mode>
+    inline void softmax(const float* in, float* out, usize size) {
+        float maxIn = in[0];
+        for (usize i = 1; i < size; i++)
+            maxIn = std::max(maxIn, in[i]);
+
+        float sum = 0;
+        for (usize i = 0; i < size; i++) {
+            out[i] = mode == FAST_MATH ? fastmath::exp(in[i] - maxIn) : std::exp(in[i] - maxIn);
+            sum += out[i];
+        }
+        for (usize i = 0; i < size; i++)
+            out[i] /= sum;
+    }
+
+    // pre = W in + b and out = act(pre), one row at a time. Weights may be any type whose
+    // rows are indexable, such as MultiVector<float, 2>
+    template<Activation act, MathMode mode, typename Weights>
+    inline void dense(const Weights& weights, const float* biases, const float* in, usize inSize, float* pre, float* out, usize outSize) {
+        for (usize curr = 0; curr < outSize; curr++) {
+            const float* row = &weights[curr][0];
+            float sum = 0;
+            #pragma omp simd reduction(+:sum)
+            for (usize prev = 0; prev < inSize; prev++)
+                sum += row[prev] * in[prev];
+
+            pre[curr] = biases[curr] + sum;
+            out[curr] = activate<act, mode>(pre[curr]);
+        }
+    }
+
+    // dense() for count samples whose inputs and outputs are inStride and outStride floats apart. Each
+    // weight row is loaded once per group of four samples and applied to the whole batch while in cache
+    template<Activation act, MathMode mode, typename Weights>
+    inline void denseBatch(const Weights& weights, const float* biases, const float* in, usize inStride, usize inSize,
+                           float* pre, float* out, usize outStride, usize outSize, usize count) {
+        const auto store = [&](usize b, usize curr, float sum) {
+            const float z = biases[curr] + sum;
+            pre[b * outStride + curr] = z;
+            out[b * outStride + curr] = activate<act, mode>(z);
+        };
+
+        for (usize curr = 0; curr < outSize; curr++) {
+            const float* row = &weights[curr][0];
+            usize b = 0;
+            for (; b + 4 <= count; b += 4) {
+                const float* x0 = in + b * inStride;
+                const float* x1 = x0 + inStride;
+                const float* x2 = x1 + inStride;
+                const float* x3 = x2 + inStride;
+                float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+                #pragma omp simd reduction(+:s0, s1, s2, s3)
+                for (usize prev = 0; prev < inSize; prev++) {
+                    const float w = row[prev];
+                    s0 += w * x0[prev];
+                    s1 += w * x1[prev];
+                    s2 += w * x2[prev];
+                    s3 += w * x3[prev];
+                }
+                store(b, curr, s0);
+                store(b + 1, curr, s1);
+                store(b + 2, curr, s2);
+                store(b + 3, curr, s3);
+            }
+            for (; b < count; b++) {
+                const float* x = in + b * inStride;
+                float sum = 0;
+                #pragma omp simd reduction(+:sum)
+                for (usize prev = 0; prev < inSize; prev++)
+                    sum += row[prev] * x[prev];
+                store(b, curr, sum);
+            }
+        }
+    }
+
+    // dense() for a sparse input, only the columns of the active features are read
+    template<Activation act, MathMode mode, typename Weights>
+    inline void dense(const Weights& weights, const float* biases, const SparseInput& in, float* pre, float* out, usize outSize) {
+        for (usize curr = 0; curr < outSize; curr++) {
+            const float* row = &weights[curr][0];
+            float sum = biases[curr];
+            for (usize idx = 0; idx < in.indices.size(); idx++)
+                sum += in.value(idx) * row[in.indices[idx]];
+
+            pre[curr] = sum;
+            out[curr] = activate<act, mode>(sum);
+        }
+    }
+
+    // dense() with the weights stored transposed, indexed [prevLayerNeuron][currNeuron]. Each input adds a
+    // scaled column, which vectorizes over the outputs when the input is too short for row dot products
+    template<Activation act, MathMode mode, typename Columns>
+    inline void denseColumns(const Columns& columns, const float* biases, const float* in, usize inSize, float* pre, float* out, usize outSize) {
+        std::copy(biases, biases + outSize, pre);
+        for (usize prev = 0; prev < inSize; prev++) {
+            const float x = in[prev];
+            if (x == 0)
+                continue;
+            const float* col = &columns[prev][0];
+            #pragma omp simd
+            for (usize curr = 0; curr < outSize; curr++)
+                pre[curr] += x * col[curr];
+        }
+        activate<act, mode>(pre, out, outSize);
+    }
+
+    // denseColumns() for a sparse input, the columns of the active features are contiguous
+    template<Activation act, MathMode mode, typename Columns>
+    inline void denseColumns(const Columns& columns, const float* biases, const SparseInput& in, float* pre, float* out, usize outSize) {
+        std::copy(biases, biases + outSize, pre);
+        for (usize idx = 0; idx < in.indices.size(); idx++) {
+            const float x = in.value(idx);
+            const float* col = &columns[in.indices[idx]][0];
+            #pragma omp simd
+            for (usize curr = 0; curr < outSize; curr++)
+                pre[curr] += x * col[curr];
+        }
+        activate<act, mode>(pre, out, outSize);
+    }
+
+    // Direct convolution without an im2col buffer. Weights are indexed [outChannel][inChannel][y][x],
+    // the in bounds range of each kernel offset is computed up front so the inner loop has no branches
+    template<typename Weights>
+    inline void conv2D(const Weights& weights, const float* biases, const float* in, float* out, const WindowShape& s) {
+        const i64 pad = s.padding;
+        for (usize oc = 0; oc < s.channels; oc++) {
+            float* outChannel = out + oc * s.height * s.width;
+            std::fill(outChannel, outChannel + s.height * s.width, biases[oc]);
+            const float* w = &weights[oc][0];
+
+            for (usize ic = 0; ic < s.inChannels; ic++)
+                for (usize ky = 0; ky < s.kernelSize; ky++)
+                    for (usize kx = 0; kx < s.kernelSize; kx++) {
+                        const float weight = w[(ic * s.kernelSize + ky) * s.kernelSize + kx];
+                        const i64 shift = static_cast<i64>(kx) - pad;
+                        const i64 stride = s.stride;
+                        // Outputs whose input column ox * stride + shift lies in [0, inWidth)
+                        const usize oxBegin = shift >= 0 ? 0 : static_cast<usize>((-shift + stride - 1) / stride);
+                        const usize oxEnd = std::min<i64>(s.width, std::max<i64>(0, (static_cast<i64>(s.inWidth) - shift + stride - 1) / stride));
+
+                        for (usize oy = 0; oy < s.height; oy++) {
+                            const i64 iy = static_cast<i64>(oy * s.stride + ky) - pad;
+                            if (iy < 0 || iy >= static_cast<i64>(s.inHeight))
+                                continue;
+                            const float* inRow = in + (ic * s.inHeight + iy) * s.inWidth;
+                            float* outRow = outChannel + oy * s.width;
+                            for (usize ox = oxBegin; ox < oxEnd; ox++)
+                                outRow[ox] += weight * inRow[ox * s.stride + shift];
+                        }
+                    }
+        }
+    }
+
+    // Max or average pooling of each channel, windows never overlap the edges
+    template<bool kMax>
+    inline void pool(const float* in, float* out, const WindowShape& s) {
+        for (usize c = 0; c < s.channels; c++)
+            for (usize oy = 0; oy < s.height; oy++)
+                for (usize ox = 0; ox < s.width; ox++) {
+                    float result = kMax ? -std::numeric_limits<float>::infinity() : 0;
+                    for (usize ky = 0; ky < s.kernelSize; ky++) {
+                        const float* inRow = in + (c * s.inHeight + oy * s.stride + ky) * s.inWidth + ox * s.stride;
+                        for (usize kx = 0; kx < s.kernelSize; kx++)
+                            result = kMax ? std::max(result, inRow[kx]) : result + inRow[kx];
+                    }
+                    out[(c * s.height + oy) * s.width + ox] = kMax ? result : result / (s.kernelSize * s.kernelSize);
+                }
+    }
+
+    // Turns the gradient with respect to the activations into one with respect to the pre-activations
+    // (the prologue) and adds its product with W transposed to prevGrad when it is non null
+    template<Activation act, MathMode mode, typename Weights>
+    inline void denseBackward(const Weights& weights, const float* pre, const float* activated, float* grad, usize outSize, float* prevGrad, usize inSize) {
+        for (usize curr = 0; curr < outSize; curr++) {
+            const float g = grad[curr] * derivative<act, mode>(pre[curr], activated[curr]);
+            grad[curr] = g;
+
+            if (prevGrad) {
+                const float* row = &weights[curr][0];
+                #pragma omp simd
+                for (usize prev = 0; prev < inSize; prev++)
+                    prevGrad[prev] += g * row[prev];
+            }
+        }
+    }
+}
@@ -1,14 +1,41 @@
 #pragma once
 
-#include "types.h"
+#include "kernels.h"
+#include "sparse.h"
+
+#include <limits>
 
 struct Layer {
-	MultiVector<float, 2> weights; // Indexed [currNeuron][prevLayerNeuron]
+	// Indexed [currNeuron][prevLayerNeuron]. In FACTORIZED layers the first rank rows hold the
+	// [rank][prevLayerNeuron] down projection and the remaining size rows the [currNeuron][rank] up projection
+	MultiVector<float, 2> weights;
 	vector<float> biases;
 
 	vector<float> preActivation;
 	vector<float> activated;
 
+	// Only used by an input layer loaded from a SparseInput, activated is left empty
+	SparseInput sparseActivated;
+	bool sparse = false;
+
+	LayerType type = DENSE;
+	BlockSparseMatrix sparseWeights; // Replaces weights in BLOCK_SPARSE layers
+
+	usize rank = 0;             // Inner dimension of FACTORIZED layers
+	vector<float> bottleneck;   // Down projected input of FACTORIZED layers
+
+	// Activations are laid out [channel][y][x], layers without spatial structure are 1x1 with size channels
+	usize channels = 0;
+	usize height = 1;
+	usize width = 1;
+
+	// Window of CONV2D and pooling layers. CONV2D weights are indexed [outChannel][inChannel][y][x] and biases [outChannel]
+	usize kernelSize = 0;
+	usize stride = 1;
+	usize padding = 0;
+	vector<float> columns;      // im2col unrolled input of CONV2D layers, indexed [inChannel][y][x][outPosition]
+	vector<u32> poolIndices;    // Input index of the maximum of each MAX_POOL output
+
 	Activation activation;
 
 	usize size;
@@ -17,13 +44,22 @@ struct Layer {
 
 	Layer(const InputLayer& from) {
 		size = from.size();
+		channels = size;
 		preActivation = from;
 		activated = from;
 	}
 
+	Layer(const SparseInput& from, usize size) {
+		this->size = size;
+		channels = size;
+		sparseActivated = from;
+		sparse = true;
+	}
+
 	Layer(const usize size, const Activation activation) {
 		this->activation = activation;
 		this->size = size;
+		channels = size;
 
 		biases.resize(size);\
 
@@ -31,19 +67,447 @@ struct Layer {
 		activated.resize(size);
 	}
 
+	// Dense layer stored as the product of two rank sized matrices
+	static Layer factorized(const usize size, const usize rank, const Activation activation) {
+		Layer layer(size, activation);
+		layer.type = FACTORIZED;
+		layer.rank = rank;
+		layer.bottleneck.resize(rank);
+		return layer;
+	}
+
+	// 2D convolution over the [channel][y][x] activations of the previous layer. The output size
+	// is only known once the layer is initialized after the previous one
+	static Layer conv2D(const usize channels, const usize kernelSize, const Activation activation, const usize stride = 1, const usize padding = 0) {
+		Layer layer;
+		layer.type = CONV2D;
+		layer.activation = activation;
+		layer.channels = channels;
+		layer.kernelSize = kernelSize;
+		layer.stride = stride;
+		layer.padding = padding;
+		layer.biases.resize(channels);
+		return layer;
+	}
+
+	// Pools each channel over kernelSize x kernelSize windows, stride defaults to the window size
+	static Layer pool(const LayerType type, const usize kernelSize, const usize stride = 0) {
+		assert(type == MAX_POOL || type == AVG_POOL);
+		Layer layer;
+		layer.type = type;
+		layer.activation = NO_ACTIVATION;
+		layer.kernelSize = kernelSize;
+		layer.stride = stride ? stride : kernelSize;
+		return layer;
+	}
+
+	static Layer maxPool(const usize kernelSize, const usize stride = 0) { return pool(MAX_POOL, kernelSize, stride); }
+	static Layer avgPool(const usize kernelSize, const usize stride = 0) { return pool(AVG_POOL, kernelSize, stride); }
+
+	// Number of values in the im2col unrolled receptive field of a CONV2D output
+	usize receptiveField(const Layer& previous) const { return previous.channels * kernelSize * kernelSize; }
+
+	kernels::WindowShape window(const Layer& previous) const {
+		return { previous.channels, previous.height, previous.width, channels, height, width, kernelSize, stride, type == CONV2D ? padding : 0 };
+	}
+
+	// Multiply adds of one forward pass counted as two flops each, from the shapes alone
+	u64 forwardFlops(const Layer& previous) const {
+		switch (type) {
+		case DENSE: return 2 * size * previous.size;
+		case FACTORIZED: return 2 * rank * (previous.size + size);
+		case BLOCK_SPARSE: return 2 * sparseWeights.values.size();
+		case CONV2D: return 2 * size * receptiveField(previous);
+		case MAX_POOL:
+		case AVG_POOL: return size * kernelSize * kernelSize;
+		default: return 0;
+		}
+	}
+
 	void init(const Layer& previous) {
+		if (type == CONV2D || type == MAX_POOL || type == AVG_POOL) {
+			const usize pad = type == CONV2D ? padding : 0;
+			if (previous.height + 2 * pad < kernelSize || previous.width + 2 * pad < kernelSize)
+				exitWithMsg("Window of size " + std::to_string(kernelSize) + " does not fit a " + std::to_string(previous.height) + "x" + std::to_string(previous.width) + " input, set the input shape with Network::setInputShape", -1);
+
+			height = (previous.height + 2 * pad - kernelSize) / stride + 1;
+			width = (previous.width + 2 * pad - kernelSize) / stride + 1;
+			if (type != CONV2D)
+				channels = previous.channels;
+			size = channels * height * width;
+
+			preActivation.resize(size);
+			activated.resize(size);
+
+			if (type == CONV2D) {
+				weights.resize(channels);
+				for (vector<float>& w : weights)
+					w.resize(receptiveField(previous));
+				columns.resize(receptiveField(previous) * height * width);
+			}
+			else if (type == MAX_POOL)
+				poolIndices.resize(size);
+			return;
+		}
+
+		if (type == FACTORIZED) {
+			weights.resize(rank + size);
+			for (usize i = 0; i < weights.size(); i++)
+				weights[i].resize(i < rank ? previous.size : rank);
+			return;
+		}
+
 		weights.resize(size);
 		for (vector<float>& w : weights)
 			w.resize(previous.size);
 
 	}
 
-	void forward(const Layer& previous) {
-		preActivation = biases;
-		for (usize curr = 0; curr < preActivation.size(); curr++)
-			for (usize prev = 0; prev < previous.activated.size(); prev++)
-				preActivation[curr] += previous.activated[prev] * weights[curr][prev];
+	// Converts a pruned dense layer to block sparse storage, weights are freed
+	void toBlockSparse(usize blockRows, usize blockCols) {
+		assert(type == DENSE);
+		sparseWeights = BlockSparseMatrix(weights, blockRows, blockCols);
+		weights = MultiVector<float, 2>();
+		type = BLOCK_SPARSE;
+	}
+
+	// out[curr] += sum over prev of weights[firstRow + curr][prev] * previous activation[prev]
+	static void multiplyAdd(const MultiVector<float, 2>& weights, usize firstRow, const Layer& previous, vector<float>& out) {
+		if (previous.sparse) {
+			// Sum of the weight columns of the active features
+			const SparseInput& input = previous.sparseActivated;
+			for (usize curr = 0; curr < out.size(); curr++)
+				for (usize idx = 0; idx < input.indices.size(); idx++)
+					out[curr] += input.value(idx) * weights[firstRow + curr][input.indices[idx]];
+		}
+		else {
+			for (usize curr = 0; curr < out.size(); curr++)
+				for (usize prev = 0; prev < previous.activated.size(); prev++)
+					out[curr] += previous.activated[prev] * weights[firstRow + curr][prev];
+		}
+	}
+
+	void forward(const Layer& previous, const MathMode mathMode = EXACT_MATH) {
+		// Softmax is not elementwise, it is applied after the kernel has stored the logits
+		const Activation fused = activation == SOFTMAX ? NO_ACTIVATION : activation;
+
+		switch (type) {
+		case DENSE:
+			kernels::dispatch(fused, mathMode, [&]<Activation kAct, MathMode kMode>() {
+				if (previous.sparse)
+					kernels::dense<kAct, kMode>(weights, biases.data(), previous.sparseActivated, preActivation.data(), activated.data(), size);
+				else
+					kernels::dense<kAct, kMode>(weights, biases.data(), previous.activated.data(), previous.activated.size(), preActivation.data(), activated.data(), size);
+			});
+			break;
+		case FACTORIZED:
+			std::fill(bottleneck.begin(), bottleneck.end(), 0);
+			multiplyAdd(weights, 0, previous, bottleneck);
+			kernels::dispatch(fused, mathMode, [&]<Activation kAct, MathMode kMode>() {
+				kernels::dense<kAct, kMode>(&weights[rank], biases.data(), bottleneck.data(), rank, preActivation.data(), activated.data(), size);
+			});
+			break;
+		default:
+			switch (type) {
+			case BLOCK_SPARSE:
+				if (previous.sparse)
+					exitWithMsg("Block sparse layers do not support sparse inputs", -1);
+				preActivation = biases;
+				sparseWeights.multiplyAdd(previous.activated.data(), preActivation.data());
+				break;
+			case CONV2D:
+				convForward(previous);
+				break;
+			case MAX_POOL:
+			case AVG_POOL:
+				poolForward(previous);
+				break;
+			default: exitWithMsg("Unsupported layer type: " + layerTypeNames[type], -1);
+			}
+
+			kernels::dispatch(fused, mathMode, [&]<Activation kAct, MathMode kMode>() {
+				kernels::activate<kAct, kMode>(preActivation.data(), activated.data(), size);
+			});
+		}
+
+		if (activation == SOFTMAX)
+			activated = activations::softmax(preActivation, mathMode);
+	}
+
+	// Const counterpart of forward that leaves the layer untouched. in holds the previous layer's activations,
+	// or sparseIn is set when the previous layer is a sparse input. Only the activations are written to out,
+	// scratch needs rank floats for FACTORIZED layers
+	void infer(const Layer& previous, const float* in, const SparseInput* sparseIn, float* out, float* scratch, const MathMode mathMode = EXACT_MATH) const {
+		const Activation fused = activation == SOFTMAX ? NO_ACTIVATION : activation;
+		if (sparseIn && type != DENSE && type != FACTORIZED)
+			exitWithMsg(layerTypeNames[type] + " layers do not support sparse inputs", -1);
+
+		switch (type) {
+		case DENSE:
+			kernels::dispatch(fused, mathMode, [&]<Activation kAct, MathMode kMode>() {
+				if (sparseIn)
+					kernels::dense<kAct, kMode>(weights, biases.data(), *sparseIn, out, out, size);
+				else
+					kernels::dense<kAct, kMode>(weights, biases.data(), in, previous.size, out, out, size);
+			});
+			break;
+		case FACTORIZED:
+			for (usize k = 0; k < rank; k++) {
+				const float* row = weights[k].data();
+				float sum = 0;
+				if (sparseIn) {
+					for (usize idx = 0; idx < sparseIn->indices.size(); idx++)
+						sum += sparseIn->value(idx) * row[sparseIn->indices[idx]];
+				}
+				else {
+					for (usize prev = 0; prev < previous.size; prev++)
+						sum += row[prev] * in[prev];
+				}
+				scratch[k] = sum;
+			}
+			kernels::dispatch(fused, mathMode, [&]<Activation kAct, MathMode kMode>() {
+				kernels::dense<kAct, kMode>(&weights[rank], biases.data(), scratch, rank, out, out, size);
+			});
+			break;
+		default:
+			switch (type) {
+			case BLOCK_SPARSE:
+				std::copy(biases.begin(), biases.end(), out);
+				sparseWeights.multiplyAdd(in, out);
+				break;
+			case CONV2D:
+				kernels::conv2D(weights, biases.data(), in, out, window(previous));
+				break;
+			case MAX_POOL:
+				kernels::pool<true>(in, out, window(previous));
+				break;
+			case AVG_POOL:
+				kernels::pool<false>(in, out, window(previous));
+				break;
+			default: exitWithMsg("Unsupported layer type: " + layerTypeNames[type], -1);
+			}
+
+			kernels::dispatch(fused, mathMode, [&]<Activation kAct, MathMode kMode>() {
+				kernels::activate<kAct, kMode>(out, out, size);
+			});
+		}
+
+		if (activation == SOFTMAX) {
+			if (mathMode == FAST_MATH)
+				kernels::softmax<FAST_MATH>(out, out, size);
+			else
+				kernels::softmax<EXACT_MATH>(out, out, size);
+		}
+	}
+
+	// Calls func(inIdx, colIdx) for every in bounds element of the receptive fields of a CONV2D or pooling layer,
+	// where colIdx indexes [inChannel][y][x][outPosition] im2col layout
+	template<typename F>
+	void forEachWindowElement(const Layer& previous, usize pad, F&& func) const {
+		const usize positions = height * width;
+		for (usize c = 0; c < previous.channels; c++)
+			for (usize ky = 0; ky < kernelSize; ky++)
+				for (usize kx = 0; kx < kernelSize; kx++) {
+					const usize row = (c * kernelSize + ky) * kernelSize + kx;
+					for (usize oy = 0; oy < height; oy++) {
+						const i64 iy = static_cast<i64>(oy * stride + ky) - static_cast<i64>(pad);
+						if (iy < 0 || iy >= static_cast<i64>(previous.height))
+							continue;
+						for (usize ox = 0; ox < width; ox++) {
+							const i64 ix = static_cast<i64>(ox * stride + kx) - static_cast<i64>(pad);
+							if (ix < 0 || ix >= static_cast<i64>(previous.width))
+								continue;
+							func((c * previous.height + iy) * previous.width + ix, row * positions + oy * width + ox);
+						}
+					}
+				}
+	}
+
+	// im2col followed by a [outChannel][receptiveField] x [receptiveField][outPosition] matrix product
+	void convForward(const Layer& previous) {
+		if (previous.sparse)
+			exitWithMsg("CONV2D layers do not support sparse inputs", -1);
+
+		std::fill(columns.begin(), columns.end(), 0);
+		forEachWindowElement(previous, padding, [&](usize inIdx, usize colIdx) { columns[colIdx] = previous.activated[inIdx]; });
+
+		const usize positions = height * width;
+		for (usize oc = 0; oc < channels; oc++) {
+			float* out = &preActivation[oc * positions];
+			std::fill(out, out + positions, biases[oc]);
+			for (usize row = 0; row < weights[oc].size(); row++) {
+				const float w = weights[oc][row];
+				const float* col = &columns[row * positions];
+				for (usize p = 0; p < positions; p++)
+					out[p] += w * col[p];
+			}
+		}
+	}
+
+	void poolForward(const Layer& previous) {
+		if (previous.sparse)
+			exitWithMsg("Pooling layers do not support sparse inputs", -1);
+
+		for (usize c = 0; c < channels; c++)
+			for (usize oy = 0; oy < height; oy++)
+				for (usize ox = 0; ox < width; ox++) {
+					const usize out = (c * height + oy) * width + ox;
+					float result = type == MAX_POOL ? -std::numeric_limits<float>::infinity() : 0;
+					for (usize ky = 0; ky < kernelSize; ky++)
+						for (usize kx = 0; kx < kernelSize; kx++) {
+							const usize in = (c * previous.height + oy * stride + ky) * previous.width + ox * stride + kx;
+							if (type == AVG_POOL)
+								result += previous.activated[in];
+							else if (previous.activated[in] > result) {
+								result = previous.activated[in];
+								poolIndices[out] = in;
+							}
+						}
+					preActivation[out] = type == AVG_POOL ? result / (kernelSize * kernelSize) : result;
+				}
+	}
+
+	// Gradient with respect to the down projected input of a FACTORIZED layer
+	Gradient bottleneckGradient(const Gradient& grad) const {
+		Gradient bottleneckGrad(rank);
+		for (usize curr = 0; curr < size; curr++)
+			for (usize k = 0; k < rank; k++)
+				bottleneckGrad[k] += grad[curr] * weights[rank + curr][k];
+		return bottleneckGrad;
+	}
+
+	// With applyDerivative set, first turns grad from the gradient with respect to this layer's activations
+	// into the one with respect to its pre-activations. Then writes the gradient with respect to the
+	// previous layer's activations into prevGrad if it is non null
+	void backward(const Layer& previous, Gradient& grad, Gradient* prevGrad, const bool applyDerivative, const MathMode mathMode = EXACT_MATH) const {
+		if (applyDerivative && activation == SOFTMAX)
+			exitWithMsg("Unsupported activation on non-output layer: " + activNames[activation], -1);
+		const Activation act = applyDerivative ? activation : NO_ACTIVATION;
+
+		if (prevGrad)
+			std::fill(prevGrad->begin(), prevGrad->end(), 0);
+
+		if (type == DENSE) {
+			// The derivative is fused into the product with the transposed weights
+			kernels::dispatch(act, mathMode, [&]<Activation kAct, MathMode kMode>() {
+				kernels::denseBackward<kAct, kMode>(weights, preActivation.data(), activated.data(), grad.data(), size, prevGrad ? prevGrad->data() : nullptr, prevGrad ? prevGrad->size() : 0);
+			});
+			return;
+		}
+
+		if (applyDerivative) {
+			kernels::dispatch(act, mathMode, [&]<Activation kAct, MathMode kMode>() {
+				kernels::applyDerivative<kAct, kMode>(preActivation.data(), activated.data(), grad.data(), size);
+			});
+		}
+
+		if (!prevGrad)
+			return;
+
+		Gradient& prev = *prevGrad;
+		switch (type) {
+		case FACTORIZED: {
+			const Gradient bottleneckGrad = bottleneckGradient(grad);
+			for (usize k = 0; k < rank; k++)
+				for (usize j = 0; j < prev.size(); j++)
+					prev[j] += bottleneckGrad[k] * weights[k][j];
+			break;
+		}
+		case CONV2D: {
+			// Gradient with respect to the unrolled input, folded back with col2im
+			const usize positions = height * width;
+			vector<float> columnGrad(columns.size());
+			for (usize oc = 0; oc < channels; oc++) {
+				const float* g = &grad[oc * positions];
+				for (usize row = 0; row < weights[oc].size(); row++) {
+					const float w = weights[oc][row];
+					float* colGrad = &columnGrad[row * positions];
+					for (usize p = 0; p < positions; p++)
+						colGrad[p] += w * g[p];
+				}
+			}
+			forEachWindowElement(previous, padding, [&](usize inIdx, usize colIdx) { prev[inIdx] += columnGrad[colIdx]; });
+			break;
+		}
+		case MAX_POOL:
+			for (usize out = 0; out < size; out++)
+				prev[poolIndices[out]] += grad[out];
+			break;
+		case AVG_POOL: {
+			const float scale = 1.0f / (kernelSize * kernelSize);
+			for (usize c = 0; c < channels; c++)
+				for (usize oy = 0; oy < height; oy++)
+					for (usize ox = 0; ox < width; ox++) {
+						const float g = grad[(c * height + oy) * width + ox] * scale;
+						for (usize ky = 0; ky < kernelSize; ky++)
+							for (usize kx = 0; kx < kernelSize; kx++)
+								prev[(c * previous.height + oy * stride + ky) * previous.width + ox * stride + kx] += g;
+					}
+			break;
+		}
+		default: exitWithMsg("Unsupported layer type for training: " + layerTypeNames[type], -1);
+		}
+	}
+
+	// Adds the weight and bias gradients of one sample to the given accumulators. A dense input is added in
+	// tiles of columnTile columns, each one to every row while that part of the input is in L1, 0 for whole rows
+	void accumulate(const Layer& previous, const Gradient& grad, MultiVector<float, 2>& weightGrad, vector<float>& biasGrad, usize columnTile = 0) const {
+		const auto outerProduct = [&](const vector<float>& g, usize firstRow) {
+			if (previous.sparse) {
+				// Only the columns of active features have a nonzero gradient
+				const SparseInput& input = previous.sparseActivated;
+				for (usize i = 0; i < g.size(); i++) {
+					vector<float>& row = weightGrad[firstRow + i];
+					for (usize idx = 0; idx < input.indices.size(); idx++)
+						row[input.indices[idx]] += g[i] * input.value(idx);
+				}
+				return;
+			}
+
+			const usize tile = columnTile ? columnTile : previous.size;
+			for (usize first = 0; first < previous.size; first += tile) {
+				const usize last = std::min(previous.size, first + tile);
+				for (usize i = 0; i < g.size(); i++) {
+					vector<float>& row = weightGrad[firstRow + i];
+					for (usize j = first; j < last; j++)
+						row[j] += g[i] * previous.activated[j];
+				}
+			}
+		};
+
+		switch (type) {
+		case DENSE:
+			outerProduct(grad, 0);
+			break;
+		case FACTORIZED:
+			for (usize curr = 0; curr < size; curr++)
+				for (usize k = 0; k < rank; k++)
+					weightGrad[rank + curr][k] += grad[curr] * bottleneck[k];
+			outerProduct(bottleneckGradient(grad), 0);
+			break;
+		case CONV2D: {
+			const usize positions = height * width;
+			for (usize oc = 0; oc < channels; oc++) {
+				const float* g = &grad[oc * positions];
+				for (usize row = 0; row < weightGrad[oc].size(); row++) {
+					const float* col = &columns[row * positions];
+					float sum = 0;
+					for (usize p = 0; p < positions; p++)
+						sum += g[p] * col[p];
+					weightGrad[oc][row] += sum;
+				}
+				for (usize p = 0; p < positions; p++)
+					biasGrad[oc] += g[p];
+			}
+			return;
+		}
+		case MAX_POOL:
+		case AVG_POOL:
+			return;
+		default: exitWithMsg("Unsupported layer type for training: " + layerTypeNames[type], -1);
+		}
 
-		activated = activations::activate(activation, preActivation);
+		for (usize i = 0; i < size; i++)
+			biasGrad[i] += grad[i];
 	}
-};
\ No newline at end of file
+};
@@ -5,13 +5,58 @@
 #include "dataloader.h"
 #include "lrschedule.h"
 #include "progbar.h"
+#include "checkpoint.h"
+#include "distributed.h"
+#include "phasetimer.h"
+#include "perfcounters.h"
+#include "threadpool.h"
+#include "numa.h"
+#include "autotune.h"
 #include "optim.h"
+#include "prune.h"
 #include "loss.h"
 
 #include <string_view>
+#include <optional>
+#include <utility>
 #include <numeric>
 #include <mutex>
-#include <omp.h>
+
+// Returns the loss and accuracy of a network on the test set of a data loader, which is recorded in memoryUsage if given
+inline std::pair<float, float> testLossAccuracy(Network& net, DataLoader& dataLoader, Loss lossFunc, MemoryTracker* memoryUsage = nullptr) {
+	float loss = 0;
+	usize numCorrect = 0;
+	dataLoader.loadTestSet();
+	usize testSize = dataLoader.batchData().size();
+	if (memoryUsage)
+		memoryUsage->set(TEST_SET, memory::heapBytes(dataLoader.batchData()));
+	while (dataLoader.hasNext()) {
+		DataPoint data = dataLoader.next();
+		net.load(data);
+		net.forwardPass();
+		loss += getLoss(lossFunc, net.layers.back(), data.target);
+		usize guess = 0, goal = 0;
+		for (usize i = 0; i < data.target.size(); i++) {
+			if (net.layers.back().activated[i] > net.layers.back().activated[guess])
+				guess = i;
+			if (data.target[i] > data.target[goal])
+				goal = i;
+		}
+		numCorrect += (guess == goal);
+	}
+	return std::pair<float, float>{ loss / (testSize ? testSize : 1), numCorrect / static_cast<float>(testSize ? testSize : 1) };
+}
+
+// Gradient of the loss with respect to the output layer's activations, or its pre-activations when the output is a softmax
+inline void outputGradient(Loss lossFunc, const Layer& output, const Target& target, Gradient& grad) {
+	if (fusedSoftmaxCrossEntropy(lossFunc, output))
+		lossFunctions::softmaxCrossEntropyDeriv(output, target, grad);
+	else {
+		grad = lossDeriv(lossFunc, output, target);
+		if (output.activation == SOFTMAX)
+			grad = activations::dsoftmax(grad, output.activated);
+	}
+}
 
 struct Learner {
 	Network& net;
@@ -19,6 +64,55 @@ struct Learner {
 	optimizers::Optimizer& optimizer;
 	Loss lossFunc;
 
+	// Optional gradual pruning, applied after every optimizer step
+	Pruner* pruner = nullptr;
+
+	// Optional periodic checkpoints, see resume() to continue from one
+	Checkpointer* checkpointer = nullptr;
+
+	// Where the next call to learn starts, set by resume()
+	TrainingProgress resumeFrom;
+
+	// Prints where the time of each epoch went after its results
+	bool printPhaseTimes = true;
+
+	// Bytes used by each part of the last training run. learn prints an estimate before it allocates
+	// anything and the tracked usage when it finishes unless printMemory is unset
+	MemoryTracker memoryUsage;
+	bool printMemory = true;
+
+	// Loader batches whose gradients are summed before each optimizer step. The data loader's batchSize is the
+	// micro-batch that is held in memory at once, the effective batch is accumulationSteps times larger
+	usize accumulationSteps = 1;
+
+	// Runs the samples of each batch and is shared with the data loader unless it has its own. If not set
+	// learn creates a pool with its threads argument, with workers pinned to cores if pinThreads is set
+	ThreadPool* pool = nullptr;
+	bool pinThreads = false;
+
+	// Places training on NUMA nodes: workers of a pool learn creates are bound to the CPUs of one node each,
+	// every worker allocates its own replica and accumulators so their pages land on its node, and gradients
+	// are summed within each node before across nodes
+	bool numaAware = false;
+
+	// Samples per task of the pool, 0 for a few tasks per thread, and columns per tile of the weight gradient
+	// outer products, 0 for whole rows. Neither changes the results
+	usize sampleGrain = 0;
+	usize accumulateTile = 0;
+
+	// Optional timed trials when learn starts that pick sampleGrain, accumulateTile and the thread count unless
+	// learn is given one, see Autotuner. Unless the result is cached, the data loader has to implement
+	// saveState and loadState so that the batch drawn for the trials is drawn again for training
+	Autotuner* autotuner = nullptr;
+
+	// Optional data parallel training with other processes. Each one draws its batches from its own shard of
+	// the training set, and the gradients of all of them are summed before every optimizer step. Rank 0's
+	// weights are copied to the others when learn starts and only rank 0 saves checkpoints. See tools/launch.cpp
+	Communicator* communicator = nullptr;
+
+	// Prints hardware counters of each epoch and of its forward, backward and accumulation, see PerfCounters
+	bool countPerf = false;
+
 	Learner(Network& net, DataLoader& dataLoader, optimizers::Optimizer& optimizer, Loss lossFunc = MSE) : net(net), dataLoader(dataLoader), optimizer(optimizer), lossFunc(lossFunc) {}
 
 	vector<Gradient> backward(const Network& net, const Target& target) {
@@ -26,166 +120,390 @@ struct Learner {
 		for (usize l = 0; l < net.layers.size(); ++l)
 			grads[l].resize(net.layers[l].size);
 
-		// Output layer gradient
-		grads.back() = lossDeriv(lossFunc, net.layers.back(), target);
-		if (net.layers.back().activation == SOFTMAX)
-			grads.back() = activations::dsoftmax(grads.back(), net.layers.back().activated);
-		else {
-			grads.back().resize(net.layers.back().size);
-			for (usize i = 0; i < net.layers.back().size; i++)
-				grads.back()[i] = grads.back()[i] * activations::derivActivate(net.layers.back().activation, net.layers.back().activated[i]);
-		}
+		const Layer& output = net.layers.back();
+		outputGradient(lossFunc, output, target, grads.back());
+
+		// Each layer applies its own activation derivative before propagating to the previous layer
+		for (usize l = net.layers.size() - 1; l > 0; --l)
+			net.layers[l].backward(net.layers[l - 1], grads[l], l > 1 ? &grads[l - 1] : nullptr, l + 1 < net.layers.size() || output.activation != SOFTMAX, net.mathMode);
+		return grads;
+	}
+
+	// Restores the weights, optimizer and data loader state of a checkpoint, the next call to learn
+	// continues from the batch after it was taken
+	void resume(const string& path) {
+		resumeFrom = Checkpointer::load(path, net, optimizer, dataLoader);
+		cout << "Resuming from epoch " << resumeFrom.epoch << " batch " << resumeFrom.batch << endl;
+	}
+
+	// Forward pass, gradient with respect to the inputs of every layer but the first and weight gradient,
+	// each about as expensive as the forward pass of a layer
+	static double trainingFlopsPerSample(const Network& net) {
+		double flops = 0;
+		for (usize l = 1; l < net.layers.size(); l++)
+			flops += net.layers[l].forwardFlops(net.layers[l - 1]) * (l > 1 ? 3 : 2);
+		return flops;
+	}
 
-		// Hidden layer gradients
-		for (int l = net.layers.size() - 2; l > 0; --l) {
-			const Layer& currLayer = net.layers[l];
-			const Layer& nextLayer = net.layers[l + 1];
-			for (usize i = 0; i < currLayer.size; ++i) {
-				float error = 0.0f;
-				for (usize j = 0; j < nextLayer.size; ++j) {
-					error += grads[l + 1][j] * nextLayer.weights[j][i];
+	// Sums the per thread gradient accumulators of accumulator index l into weightGradAccum and biasGradAccum,
+	// of the threads in threadIdxs
+	static void reduceGradients(const MultiVector<float, 4>& threadWeightGradAccum, const MultiVector<float, 3>& threadBiasGradAccum, MultiVector<float, 3>& weightGradAccum, MultiVector<float, 2>& biasGradAccum, const usize l, const vector<usize>& threadIdxs) {
+		for (usize t : threadIdxs) {
+			for (usize i = 0; i < weightGradAccum[l].size(); i++) {
+				for (usize j = 0; j < weightGradAccum[l][i].size(); j++) {
+					weightGradAccum[l][i][j] += threadWeightGradAccum[t][l][i][j];
 				}
-				grads[l][i] = error * activations::derivActivate(currLayer.activation, currLayer.activated[i]);
 			}
+			for (usize i = 0; i < biasGradAccum[l].size(); i++)
+				biasGradAccum[l][i] += threadBiasGradAccum[t][l][i];
 		}
-		return grads;
 	}
 
-	void applyGradients(const Network& net, optimizers::Optimizer& optim, const usize batchSize, const MultiVector<float, 3>& weightGradAccum, const MultiVector<float, 2>& biasGradAccum) {
-		// Apply gradients to weights and biases
-		for (usize l = 1; l < net.layers.size(); l++) {
-			const Layer& currLayer = net.layers[l];
-			for (usize i = 0; i < currLayer.size; i++) {
-				for (usize j = 0; j < currLayer.weights[i].size(); j++) {
-					assert(l - 1 < weightGradAccum.size());
-					assert(i < weightGradAccum[l - 1].size());
-					assert(j < weightGradAccum[l - 1][i].size());
-					assert(l < optim.weightGradients.size());
-					assert(i < optim.weightGradients[l].size());
-					assert(j < optim.weightGradients[l][i].size());
-
-					optim.weightGradients[l][i][j] += weightGradAccum[l - 1][i][j] / batchSize;
-				}
-				optim.biasGradients[l][i] += biasGradAccum[l - 1][i] / batchSize;
+	static void reduceGradients(const MultiVector<float, 4>& threadWeightGradAccum, const MultiVector<float, 3>& threadBiasGradAccum, MultiVector<float, 3>& weightGradAccum, MultiVector<float, 2>& biasGradAccum, const vector<usize>& threadIdxs) {
+		for (usize l = 0; l < weightGradAccum.size(); l++)
+			reduceGradients(threadWeightGradAccum, threadBiasGradAccum, weightGradAccum, biasGradAccum, l, threadIdxs);
+	}
+
+	static void reduceGradients(const MultiVector<float, 4>& threadWeightGradAccum, const MultiVector<float, 3>& threadBiasGradAccum, MultiVector<float, 3>& weightGradAccum, MultiVector<float, 2>& biasGradAccum) {
+		vector<usize> threadIdxs(threadWeightGradAccum.size());
+		std::iota(threadIdxs.begin(), threadIdxs.end(), 0);
+		reduceGradients(threadWeightGradAccum, threadBiasGradAccum, weightGradAccum, biasGradAccum, threadIdxs);
+	}
+
+	// First step of the hierarchical reduction, run by worker w of a node's members: adds the accumulators of the
+	// other members to those of the first one, each member taking every members.size()-th row
+	static void reduceNodeGradients(MultiVector<float, 4>& threadWeightGradAccum, MultiVector<float, 3>& threadBiasGradAccum, const vector<usize>& members, const usize w) {
+		const usize lead = members.front();
+		const usize part = std::find(members.begin(), members.end(), w) - members.begin();
+		for (usize l = 0; l < threadWeightGradAccum[lead].size(); l++) {
+			for (usize i = part; i < threadWeightGradAccum[lead][l].size(); i += members.size())
+				for (usize m = 1; m < members.size(); m++)
+					for (usize j = 0; j < threadWeightGradAccum[lead][l][i].size(); j++)
+						threadWeightGradAccum[lead][l][i][j] += threadWeightGradAccum[members[m]][l][i][j];
+			if (part == 0)
+				for (usize m = 1; m < members.size(); m++)
+					for (usize i = 0; i < threadBiasGradAccum[lead][l].size(); i++)
+						threadBiasGradAccum[lead][l][i] += threadBiasGradAccum[members[m]][l][i];
+		}
+	}
+
+	// Adds the reduced gradients of layer l to the optimizer's
+	void applyGradients(const Network& net, optimizers::Optimizer& optim, const usize batchSize, const MultiVector<float, 3>& weightGradAccum, const MultiVector<float, 2>& biasGradAccum, const usize l) {
+		const Layer& currLayer = net.layers[l];
+		for (usize i = 0; i < currLayer.weights.size(); i++) {
+			for (usize j = 0; j < currLayer.weights[i].size(); j++) {
+				assert(l - 1 < weightGradAccum.size());
+				assert(i < weightGradAccum[l - 1].size());
+				assert(j < weightGradAccum[l - 1][i].size());
+				assert(l < optim.weightGradients.size());
+				assert(i < optim.weightGradients[l].size());
+				assert(j < optim.weightGradients[l][i].size());
+
+				optim.weightGradients[l][i][j] += weightGradAccum[l - 1][i][j] / batchSize;
 			}
 		}
+		for (usize i = 0; i < currLayer.biases.size(); i++)
+			optim.biasGradients[l][i] += biasGradAccum[l - 1][i] / batchSize;
+	}
+
+	void applyGradients(const Network& net, optimizers::Optimizer& optim, const usize batchSize, const MultiVector<float, 3>& weightGradAccum, const MultiVector<float, 2>& biasGradAccum) {
+		// Apply gradients to weights and biases
+		for (usize l = 1; l < net.layers.size(); l++)
+			applyGradients(net, optim, batchSize, weightGradAccum, biasGradAccum, l);
+	}
+
+	// Copies the weights and biases of a layer, or their gradients, to one contiguous buffer for a Communicator and back
+	static void flatten(const MultiVector<float, 2>& weights, const vector<float>& biases, vector<float>& flat) {
+		flat.clear();
+		for (const vector<float>& row : weights)
+			flat.insert(flat.end(), row.begin(), row.end());
+		flat.insert(flat.end(), biases.begin(), biases.end());
+	}
+
+	static void unflatten(const vector<float>& flat, MultiVector<float, 2>& weights, vector<float>& biases) {
+		const float* src = flat.data();
+		for (vector<float>& row : weights)
+			for (float& w : row)
+				w = *src++;
+		for (float& b : biases)
+			b = *src++;
 	}
 
 	void learn(LRSchedule& lrSchedule, usize epochs, usize threads = 0) {
+		const usize requestedThreads = threads;
 		if (threads == 0)
 			threads = std::thread::hardware_concurrency();
 		if (threads == 0) {
 			cerr << "Failed to detect number of threads" << endl;
 			threads = 1;
 		}
+		if (pool)
+			threads = pool->size();
+
+		for (const Layer& l : net.layers)
+			if (l.type == BLOCK_SPARSE)
+				exitWithMsg("Block sparse layers are inference only, prune with a Pruner while training and sparsify afterwards", -1);
+
+		if (accumulationSteps == 0)
+			exitWithMsg("accumulationSteps must be at least 1", -1);
+
+		const usize worldSize = communicator ? communicator->worldSize : 1;
+		const bool isRoot = !communicator || communicator->rank == 0;
+		dataLoader.shardIndex = communicator ? communicator->rank : 0;
+		dataLoader.shardCount = worldSize;
 
+		// Loader batches of this process, trailing ones that do not fill an optimizer step are left out
 		const u64 batchSize = dataLoader.batchSize;
-		u64 batchesPerEpoch = dataLoader.numSamples / batchSize;
+		const u64 stepsPerEpoch = dataLoader.numSamples / (batchSize * accumulationSteps * worldSize);
+		const u64 batchesPerEpoch = stepsPerEpoch * accumulationSteps;
+		if (stepsPerEpoch == 0)
+			exitWithMsg(fmt::format("An effective batch of {} samples is larger than the training set of {}", batchSize * accumulationSteps * worldSize, dataLoader.numSamples), -1);
+
+		// Rank 0 tunes and the other ranks take its settings
+		if (autotuner) {
+			TuningResult tuned;
+			if (isRoot) {
+				// A batch drawn with the loader's state restored afterwards, so training draws the same batches.
+				// Loaders that save no state cannot give the batch back, so they are only tuned from the cache.
+				// The batch is loaded on pool, or on a pool of its own since the training pool does not exist yet
+				const auto loadSamples = [&]() {
+					std::stringstream state(std::ios::in | std::ios::out | std::ios::binary);
+					dataLoader.saveState(state);
+					if (state.tellp() <= 0)
+						exitWithMsg("Autotuning needs a data loader that implements saveState and loadState, or a cached result", -1);
+
+					std::optional<ThreadPool> samplePool;
+					ThreadPool* loaderPool = dataLoader.pool;
+					if (!loaderPool && !pool)
+						samplePool.emplace(threads, pinThreads);
+					if (!loaderPool)
+						dataLoader.pool = pool ? pool : &*samplePool;
+
+					dataLoader.loadBatch(batchSize, dataLoader.currBatch);
+					vector<DataPoint> samples = dataLoader.batchData();
+					dataLoader.loadState(state);
+					dataLoader.pool = loaderPool;
+					return samples;
+				};
+				const auto trainSample = [&](Network& replica, const DataPoint& data, MultiVector<float, 3>& weightGrad, MultiVector<float, 2>& biasGrad, usize tile) {
+					replica.load(data);
+					replica.forwardPass();
+					const vector<Gradient> gradients = backward(replica, data.target);
+					for (usize l = 1; l < replica.layers.size(); l++)
+						replica.layers[l].accumulate(replica.layers[l - 1], gradients[l], weightGrad[l - 1], biasGrad[l - 1], tile);
+				};
+				tuned = autotuner->tune(net, batchSize, pool, threads, requestedThreads, loadSamples, trainSample);
+			}
+			if (communicator)
+				communicator->broadcast(&tuned, sizeof(tuned));
 
-		// Hide cursor
-		cout << "\033[?25l";
+			threads = tuned.threads;
+			sampleGrain = tuned.sampleGrain;
+			accumulateTile = tuned.accumulateTile;
+		}
 
-		cout << "Training for " << batchesPerEpoch * epochs << " batches with " << batchesPerEpoch << " batches per epoch" << endl;
+		if (printMemory) {
+			MemoryEstimate estimate = estimateTrainingMemory(net, threads, batchSize, dataLoader.numSamples * (1 - dataLoader.trainSplit), 0);
+			estimate.bytes[OPTIMIZER_STATE] = optimizer.stateBytes();
+			estimate.print();
+		}
 
-		cout << "Epoch    Train loss    Test loss     Train accuracy     Test accuracy" << endl;
-		cout << endl;
-		cout << endl;
+		// Hide cursor
+		cout << "\033[?25l";
 
-		const auto getTestLossAcc = [&]() {
-			float loss = 0;
-			usize numCorrect = 0;
-			dataLoader.loadTestSet();
-			usize testSize = dataLoader.batchData().size();
-			while (dataLoader.hasNext()) {
-				DataPoint data = dataLoader.next();
-				net.load(data);
-				net.forwardPass();
-				loss += getLoss(lossFunc, net.layers.back(), data.target);
-				usize guess = 0, goal = 0;
-				for (usize i = 0; i < data.target.size(); i++) {
-					if (net.layers.back().activated[i] > net.layers.back().activated[guess])
-						guess = i;
-					if (data.target[i] > data.target[goal])
-						goal = i;
-				}
-				numCorrect += (guess == goal);
-			}
-			return std::pair<float, float>{ loss / (testSize ? testSize : 1), numCorrect / static_cast<float>(testSize ? testSize : 1) };
-		};
+		cout << "Training for " << stepsPerEpoch * epochs << " batches with " << stepsPerEpoch << " batches per epoch" << endl;
+		if (accumulationSteps > 1)
+			cout << "Each batch accumulates " << accumulationSteps << " micro-batches of " << batchSize << " samples" << endl;
+		if (communicator)
+			cout << "Rank " << communicator->rank << " of " << worldSize << " processes training on its shard of the data" << endl;
+
+		// Opened before the pool is created so its workers are counted, the workers of a pool given in pool are not
+		std::optional<PerfCounters> counters;
+		if (countPerf)
+			counters.emplace();
+
+		const NumaTopology topology = numaAware ? NumaTopology::detect() : NumaTopology{};
+		std::optional<ThreadPool> ownPool;
+		if (!pool && numaAware)
+			ownPool.emplace(topology.workerCpus(threads));
+		else if (!pool)
+			ownPool.emplace(threads, pinThreads);
+		ThreadPool& workers = pool ? *pool : *ownPool;
+		ThreadPool* loaderPool = dataLoader.pool;
+		if (!loaderPool)
+			dataLoader.pool = &workers;
+
+		// Workers of each node. Gradients are summed into the first worker of each node, then across those leads
+		const vector<usize> workerNodes = numaAware ? topology.workerNodes(threads) : vector<usize>(threads, 0);
+		vector<vector<usize>> nodeMembers(std::max<usize>(topology.nodes(), 1));
+		for (usize t = 0; t < threads; t++)
+			nodeMembers[workerNodes[t]].push_back(t);
+		std::erase_if(nodeMembers, [](const vector<usize>& members) { return members.empty(); });
+		const bool hierarchicalReduction = nodeMembers.size() > 1;
+		vector<usize> reductionSources;
+		vector<usize> nodeIndex(threads);
+		for (usize n = 0; n < nodeMembers.size(); n++) {
+			for (usize t : nodeMembers[n])
+				nodeIndex[t] = n;
+			if (hierarchicalReduction)
+				reductionSources.push_back(nodeMembers[n].front());
+			else
+				reductionSources.insert(reductionSources.end(), nodeMembers[n].begin(), nodeMembers[n].end());
+		}
+		if (numaAware)
+			cout << "NUMA aware training on " << nodeMembers.size() << " node" << (nodeMembers.size() == 1 ? "" : "s") << endl;
 
 		MultiVector<float, 3> weightGradAccum;
 		MultiVector<float, 2> biasGradAccum;
 
-		MultiVector<float, 4> threadWeightGradAccum;
-		MultiVector<float, 3> threadBiasGradAccum;
-		vector<Network> networks;
+		MultiVector<float, 4> threadWeightGradAccum(threads);
+		MultiVector<float, 3> threadBiasGradAccum(threads);
+		vector<Network> networks(threads, Network(vector<Layer>{}));
 
 		vector<float> losses;
 
 		weightGradAccum.reserve(net.layers.size());
 		biasGradAccum.reserve(net.layers.size());
 
-		threadWeightGradAccum.reserve(threads);
-		threadBiasGradAccum.reserve(threads);
-		networks.reserve(threads);
-
 		for (usize l = 1; l < net.layers.size(); l++) {
-			weightGradAccum.push_back(MultiVector<float, 2>(net.layers[l].weights.size(), vector<float>(net.layers[l].weights[0].size(), 0.0f)));
-			biasGradAccum.push_back(vector<float>(net.layers[l].biases.size(), 0.0f));
+			weightGradAccum.push_back(zerosLike(net.layers[l].weights));
+			biasGradAccum.push_back(zerosLike(net.layers[l].biases));
 		}
 
-		for (usize t = 0; t < threads; t++) {
-			threadWeightGradAccum.push_back(weightGradAccum);
-			threadBiasGradAccum.push_back(biasGradAccum);
-			networks.push_back(net);
+		// Each worker allocates and fills its own buffers, so with bound workers they are placed on its node
+		workers.runOnEach([&](usize t) {
+			threadWeightGradAccum[t] = weightGradAccum;
+			threadBiasGradAccum[t] = biasGradAccum;
+			networks[t] = net;
+		});
+
+		// Contiguous gradients of each layer to all-reduce, starting with rank 0's weights
+		vector<vector<float>> syncBuffers(net.layers.size());
+		std::optional<AsyncAllReduce> gradientSync;
+		if (communicator) {
+			for (usize l = 1; l < net.layers.size(); l++) {
+				flatten(net.layers[l].weights, net.layers[l].biases, syncBuffers[l]);
+				communicator->broadcast(syncBuffers[l].data(), syncBuffers[l].size() * sizeof(float));
+				unflatten(syncBuffers[l], net.layers[l].weights, net.layers[l].biases);
+			}
+			deepFill(networks, net);
+			gradientSync.emplace(*communicator);
 		}
 
-		for (usize epoch = 0; epoch < epochs; epoch++) {
-			dataLoader.asyncPreloadoadBatch(batchSize);
+		memoryUsage = MemoryTracker{};
+		memoryUsage.set(NETWORK_MEMORY, memory::heapBytes(net));
+		memoryUsage.set(THREAD_REPLICAS, memory::heapBytes(networks));
+		memoryUsage.set(GRADIENT_ACCUMULATORS, memory::heapBytes(weightGradAccum) + memory::heapBytes(biasGradAccum)
+			+ memory::heapBytes(threadWeightGradAccum) + memory::heapBytes(threadBiasGradAccum) + memory::heapBytes(syncBuffers));
+		memoryUsage.set(OPTIMIZER_STATE, optimizer.stateBytes());
+
+		cout << "Epoch    Train loss    Test loss     Train accuracy     Test accuracy" << endl;
+		cout << endl;
+		cout << endl;
+
+		const TrainingProgress from = std::exchange(resumeFrom, TrainingProgress{});
+
+		trace::setThreadName("Learner");
+		PhaseTimer timer;
+		vector<PhaseTimer> threadTimers(threads);
+		const double flopsPerSample = trainingFlopsPerSample(net);
+
+		// Per thread training stats of the current batch
+		struct alignas(64) ThreadStats {
+			float lossSum = 0;
+			usize correct = 0;
+			usize total = 0;
+		};
+		vector<ThreadStats> threadStats(threads);
+
+		// A few tasks per thread, small enough for idle threads to take over the samples of slow ones
+		const usize grain = sampleGrain ? sampleGrain : std::max<usize>(1, batchSize / (threads * 4));
+		PerfSample epochStart;
+		PerfSample computeCounts;
+
+		// Every batch prefetches the next one, which carries over into the next epoch
+		dataLoader.asyncPreloadoadBatch(batchSize);
+
+		for (usize epoch = from.epoch; epoch < epochs; epoch++) {
+			const bool resumed = epoch == from.epoch;
+
+			if (pruner)
+				pruner->update(net, epoch);
 
 			ProgressBar progressBar{};
 
-			u64 batch = 0;
+			u64 batch = resumed ? from.batch : 0;
+
+			float trainLossSum = resumed ? from.trainLossSum : 0.0f;
+			usize trainCorrect = resumed ? from.trainCorrect : 0;
+			usize trainTotal = resumed ? from.trainTotal : 0;
 
-			float trainLossSum = 0.0f;
-			usize trainCorrect = 0;
-			usize trainTotal = 0;
+			const u64 firstBatch = batch;
+			string loaderState;
+			timer.clear();
+			if (counters) {
+				epochStart = counters->read();
+				computeCounts = PerfSample{};
+			}
 
 			while (batch < batchesPerEpoch) {
+				// The weights only change after the last micro-batch of a step
+				const bool stepStart = batch % accumulationSteps == 0;
+				const bool stepEnd = (batch + 1) % accumulationSteps == 0;
+
 				deepFill(weightGradAccum, 0);
 				deepFill(biasGradAccum, 0);
 
 				deepFill(threadWeightGradAccum, 0);
 				deepFill(threadBiasGradAccum, 0);
 
-				deepFill(networks, net);
-
-				optimizer.zeroGrad();
+				if (stepStart) {
+					deepFill(networks, net);
+					optimizer.zeroGrad();
+				}
+				timer.lap(REPLICA_SETUP);
 
 				// Dataloader mutex
 				std::mutex dlMut;
 
 				dataLoader.waitForBatch();
 				dataLoader.swapBuffers();
+				memoryUsage.set(LOADER_BUFFERS, memory::heapBytes(dataLoader.data));
+
+				// Loader state once the last micro-batch of the step is drawn and before the first one of the next
+				// step is, which is where a resumed run picks up after this step's checkpoint
+				if (checkpointer && stepEnd) {
+					std::ostringstream stateOut(std::ios::binary);
+					dataLoader.saveState(stateOut);
+					loaderState = std::move(stateOut).str();
+				}
 
 				// Start async loading the next batch's data into the buffer as soon as possible
 				dataLoader.asyncPreloadoadBatch(batchSize);
+				timer.lap(DATA_WAIT);
 
-				#pragma omp parallel for num_threads(threads) reduction(+:trainLossSum, trainCorrect, trainTotal)
-				for (usize idx = 0; idx < batchSize; idx++) {
-					usize tID = omp_get_thread_num();
+				for (PhaseTimer& t : threadTimers)
+					t.split();
+				PerfSample computeStart;
+				if (counters)
+					computeStart = counters->read();
 
+				workers.parallelFor(0, batchSize, [&](usize idx, usize tID) {
 					Network& net = networks[tID];
+					ThreadStats& stats = threadStats[tID];
+					PhaseTimer& threadTimer = threadTimers[tID];
 
 					dlMut.lock();
 					DataPoint data = dataLoader.batchData()[idx];
 					dlMut.unlock();
+					threadTimer.lap(DATA_WAIT);
+
 					net.load(data);
 					net.forwardPass();
 
 					// Accumulate training loss
 					float loss = getLoss(lossFunc, net.layers.back(), data.target);
-					trainLossSum += loss;
+					stats.lossSum += loss;
 
 					// Accumulate training accuracy
 					usize guess = 0, goal = 0;
@@ -195,38 +513,68 @@ struct Learner {
 						if (data.target[i] > data.target[goal])
 							goal = i;
 					}
-					trainCorrect += (guess == goal);
-					trainTotal++;
+					stats.correct += (guess == goal);
+					stats.total++;
+					threadTimer.lap(FORWARD);
 
 					// Backward + accumulate gradients
 					auto gradients = backward(net, data.target);
-					for (usize l = 1; l < net.layers.size(); l++) {
-						const Layer& prevLayer = net.layers[l - 1];
-						for (usize i = 0; i < net.layers[l].size; i++) {
-							for (usize j = 0; j < prevLayer.size; j++) {
-								threadWeightGradAccum[tID][l - 1][i][j] += gradients[l][i] * prevLayer.activated[j];
-							}
-							threadBiasGradAccum[tID][l - 1][i] += gradients[l][i];
-						}
+					threadTimer.lap(BACKWARD);
+					for (usize l = 1; l < net.layers.size(); l++)
+						net.layers[l].accumulate(net.layers[l - 1], gradients[l], threadWeightGradAccum[tID][l - 1], threadBiasGradAccum[tID][l - 1], accumulateTile);
+					threadTimer.lap(ACCUMULATE);
+				}, grain);
+				for (ThreadStats& stats : threadStats) {
+					trainLossSum += stats.lossSum;
+					trainCorrect += stats.correct;
+					trainTotal += stats.total;
+					stats = ThreadStats{};
+				}
+				if (counters)
+					computeCounts += counters->read() - computeStart;
+				timer.distribute(timer.split(), threadTimers);
+
+				const usize effectiveBatch = batchSize * accumulationSteps * worldSize;
+				if (hierarchicalReduction)
+					workers.runOnEach([&](usize t) { reduceNodeGradients(threadWeightGradAccum, threadBiasGradAccum, nodeMembers[nodeIndex[t]], t); });
+				if (communicator && stepEnd) {
+					// Layers go last to first, the all-reduce of one layer overlaps the reduction of the ones before it
+					for (usize l = net.layers.size() - 1; l > 0; l--) {
+						reduceGradients(threadWeightGradAccum, threadBiasGradAccum, weightGradAccum, biasGradAccum, l - 1, reductionSources);
+						applyGradients(net, optimizer, effectiveBatch, weightGradAccum, biasGradAccum, l);
+						flatten(optimizer.weightGradients[l], optimizer.biasGradients[l], syncBuffers[l]);
+						gradientSync->submit(syncBuffers[l]);
 					}
+					timer.lap(REDUCTION);
+
+					gradientSync->wait();
+					for (usize l = 1; l < net.layers.size(); l++)
+						unflatten(syncBuffers[l], optimizer.weightGradients[l], optimizer.biasGradients[l]);
+					timer.lap(ALL_REDUCE);
+				}
+				else {
+					reduceGradients(threadWeightGradAccum, threadBiasGradAccum, weightGradAccum, biasGradAccum, reductionSources);
+					applyGradients(net, optimizer, effectiveBatch, weightGradAccum, biasGradAccum);
+					timer.lap(REDUCTION);
 				}
+				batch++;
 
-				// Accumulate
-				for (usize t = 0; t < threads; t++) {
-					for (usize l = 1; l < net.layers.size(); l++) {
-						for (usize i = 0; i < net.layers[l].size; i++) {
-							for (usize j = 0; j < net.layers[l - 1].size; j++) {
-								weightGradAccum[l - 1][i][j] += threadWeightGradAccum[t][l - 1][i][j];
-							}
-							biasGradAccum[l - 1][i] += threadBiasGradAccum[t][l - 1][i];
-						}
-					}
+				if (stepEnd) {
+					optimizer.clipGrad(1);
+					timer.lap(CLIP);
+					optimizer.step(lrSchedule.lr(epoch));
+					if (pruner)
+						pruner->apply(net);
+					timer.lap(OPTIMIZER_STEP);
+
+					if (checkpointer && isRoot && checkpointer->due())
+						checkpointer->save({ epoch, batch, trainLossSum, trainCorrect, trainTotal }, net, optimizer, loaderState);
+					timer.lap(CHECKPOINT);
 				}
 
-				applyGradients(net, optimizer, batchSize, weightGradAccum, biasGradAccum);
-				optimizer.clipGrad(1);
-				optimizer.step(lrSchedule.lr(epoch));
-				batch++;
+				// The console counts optimizer steps like the banner, batch counts micro-batches
+				if (!stepEnd)
+					continue;
 
 				// Update trainLoss/trainAcc after each batch
 				float trainLoss = trainLossSum / (trainTotal ? trainTotal : 1);
@@ -236,25 +584,52 @@ struct Learner {
 				cursor::up();
 				cursor::begin();
 				cout << fmt::format("{:>5L}{:>14.5f}{:>13}{:>18.2f}%{:>18}", epoch, trainLoss, "Pending", trainAcc * 100, "Pending") << endl;
-				cout << progressBar.report(batch, batchesPerEpoch, 63) << "      " << endl;
+				cout << progressBar.report(batch / accumulationSteps, stepsPerEpoch, 63) << "      " << endl;
+				timer.lap(CONSOLE_IO);
 			}
 
 			float trainLoss = trainLossSum / (trainTotal ? trainTotal : 1);
 			float trainAcc = trainCorrect / static_cast<float>(trainTotal ? trainTotal : 1);
+			if (communicator) {
+				// Results over the shards of every process
+				array<float, 3> totals = { trainLossSum, static_cast<float>(trainCorrect), static_cast<float>(trainTotal) };
+				communicator->allReduce(totals.data(), totals.size());
+				trainLoss = totals[0] / std::max(totals[2], 1.0f);
+				trainAcc = totals[1] / std::max(totals[2], 1.0f);
+			}
 
-			auto testLA = getTestLossAcc();
+			auto testLA = testLossAccuracy(net, dataLoader, lossFunc, &memoryUsage);
+			timer.lap(EVALUATION);
 
 			cursor::up();
 			cursor::clear();
 			cursor::up();
 			cout << fmt::format("{:>5L}{:>14.5f}{:>13.5f}{:>18.2f}%{:>17.2f}%", epoch, trainLoss, testLA.first, trainAcc * 100, testLA.second * 100) << endl;
+			// Samples of the micro-batches run this epoch
+			const double epochFlops = flopsPerSample * (batch - firstBatch) * batchSize;
+			if (printPhaseTimes)
+				timer.print(epochFlops);
+			if (counters) {
+				cout << "    Counters in forward, backward and accumulation: " << computeCounts.summary(epochFlops) << endl;
+				cout << "    Counters of the epoch: " << (counters->read() - epochStart).summary(epochFlops) << endl;
+			}
 			cout << endl;
 			cout << endl;
 		}
 
+		if (checkpointer)
+			checkpointer->flush();
+
+		// The batch prefetched last may still be loading on the pool
+		dataLoader.waitForBatch();
+		dataLoader.pool = loaderPool;
+
 		cursor::up();
 		cursor::up();
 
+		if (printMemory)
+			memoryUsage.print();
+
 		// Show cursor
 		cout << "\033[?25h";
 	}
@@ -46,6 +46,44 @@ namespace lossFunctions {
 		return loss;
 	}
 
+	// Cross entropy of a softmax output computed from the logits with log-sum-exp, so
+	// outputs that underflow to zero do not need an epsilon
+	inline float softmaxCrossEntropy(const Layer& output, const Target& target) {
+		assert(output.size == target.size());
+
+		const vector<float>& logits = output.preActivation;
+		float maxLogit = logits[0];
+		for (usize i = 1; i < output.size; i++)
+			maxLogit = std::max(maxLogit, logits[i]);
+
+		float expSum = 0;
+		for (usize i = 0; i < output.size; i++)
+			expSum += std::exp(logits[i] - maxLogit);
+		const float logSumExp = maxLogit + std::log(expSum);
+
+		float loss = 0;
+		#pragma omp simd reduction(+:loss)
+		for (usize i = 0; i < output.size; i++)
+			loss += target[i] * (logSumExp - logits[i]);
+
+		return loss;
+	}
+
+	// Gradient of the softmax cross entropy with respect to the logits for targets summing to 1,
+	// written into grad in a single pass
+	inline void softmaxCrossEntropyDeriv(const Layer& output, const Target& target, Gradient& grad) {
+		assert(output.size == target.size());
+
+		grad.resize(output.size);
+		const float* probs = output.activated.data();
+		const float* t = target.data();
+		float* g = grad.data();
+
+		#pragma omp simd
+		for (usize i = 0; i < output.size; i++)
+			g[i] = probs[i] - t[i];
+	}
+
 	inline Gradient crossEntropyDeriv(const Layer& output, const Target& target) {
 		assert(output.size == target.size());
 
@@ -58,9 +96,17 @@ namespace lossFunctions {
 	}
 }
 
+// Softmax outputs trained with cross entropy skip the softmax derivative and use the fused loss
+inline bool fusedSoftmaxCrossEntropy(const Loss func, const Layer& output) {
+	return func == CROSS_ENTROPY && output.activation == SOFTMAX;
+}
+
 inline float getLoss(const Loss func, const Layer& output, const Target& target) {
 	using namespace lossFunctions;
 
+	if (fusedSoftmaxCrossEntropy(func, output))
+		return softmaxCrossEntropy(output, target);
+
 	switch (func) {
 	case MSE: return mse(output, target);
 	case CROSS_ENTROPY: return crossEntropy(output, target);
@@ -0,0 +1,237 @@
+#pragma once
+
+#include "learner.h"
+
+#include <random>
+
+namespace lowrank {
+    // W ~= up * down with up indexed [row][rank] and down indexed [rank][col]
+    struct Factorization {
+        MultiVector<float, 2> up;
+        MultiVector<float, 2> down;
+        vector<float> singularValues;
+    };
+
+    namespace internal {
+        // Orthonormalizes the given vectors in place with modified Gram-Schmidt
+        inline void orthonormalize(MultiVector<double, 2>& vecs) {
+            for (usize i = 0; i < vecs.size(); i++) {
+                for (usize k = 0; k < i; k++) {
+                    double dot = 0;
+                    for (usize j = 0; j < vecs[i].size(); j++)
+                        dot += vecs[i][j] * vecs[k][j];
+                    for (usize j = 0; j < vecs[i].size(); j++)
+                        vecs[i][j] -= dot * vecs[k][j];
+                }
+
+                double norm = 0;
+                for (const double d : vecs[i])
+                    norm += d * d;
+                norm = std::sqrt(norm);
+                for (double& d : vecs[i])
+                    d = norm > 1e-12 ? d / norm : 0;
+            }
+        }
+
+        // Eigen decomposition of a small symmetric matrix with cyclic Jacobi rotations.
+        // Returns the eigenvalues, eigenvectors are stored as the rows of vecs
+        inline vector<double> symmetricEigen(MultiVector<double, 2> a, MultiVector<double, 2>& vecs) {
+            const usize n = a.size();
+            vecs.assign(n, vector<double>(n));
+            for (usize i = 0; i < n; i++)
+                vecs[i][i] = 1;
+
+            for (usize sweep = 0; sweep < 64; sweep++) {
+                double offDiagonal = 0;
+                for (usize p = 0; p < n; p++)
+                    for (usize q = p + 1; q < n; q++)
+                        offDiagonal += a[p][q] * a[p][q];
+                if (offDiagonal < 1e-20)
+                    break;
+
+                for (usize p = 0; p < n; p++) {
+                    for (usize q = p + 1; q < n; q++) {
+                        if (std::abs(a[p][q]) < 1e-30)
+                            continue;
+
+                        const double theta = (a[q][q] - a[p][p]) / (2 * a[p][q]);
+                        const double t = (theta >= 0 ? 1 : -1) / (std::abs(theta) + std::sqrt(theta * theta + 1));
+                        const double c = 1 / std::sqrt(t * t + 1);
+                        const double s = t * c;
+
+                        for (usize k = 0; k < n; k++) {
+                            const double akp = a[k][p], akq = a[k][q];
+                            a[k][p] = c * akp - s * akq;
+                            a[k][q] = s * akp + c * akq;
+                        }
+                        for (usize k = 0; k < n; k++) {
+                            const double apk = a[p][k], aqk = a[q][k];
+                            a[p][k] = c * apk - s * aqk;
+                            a[q][k] = s * apk + c * aqk;
+                        }
+                        for (usize k = 0; k < n; k++) {
+                            const double vpk = vecs[p][k], vqk = vecs[q][k];
+                            vecs[p][k] = c * vpk - s * vqk;
+                            vecs[q][k] = s * vpk + c * vqk;
+                        }
+                    }
+                }
+            }
+
+            vector<double> values(n);
+            for (usize i = 0; i < n; i++)
+                values[i] = a[i][i];
+            return values;
+        }
+    }
+
+    // Truncated SVD by randomized subspace iteration, the singular values are split evenly between both factors
+    inline Factorization truncatedSVD(const MultiVector<float, 2>& weights, usize rank, usize powerIterations = 4, usize oversampling = 8) {
+        using internal::orthonormalize;
+
+        assert(!weights.empty());
+        const usize rows = weights.size();
+        const usize cols = weights[0].size();
+        rank = std::min({ rank, rows, cols });
+        const usize k = std::min({ rank + oversampling, rows, cols });
+
+        std::mt19937 gen(0);
+        std::normal_distribution<double> dis(0, 1);
+
+        // Basis of the range of W, stored as k vectors of length rows
+        MultiVector<double, 2> range(k, vector<double>(rows));
+        MultiVector<double, 2> coRange(k, vector<double>(cols));
+        for (auto& v : coRange)
+            for (double& d : v)
+                d = dis(gen);
+
+        const auto multiply = [&]() { // range = W * coRange
+            for (usize v = 0; v < k; v++)
+                for (usize r = 0; r < rows; r++) {
+                    double sum = 0;
+                    for (usize c = 0; c < cols; c++)
+                        sum += weights[r][c] * coRange[v][c];
+                    range[v][r] = sum;
+                }
+            orthonormalize(range);
+        };
+        const auto multiplyTransposed = [&]() { // coRange = W^T * range
+            for (usize v = 0; v < k; v++) {
+                std::fill(coRange[v].begin(), coRange[v].end(), 0);
+                for (usize r = 0; r < rows; r++)
+                    for (usize c = 0; c < cols; c++)
+                        coRange[v][c] += weights[r][c] * range[v][r];
+            }
+        };
+
+        multiply();
+        for (usize i = 0; i < powerIterations; i++) {
+            multiplyTransposed();
+            orthonormalize(coRange);
+            multiply();
+        }
+
+        // B = Q^T W is k x cols, its SVD comes from the eigen decomposition of B B^T
+        multiplyTransposed();
+        const MultiVector<double, 2>& b = coRange;
+        MultiVector<double, 2> bbt(k, vector<double>(k));
+        for (usize i = 0; i < k; i++)
+            for (usize j = 0; j <= i; j++) {
+                double sum = 0;
+                for (usize c = 0; c < cols; c++)
+                    sum += b[i][c] * b[j][c];
+                bbt[i][j] = bbt[j][i] = sum;
+            }
+
+        MultiVector<double, 2> eigenVecs;
+        const vector<double> eigenValues = internal::symmetricEigen(bbt, eigenVecs);
+
+        vector<usize> order(k);
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [&](usize a, usize b) { return eigenValues[a] > eigenValues[b]; });
+
+        Factorization result;
+        result.up.assign(rows, vector<float>(rank));
+        result.down.assign(rank, vector<float>(cols));
+        for (usize i = 0; i < rank; i++) {
+            const vector<double>& e = eigenVecs[order[i]];
+            const double sigma = std::sqrt(std::max(eigenValues[order[i]], 0.0));
+            result.singularValues.push_back(sigma);
+            if (sigma < 1e-12)
+                continue;
+
+            // Left singular vector Q e scaled by sqrt(sigma), right singular vector B^T e / sigma scaled by sqrt(sigma)
+            const double scale = std::sqrt(sigma);
+            for (usize r = 0; r < rows; r++) {
+                double sum = 0;
+                for (usize v = 0; v < k; v++)
+                    sum += range[v][r] * e[v];
+                result.up[r][i] = sum * scale;
+            }
+            for (usize c = 0; c < cols; c++) {
+                double sum = 0;
+                for (usize v = 0; v < k; v++)
+                    sum += b[v][c] * e[v];
+                result.down[i][c] = sum / sigma * scale;
+            }
+        }
+
+        return result;
+    }
+
+    // Frobenius norm of W - up * down relative to that of W
+    inline float relativeError(const MultiVector<float, 2>& weights, const Factorization& f) {
+        double errorSq = 0, normSq = 0;
+        for (usize r = 0; r < weights.size(); r++)
+            for (usize c = 0; c < weights[r].size(); c++) {
+                double approx = 0;
+                for (usize k = 0; k < f.down.size(); k++)
+                    approx += f.up[r][k] * f.down[k][c];
+                errorSq += (weights[r][c] - approx) * (weights[r][c] - approx);
+                normSq += weights[r][c] * weights[r][c];
+            }
+        return normSq > 0 ? std::sqrt(errorSq / normSq) : 0;
+    }
+
+    // Replaces a dense layer with the FACTORIZED layer of a factorization of its weights
+    inline void factorize(Layer& layer, const Factorization& f) {
+        assert(layer.type == DENSE);
+        Layer factorized = Layer::factorized(layer.size, f.down.size(), layer.activation);
+        factorized.biases = layer.biases;
+        factorized.weights = f.down;
+        factorized.weights.insert(factorized.weights.end(), f.up.begin(), f.up.end());
+
+        layer = std::move(factorized);
+    }
+
+    // Replaces a dense layer with a FACTORIZED layer of the given rank
+    inline void factorize(Layer& layer, usize rank) {
+        assert(layer.type == DENSE);
+        factorize(layer, truncatedSVD(layer.weights, rank));
+    }
+
+    // Prints the test loss and accuracy of a network with the given layer factorized at each rank
+    inline void rankReport(const Network& net, usize layerIdx, const vector<usize>& ranks, DataLoader& dataLoader, Loss lossFunc = MSE) {
+        assert(layerIdx > 0 && layerIdx < net.layers.size());
+        const Layer& layer = net.layers[layerIdx];
+        const usize rows = layer.weights.size();
+        const usize cols = layer.weights[0].size();
+
+        cout << "Rank       Params    Rel. error     Test loss     Test accuracy" << endl;
+
+        Network full = net;
+        const auto fullLA = testLossAccuracy(full, dataLoader, lossFunc);
+        cout << fmt::format("{:>4}{:>13}{:>14.5f}{:>14.5f}{:>17.2f}%", "full", formatNum(rows * cols), 0.0f, fullLA.first, fullLA.second * 100) << endl;
+
+        for (const usize rank : ranks) {
+            const Factorization f = truncatedSVD(layer.weights, rank);
+
+            Network compressed = net;
+            factorize(compressed.layers[layerIdx], f);
+            const auto la = testLossAccuracy(compressed, dataLoader, lossFunc);
+
+            const usize r = f.down.size();
+            cout << fmt::format("{:>4}{:>13}{:>14.5f}{:>14.5f}{:>17.2f}%", r, formatNum(r * (rows + cols)), relativeError(layer.weights, f), la.first, la.second * 100) << endl;
+        }
+    }
+}
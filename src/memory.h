@@ -0,0 +1,151 @@
+#pragma once
+
+#include "network.h"
+
+#include <fmt/fmt/format.h>
+
+#include <fstream>
+#include <type_traits>
+
+// What the memory of a training run is spent on
+enum MemoryCategory : u8 {
+    NETWORK_MEMORY,        // The network being trained
+    THREAD_REPLICAS,       // Per thread Network copies
+    GRADIENT_ACCUMULATORS, // Per thread and reduced weight and bias gradients
+    OPTIMIZER_STATE,       // Gradients and moment buffers of the optimizer
+    LOADER_BUFFERS,        // The two DataPoint batch buffers of the data loader
+    TEST_SET,
+    NUM_MEMORY_CATEGORIES
+};
+
+inline const array<string, NUM_MEMORY_CATEGORIES> memoryCategoryNames = {
+    "Network", "Thread replicas", "Gradient accumulators", "Optimizer state", "Loader buffers", "Test set"
+};
+
+namespace memory {
+    // Heap bytes owned by a value. Capacities rather than sizes are counted since that is what is allocated
+    inline usize heapBytes(const SparseInput& input);
+    inline usize heapBytes(const BlockSparseMatrix& matrix);
+    inline usize heapBytes(const Layer& layer);
+    inline usize heapBytes(const Network& net);
+    inline usize heapBytes(const DataPoint& data);
+
+    template<typename T>
+    usize heapBytes(const vector<T>& v) {
+        usize bytes = v.capacity() * sizeof(T);
+        if constexpr (!std::is_trivially_copyable_v<T>)
+            for (const T& element : v)
+                bytes += heapBytes(element);
+        return bytes;
+    }
+
+    template<typename T, usize N>
+    usize heapBytes(const array<T, N>& a) {
+        usize bytes = 0;
+        for (const T& element : a)
+            bytes += heapBytes(element);
+        return bytes;
+    }
+
+    inline usize heapBytes(const SparseInput& input) { return heapBytes(input.indices) + heapBytes(input.values); }
+
+    inline usize heapBytes(const BlockSparseMatrix& matrix) {
+        return heapBytes(matrix.rowPtr) + heapBytes(matrix.blockIdx) + heapBytes(matrix.values);
+    }
+
+    inline usize heapBytes(const Layer& layer) {
+        return heapBytes(layer.weights) + heapBytes(layer.biases) + heapBytes(layer.preActivation) + heapBytes(layer.activated)
+             + heapBytes(layer.sparseActivated) + heapBytes(layer.sparseWeights) + heapBytes(layer.bottleneck)
+             + heapBytes(layer.columns) + heapBytes(layer.poolIndices);
+    }
+
+    inline usize heapBytes(const Network& net) { return heapBytes(net.layers); }
+
+    inline usize heapBytes(const DataPoint& data) { return heapBytes(data.input) + heapBytes(data.sparseInput) + heapBytes(data.target); }
+
+    // Weights and biases of every layer, the size of one set of gradients
+    inline usize parameterBytes(const Network& net) {
+        usize bytes = 0;
+        for (const Layer& l : net.layers)
+            bytes += heapBytes(l.weights) + heapBytes(l.biases);
+        return bytes;
+    }
+
+    // Reads a "Name:   123 kB" line of /proc/self/status, 0 where it is unavailable
+    inline usize procStatusBytes(const string& name) {
+        std::ifstream status("/proc/self/status");
+        string line;
+        while (std::getline(status, line))
+            if (line.rfind(name + ":", 0) == 0)
+                return std::stoull(line.substr(name.size() + 1)) * 1024;
+        return 0;
+    }
+
+    inline usize residentBytes() { return procStatusBytes("VmRSS"); }
+    inline usize peakResidentBytes() { return procStatusBytes("VmHWM"); }
+}
+
+// Current and peak bytes of each category, set by the code that owns the memory
+struct MemoryTracker {
+    array<usize, NUM_MEMORY_CATEGORIES> current{};
+    array<usize, NUM_MEMORY_CATEGORIES> peak{};
+
+    void set(MemoryCategory category, usize bytes) {
+        current[category] = bytes;
+        peak[category] = std::max(peak[category], bytes);
+    }
+
+    usize total() const {
+        usize sum = 0;
+        for (usize bytes : current)
+            sum += bytes;
+        return sum;
+    }
+
+    void print() const {
+        cout << fmt::format("    {:<24}{:>14}{:>14}", "Memory", "Current", "Peak") << endl;
+        usize peakSum = 0;
+        for (usize c = 0; c < NUM_MEMORY_CATEGORIES; c++) {
+            cout << fmt::format("    {:<24}{:>14}{:>14}", memoryCategoryNames[c], formatBytes(current[c]), formatBytes(peak[c])) << endl;
+            peakSum += peak[c];
+        }
+        cout << fmt::format("    {:<24}{:>14}{:>14}", "Total tracked", formatBytes(total()), formatBytes(peakSum)) << endl;
+        cout << fmt::format("    {:<24}{:>14}{:>14}", "Process resident", formatBytes(memory::residentBytes()), formatBytes(memory::peakResidentBytes())) << endl;
+    }
+};
+
+// Footprint of Learner::learn worked out from the topology before it allocates anything, allocator
+// overhead and the code itself are not included
+struct MemoryEstimate {
+    array<usize, NUM_MEMORY_CATEGORIES> bytes{};
+
+    usize total() const {
+        usize sum = 0;
+        for (usize b : bytes)
+            sum += b;
+        return sum;
+    }
+
+    void print() const {
+        cout << fmt::format("    {:<24}{:>14}", "Estimated memory", "") << endl;
+        for (usize c = 0; c < NUM_MEMORY_CATEGORIES; c++)
+            cout << fmt::format("    {:<24}{:>14}", memoryCategoryNames[c], formatBytes(bytes[c])) << endl;
+        cout << fmt::format("    {:<24}{:>14}", "Total", formatBytes(total())) << endl;
+    }
+};
+
+// net must be initialized. optimizerBuffers is the number of parameter sized buffers the optimizer keeps
+// including its gradients, the BUFFERS_PER_PARAMETER of the optimizer type
+inline MemoryEstimate estimateTrainingMemory(const Network& net, usize threads, usize batchSize, usize testSamples, usize optimizerBuffers) {
+    const usize params = memory::parameterBytes(net);
+    const usize sampleBytes = sizeof(DataPoint) + (net.layers.front().size + net.layers.back().size) * sizeof(float);
+
+    MemoryEstimate estimate;
+    estimate.bytes[NETWORK_MEMORY] = memory::heapBytes(net);
+    estimate.bytes[THREAD_REPLICAS] = threads * memory::heapBytes(net);
+    estimate.bytes[GRADIENT_ACCUMULATORS] = (threads + 1) * params;
+    estimate.bytes[OPTIMIZER_STATE] = optimizerBuffers * params;
+    estimate.bytes[LOADER_BUFFERS] = 2 * batchSize * sampleBytes;
+    estimate.bytes[TEST_SET] = testSamples * sampleBytes;
+    return estimate;
+}
@@ -3,9 +3,22 @@
 #include "dataloader.h"
 #include "util.h"
 
+#include <span>
+
+struct ExecutionPlan;
+
+// INFERENCE_PLAN only keeps the buffers that are still needed, TRAINING_PLAN keeps every layer's activations for a backward pass
+enum PlanMode : i16 {
+	INFERENCE_PLAN,
+	TRAINING_PLAN
+};
+
 struct Network {
 	vector<Layer> layers;
 
+	// Whether exp based activations use the exact or the fastmath.h approximations
+	MathMode mathMode = EXACT_MATH;
+
 	Network(usize inputSize, usize outputSize, Activation outputActivation) {
 		layers.resize(2);
 		layers[0] = InputLayer(inputSize);
@@ -24,58 +37,144 @@ struct Network {
 
         for (usize l = 1; l < layers.size(); ++l) {
             Layer& layer = layers[l];
-            usize fanIn = layers[l - 1].size;
-            usize fanOut = layer.size;
 
-            if (useXavierInit) {
-                // Xavier Uniform
-                float limit = std::sqrt(6.0f / (fanIn + fanOut));
-                std::uniform_real_distribution<float> dis(-limit, limit);
+            for (usize i = 0; i < layer.weights.size(); i++) {
+                // Each factor of a factorized layer is initialized as its own matrix
+                usize fanIn = layer.weights[i].size();
+                usize fanOut = layer.type == FACTORIZED && i < layer.rank ? layer.rank : layer.size;
+                if (layer.type == CONV2D)
+                    fanOut = layer.channels * layer.kernelSize * layer.kernelSize;
+
+                if (useXavierInit) {
+                    // Xavier Uniform
+                    float limit = std::sqrt(6.0f / (fanIn + fanOut));
+                    std::uniform_real_distribution<float> dis(-limit, limit);
 
-                for (usize i = 0; i < layer.weights.size(); i++)
                     for (usize j = 0; j < layer.weights[i].size(); j++)
                         layer.weights[i][j] = dis(gen);
+                }
+                else {
+                    // He Normal
+                    float stddev = std::sqrt(2.0f / fanIn);
+                    std::normal_distribution<float> dis(0.0f, stddev);
 
-                for (usize i = 0; i < layer.biases.size(); i++)
-                    layer.biases[i] = 0.0f;
-            }
-            else {
-                // He Normal
-                float stddev = std::sqrt(2.0f / fanIn);
-                std::normal_distribution<float> dis(0.0f, stddev);
-
-                for (usize i = 0; i < layer.weights.size(); i++)
                     for (usize j = 0; j < layer.weights[i].size(); j++)
                         layer.weights[i][j] = dis(gen);
-
-                for (usize i = 0; i < layer.biases.size(); i++)
-                    layer.biases[i] = 0.0f;
+                }
             }
+
+            for (usize i = 0; i < layer.biases.size(); i++)
+                layer.biases[i] = 0.0f;
         }
     }
 
+	// Sets the [channel][y][x] layout of the input for CONV2D and pooling layers
+	Network& setInputShape(usize channels, usize height, usize width) {
+		assert(channels * height * width == layers[0].size);
+		layers[0].channels = channels;
+		layers[0].height = height;
+		layers[0].width = width;
+		return *this;
+	}
+
+	// Loading keeps the input shape set by setInputShape
 	void load(InputLayer input) {
-		layers[0] = input;
+		Layer& in = layers[0];
+		if (input.size() != in.size) {
+			in.size = input.size();
+			in.channels = in.size;
+			in.height = in.width = 1;
+		}
+		in.sparse = false;
+		in.preActivation = input;
+		in.activated = std::move(input);
+	}
+	void load(const SparseInput& input) {
+		assert(std::all_of(input.indices.begin(), input.indices.end(), [&](u32 idx) { return idx < layers[0].size; }));
+		layers[0].sparse = true;
+		layers[0].sparseActivated = input;
+		layers[0].activated.clear();
 	}
 	void load(DataPoint data) {
-		load(data.input);
+		if (data.sparse)
+			load(data.sparseInput);
+		else
+			load(data.input);
 	}
 
-	Network& addLayer(usize size, Activation activation) {
+	// Inserts a layer before the output layer
+	Network& addLayer(const Layer& layer) {
 		layers.resize(layers.size() + 1);
 		layers.back() = layers[layers.size() - 2];
-		layers[layers.size() - 2] = Layer(size, activation);
+		layers[layers.size() - 2] = layer;
 
 		return *this;
 	}
 
-	void forwardPass() {
-		for (usize i = 1; i < layers.size(); i++)
-			layers[i].forward(layers[i - 1]);
+	Network& addLayer(usize size, Activation activation) {
+		return addLayer(Layer(size, activation));
+	}
+
+	// Runs every layer from the given index onwards, earlier layers are assumed to be up to date
+	void forwardPass(usize from = 1) {
+		for (usize i = from; i < layers.size(); i++)
+			layers[i].forward(layers[i - 1], mathMode);
 	}
 
 	const vector<float>& output() const {
 		return layers.back().activated;
 	}
 
-};
\ No newline at end of file
+	// Packs the weights into an ExecutionPlan that runs without touching the layers, defined in plan.h.
+	// With sparseInput set the first layer is laid out for SparseInput features
+	ExecutionPlan compile(PlanMode mode = INFERENCE_PLAN, bool sparseInput = false) const;
+
+};
+
+// Scratch of predict(). Each thread keeps its own so that any number of them can share one const Network
+struct InferenceWorkspace {
+	array<vector<float>, 2> buffers; // Alternately written by consecutive layers
+	vector<float> scratch;           // Bottleneck of FACTORIZED layers
+
+	InferenceWorkspace() = default;
+	explicit InferenceWorkspace(const Network& net) { fit(net); }
+
+	// Grows the buffers to the largest layer of net, only allocates the first time it sees a network
+	void fit(const Network& net) {
+		for (usize l = 1; l < net.layers.size(); l++) {
+			const Layer& layer = net.layers[l];
+			for (vector<float>& buffer : buffers)
+				if (buffer.size() < layer.size)
+					buffer.resize(layer.size);
+			if (scratch.size() < layer.rank)
+				scratch.resize(layer.rank);
+		}
+	}
+};
+
+namespace internal {
+	// Runs the layers of net on in (or sparseIn), the last one writes straight into out
+	inline void predict(const Network& net, const float* in, const SparseInput* sparseIn, std::span<float> out, InferenceWorkspace& ws) {
+		assert(net.layers.size() > 1 && out.size() == net.layers.back().size);
+		ws.fit(net);
+
+		const float* current = in;
+		for (usize l = 1; l < net.layers.size(); l++) {
+			float* next = l + 1 == net.layers.size() ? out.data() : ws.buffers[l % 2].data();
+			net.layers[l].infer(net.layers[l - 1], current, l == 1 ? sparseIn : nullptr, next, ws.scratch.data(), net.mathMode);
+			current = next;
+		}
+	}
+}
+
+// Forward pass that leaves the network untouched, unlike Network::forwardPass. All intermediate values
+// live in ws, so threads with their own workspace can run one shared copy of the weights concurrently
+inline void predict(const Network& net, std::span<const float> in, std::span<float> out, InferenceWorkspace& ws) {
+	assert(in.size() == net.layers[0].size);
+	internal::predict(net, in.data(), nullptr, out, ws);
+}
+
+inline void predict(const Network& net, const SparseInput& in, std::span<float> out, InferenceWorkspace& ws) {
+	assert(std::all_of(in.indices.begin(), in.indices.end(), [&](u32 idx) { return idx < net.layers[0].size; }));
+	internal::predict(net, nullptr, &in, out, ws);
+}
\ No newline at end of file
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "threadpool.h"
+
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <numeric>
+
+// CPUs of each NUMA node as Linux lists them in sysfs. Where that is unavailable there is one node
+// holding every CPU
+struct NumaTopology {
+    vector<vector<u32>> nodeCpus;
+
+    static NumaTopology detect() {
+        NumaTopology topology;
+#ifdef __linux__
+        std::error_code err;
+        vector<std::pair<usize, vector<u32>>> nodes;
+        for (const auto& entry : std::filesystem::directory_iterator("/sys/devices/system/node", err)) {
+            const string name = entry.path().filename().string();
+            if (name.rfind("node", 0) != 0 || name.size() == 4 || !std::isdigit(name[4]))
+                continue;
+
+            std::ifstream file(entry.path() / "cpulist");
+            string list;
+            std::getline(file, list);
+            vector<u32> cpus = parseCpuList(list);
+            // Memory only nodes have no CPUs to run workers on
+            if (!cpus.empty())
+                nodes.emplace_back(std::stoull(name.substr(4)), std::move(cpus));
+        }
+        std::sort(nodes.begin(), nodes.end());
+        for (auto& node : nodes)
+            topology.nodeCpus.push_back(std::move(node.second));
+#endif
+        if (topology.nodeCpus.empty()) {
+            topology.nodeCpus.emplace_back(std::max(1u, std::thread::hardware_concurrency()));
+            std::iota(topology.nodeCpus[0].begin(), topology.nodeCpus[0].end(), 0);
+        }
+        return topology;
+    }
+
+    usize nodes() const { return nodeCpus.size(); }
+
+    usize cpus() const {
+        usize count = 0;
+        for (const vector<u32>& node : nodeCpus)
+            count += node.size();
+        return count;
+    }
+
+    // Node of each of threads workers. Workers are split over the nodes in proportion to their CPUs and
+    // consecutive workers share a node
+    vector<usize> workerNodes(usize threads) const {
+        vector<usize> nodeOf(threads);
+        const usize total = cpus();
+        for (usize w = 0; w < threads; w++) {
+            usize slot = w * total / threads;
+            usize node = 0;
+            while (slot >= nodeCpus[node].size()) {
+                slot -= nodeCpus[node].size();
+                node++;
+            }
+            nodeOf[w] = node;
+        }
+        return nodeOf;
+    }
+
+    // CPUs each worker is bound to for ThreadPool, all CPUs of its node so the scheduler still balances within it
+    vector<vector<u32>> workerCpus(usize threads) const {
+        vector<vector<u32>> cpus;
+        for (usize node : workerNodes(threads))
+            cpus.push_back(nodeCpus[node]);
+        return cpus;
+    }
+
+    // Parses lists such as "0-3,8-11,16"
+    static vector<u32> parseCpuList(const string& list) {
+        vector<u32> cpus;
+        std::istringstream ranges(list);
+        string range;
+        while (std::getline(ranges, range, ',')) {
+            if (range.empty() || !std::isdigit(range[0]))
+                continue;
+            const usize dash = range.find('-');
+            const u32 first = std::stoul(range.substr(0, dash));
+            const u32 last = dash == string::npos ? first : std::stoul(range.substr(dash + 1));
+            for (u32 cpu = first; cpu <= last; cpu++)
+                cpus.push_back(cpu);
+        }
+        return cpus;
+    }
+};
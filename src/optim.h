@@ -1,6 +1,6 @@
 #pragma once
 
-#include "network.h"
+#include "memory.h"
 
 namespace optimizers {
     struct Optimizer {
@@ -12,10 +12,7 @@ namespace optimizers {
 
         Optimizer(Network& net, float momentum = 0.9f) : net(net), momentum(momentum) {
             for (Layer& l : net.layers) {
-                if (!l.weights.empty() && !l.weights[0].empty())
-                    weightGradients.emplace_back(l.weights.size(), vector<float>(l.weights[0].size()));
-                else
-                    weightGradients.emplace_back();
+                weightGradients.push_back(zerosLike(l.weights));
                 biasGradients.emplace_back(l.biases.size());
             }
         }
@@ -69,19 +66,25 @@ namespace optimizers {
         virtual void step(float lr) = 0;
         virtual std::unique_ptr<Optimizer> clone() const = 0;
 
+        // Heap bytes of the gradients and any moment buffers
+        virtual usize stateBytes() const { return memory::heapBytes(weightGradients) + memory::heapBytes(biasGradients); }
+
+        // Moment buffers and step counters, everything needed to continue training where it left off
+        virtual void saveState(std::ostream&) const {}
+        virtual void loadState(std::istream&) {}
+
         virtual ~Optimizer() = default;
     };
 
     struct SGD : Optimizer {
+        static constexpr usize BUFFERS_PER_PARAMETER = 2;
+
         MultiVector<float, 3> weightVelocities;
         MultiVector<float, 2> biasVelocities;
 
         SGD(Network& net, float momentum = 0.9f) : Optimizer(net, momentum) {
             for (Layer& l : net.layers) {
-                if (!l.weights.empty() && !l.weights[0].empty())
-                    weightVelocities.emplace_back(l.weights.size(), vector<float>(l.weights[0].size()));
-                else
-                    weightVelocities.emplace_back();
+                weightVelocities.push_back(zerosLike(l.weights));
                 biasVelocities.emplace_back(l.biases.size());
             }
         }
@@ -114,9 +117,23 @@ namespace optimizers {
         std::unique_ptr<Optimizer> clone() const override {
             return std::make_unique<SGD>(*this);
         }
+
+        usize stateBytes() const override { return Optimizer::stateBytes() + memory::heapBytes(weightVelocities) + memory::heapBytes(biasVelocities); }
+
+        void saveState(std::ostream& out) const override {
+            serialization::write(out, weightVelocities);
+            serialization::write(out, biasVelocities);
+        }
+
+        void loadState(std::istream& in) override {
+            serialization::read(in, weightVelocities);
+            serialization::read(in, biasVelocities);
+        }
     };
 
     struct RMSprop : Optimizer {
+        static constexpr usize BUFFERS_PER_PARAMETER = 2;
+
         float beta;
         float epsilon;
         MultiVector<float, 3> weightSqGrads;
@@ -124,10 +141,7 @@ namespace optimizers {
 
         RMSprop(Network& net, float momentum = 0.9f, float beta = 0.9f, float epsilon = 1e-8f) : Optimizer(net, momentum), beta(beta), epsilon(epsilon) {
             for (Layer& l : net.layers) {
-                if (!l.weights.empty() && !l.weights[0].empty())
-                    weightSqGrads.emplace_back(l.weights.size(), vector<float>(l.weights[0].size()));
-                else
-                    weightSqGrads.emplace_back();
+                weightSqGrads.push_back(zerosLike(l.weights));
                 biasSqGrads.emplace_back(l.biases.size());
             }
         }
@@ -165,11 +179,25 @@ namespace optimizers {
         std::unique_ptr<Optimizer> clone() const override {
             return std::make_unique<RMSprop>(*this);
         }
+
+        usize stateBytes() const override { return Optimizer::stateBytes() + memory::heapBytes(weightSqGrads) + memory::heapBytes(biasSqGrads); }
+
+        void saveState(std::ostream& out) const override {
+            serialization::write(out, weightSqGrads);
+            serialization::write(out, biasSqGrads);
+        }
+
+        void loadState(std::istream& in) override {
+            serialization::read(in, weightSqGrads);
+            serialization::read(in, biasSqGrads);
+        }
     };
 
     // Heavily based on code from h1me, the developer of the Astra chess engine
     // Thank you for your contribution!
     struct Adam : Optimizer {
+        static constexpr usize BUFFERS_PER_PARAMETER = 3;
+
         float beta1;
         float beta2;
         float epsilon;
@@ -184,14 +212,8 @@ namespace optimizers {
         Adam(Network& net, float beta1 = 0.9f, float beta2 = 0.999f, float epsilon = 1e-8f, float decay = 0.01f)
             : Optimizer(net), beta1(beta1), beta2(beta2), epsilon(epsilon), decay(decay) {
             for (Layer& l : net.layers) {
-                if (!l.weights.empty() && !l.weights[0].empty()) {
-                    weightMomentums.emplace_back(l.weights.size(), vector<float>(l.weights[0].size()));
-                    weightVelocities.emplace_back(l.weights.size(), vector<float>(l.weights[0].size()));
-                }
-                else {
-                    weightMomentums.emplace_back();
-                    weightVelocities.emplace_back();
-                }
+                weightMomentums.push_back(zerosLike(l.weights));
+                weightVelocities.push_back(zerosLike(l.weights));
                 biasMomentums.emplace_back(l.biases.size());
                 biasVelocities.emplace_back(l.biases.size());
             }
@@ -253,5 +275,28 @@ namespace optimizers {
         std::unique_ptr<Optimizer> clone() const override {
             return std::make_unique<Adam>(*this);
         }
+
+        usize stateBytes() const override {
+            return Optimizer::stateBytes() + memory::heapBytes(weightMomentums) + memory::heapBytes(weightVelocities)
+                 + memory::heapBytes(biasMomentums) + memory::heapBytes(biasVelocities);
+        }
+
+        void saveState(std::ostream& out) const override {
+            serialization::write(out, static_cast<u64>(iteration));
+            serialization::write(out, weightMomentums);
+            serialization::write(out, weightVelocities);
+            serialization::write(out, biasMomentums);
+            serialization::write(out, biasVelocities);
+        }
+
+        void loadState(std::istream& in) override {
+            u64 iter;
+            serialization::read(in, iter);
+            iteration = iter;
+            serialization::read(in, weightMomentums);
+            serialization::read(in, weightVelocities);
+            serialization::read(in, biasMomentums);
+            serialization::read(in, biasVelocities);
+        }
     };
 }
\ No newline at end of file
@@ -0,0 +1,234 @@
+#pragma once
+
+#include <fmt/fmt/format.h>
+
+#include "types.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#endif
+
+enum PerfCounter : u8 {
+    TASK_CLOCK,   // Nanoseconds on a CPU, a software event that is available whenever perf_event_open is
+    CYCLES,
+    INSTRUCTIONS,
+    L1D_MISSES,   // L1 data cache read misses
+    LLC_MISSES,
+    DRAM_BYTES,   // Read and write traffic of the Intel integrated memory controllers, system wide
+    NUM_PERF_COUNTERS
+};
+
+inline const array<string, NUM_PERF_COUNTERS> perfCounterNames = {
+    "task_clock_ns", "cycles", "instructions", "l1d_misses", "llc_misses", "dram_bytes"
+};
+
+// Counter values over some span, counters that could not be opened are not valid
+struct PerfSample {
+    array<double, NUM_PERF_COUNTERS> values{};
+    array<bool, NUM_PERF_COUNTERS> valid{};
+
+    PerfSample operator-(const PerfSample& other) const {
+        PerfSample diff = *this;
+        for (usize c = 0; c < NUM_PERF_COUNTERS; c++)
+            diff.values[c] -= other.values[c];
+        return diff;
+    }
+
+    PerfSample& operator+=(const PerfSample& other) {
+        for (usize c = 0; c < NUM_PERF_COUNTERS; c++) {
+            values[c] += other.values[c];
+            valid[c] = valid[c] || other.valid[c];
+        }
+        return *this;
+    }
+
+    PerfSample operator/(double divisor) const {
+        PerfSample result = *this;
+        for (double& v : result.values)
+            v /= divisor;
+        return result;
+    }
+
+    bool has(PerfCounter c) const { return valid[c]; }
+    double operator[](PerfCounter c) const { return values[c]; }
+
+    // Derived figures that tell compute bound from memory bound code, flops is the work done over the span.
+    // Without DRAM counters the traffic is estimated as one cache line per LLC miss
+    string summary(double flops = 0) const {
+        string out;
+        const auto append = [&](const string& part) { out += (out.empty() ? "" : ", ") + part; };
+
+        if (has(CYCLES) && has(INSTRUCTIONS) && values[CYCLES] > 0)
+            append(fmt::format("IPC {:.2f}", values[INSTRUCTIONS] / values[CYCLES]));
+        if (has(INSTRUCTIONS) && values[INSTRUCTIONS] > 0) {
+            if (has(L1D_MISSES))
+                append(fmt::format("L1D {:.2f} MPKI", values[L1D_MISSES] * 1000 / values[INSTRUCTIONS]));
+            if (has(LLC_MISSES))
+                append(fmt::format("LLC {:.2f} MPKI", values[LLC_MISSES] * 1000 / values[INSTRUCTIONS]));
+        }
+
+        const bool measuredTraffic = has(DRAM_BYTES);
+        const double traffic = measuredTraffic ? values[DRAM_BYTES] : has(LLC_MISSES) ? values[LLC_MISSES] * 64 : 0;
+        if (measuredTraffic || has(LLC_MISSES)) {
+            append(fmt::format("{}{:.3f} GB DRAM", measuredTraffic ? "" : "~", traffic * 1e-9));
+            if (flops > 0 && traffic > 0)
+                append(fmt::format("{:.1f} flop/byte", flops / traffic));
+        }
+        if (has(TASK_CLOCK))
+            append(fmt::format("{:.1f} ms CPU", values[TASK_CLOCK] * 1e-6));
+        return out.empty() ? "no counters available" : out;
+    }
+};
+
+// Hardware counters opened with perf_event_open for the calling thread. With inherit set threads it creates
+// afterwards are counted too, so open them before the ThreadPool workers are created to include them.
+// Counters the kernel, hypervisor or perf_event_paranoid do not allow are left out
+struct PerfCounters {
+    explicit PerfCounters(bool inherit = true) {
+        fds.fill(-1);
+#ifdef __linux__
+        open(TASK_CLOCK, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, inherit);
+        open(CYCLES, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, inherit);
+        open(INSTRUCTIONS, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, inherit);
+        open(L1D_MISSES, PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), inherit);
+        open(LLC_MISSES, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, inherit);
+        openMemoryControllers();
+#endif
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    ~PerfCounters() {
+#ifdef __linux__
+        for (int fd : fds)
+            if (fd >= 0)
+                ::close(fd);
+        for (const ScaledFd& imc : dramFds)
+            ::close(imc.fd);
+#endif
+    }
+
+    // Whether any counter beyond the task clock could be opened
+    bool hardwareAvailable() const {
+        return fds[CYCLES] >= 0 || fds[INSTRUCTIONS] >= 0 || fds[L1D_MISSES] >= 0 || fds[LLC_MISSES] >= 0 || !dramFds.empty();
+    }
+
+    // Totals since the counters were opened, scaled up when the kernel multiplexed them
+    PerfSample read() const {
+        PerfSample sample;
+#ifdef __linux__
+        for (usize c = 0; c < NUM_PERF_COUNTERS; c++) {
+            if (fds[c] < 0)
+                continue;
+            sample.values[c] = readScaled(fds[c]);
+            sample.valid[c] = true;
+        }
+        for (const ScaledFd& imc : dramFds) {
+            sample.values[DRAM_BYTES] += readScaled(imc.fd) * imc.scale;
+            sample.valid[DRAM_BYTES] = true;
+        }
+#endif
+        return sample;
+    }
+
+  private:
+    struct ScaledFd {
+        int fd;
+        double scale; // Bytes per count
+    };
+
+    array<int, NUM_PERF_COUNTERS> fds;
+    vector<ScaledFd> dramFds;
+
+#ifdef __linux__
+    static int openEvent(u32 type, u64 config, bool inherit, int pid, int cpu) {
+        perf_event_attr attr{};
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.inherit = inherit;
+        attr.exclude_kernel = pid >= 0;
+        attr.exclude_hv = pid >= 0;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        return static_cast<int>(::syscall(SYS_perf_event_open, &attr, pid, cpu, -1, 0));
+    }
+
+    void open(PerfCounter counter, u32 type, u64 config, bool inherit) {
+        fds[counter] = openEvent(type, config, inherit, 0, -1);
+    }
+
+    static double readScaled(int fd) {
+        u64 data[3] = {};
+        if (::read(fd, data, sizeof(data)) != sizeof(data) || data[2] == 0)
+            return 0;
+        return static_cast<double>(data[0]) * data[1] / data[2];
+    }
+
+    static string readFile(const std::filesystem::path& path) {
+        std::ifstream file(path);
+        string content;
+        std::getline(file, content);
+        return content;
+    }
+
+    // Builds the config of a sysfs event such as "event=0x04,umask=0x03" from the PMU's format
+    // descriptions such as "config:8-15"
+    static u64 eventConfig(const std::filesystem::path& pmu, const string& event) {
+        u64 config = 0;
+        std::istringstream terms(event);
+        string term;
+        while (std::getline(terms, term, ',')) {
+            const usize eq = term.find('=');
+            const string field = term.substr(0, eq);
+            const u64 value = eq == string::npos ? 1 : std::stoull(term.substr(eq + 1), nullptr, 0);
+
+            const string format = readFile(pmu / "format" / field);
+            const usize colon = format.find(':');
+            if (format.substr(0, colon) != "config")
+                continue;
+            const string bits = format.substr(colon + 1);
+            config |= value << std::stoul(bits.substr(0, bits.find('-')));
+        }
+        return config;
+    }
+
+    // Read and write CAS counts of every Intel memory controller, which need CAP_PERFMON or perf_event_paranoid <= 0
+    void openMemoryControllers() {
+        const std::filesystem::path devices = "/sys/bus/event_source/devices";
+        std::error_code err;
+        for (const auto& entry : std::filesystem::directory_iterator(devices, err)) {
+            const std::filesystem::path pmu = entry.path();
+            if (pmu.filename().string().rfind("uncore_imc", 0) != 0)
+                continue;
+
+            const u32 type = std::stoul(readFile(pmu / "type"));
+            const string cpumask = readFile(pmu / "cpumask");
+            const int cpu = cpumask.empty() ? 0 : std::stoi(cpumask);
+
+            for (const string event : { "cas_count_read", "cas_count_write" }) {
+                const string description = readFile(pmu / "events" / event);
+                if (description.empty())
+                    continue;
+
+                // Scales are given for the unit in the .unit file, usually MiB
+                const string scaleText = readFile(pmu / "events" / (event + ".scale"));
+                const string unit = readFile(pmu / "events" / (event + ".unit"));
+                double scale = scaleText.empty() ? 64 : std::stod(scaleText);
+                if (unit == "MiB")
+                    scale *= 1 << 20;
+
+                const int fd = openEvent(type, eventConfig(pmu, description), false, -1, cpu);
+                if (fd >= 0)
+                    dramFds.push_back({ fd, scale });
+            }
+        }
+    }
+#endif
+};
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <fmt/fmt/format.h>
+
+#include "stopwatch.h"
+#include "trace.h"
+#include "util.h"
+
+// Parts of a training batch that Learner::learn times separately
+enum Phase : u8 {
+    DATA_WAIT,
+    REPLICA_SETUP,
+    FORWARD,
+    BACKWARD,
+    ACCUMULATE,
+    REDUCTION,
+    ALL_REDUCE, // Waiting for gradients of the other processes, see Communicator
+    CLIP,
+    OPTIMIZER_STEP,
+    CHECKPOINT,
+    CONSOLE_IO,
+    EVALUATION,
+    NUM_PHASES
+};
+
+inline const array<string, NUM_PHASES> phaseNames = {
+    "Data wait", "Replica setup", "Forward", "Backward", "Accumulation", "Reduction", "All-reduce", "Clip", "Optimizer step", "Checkpoint", "Console I/O", "Evaluation"
+};
+
+// Nanoseconds spent in each phase. Every lap charges the time since the previous one to a phase, so a
+// sequence of laps costs one clock read per phase. While tracing each lap is also a trace event.
+// Aligned so that per thread instances do not share cache lines
+struct alignas(64) PhaseTimer {
+    array<u64, NUM_PHASES> nanos{};
+
+    void lap(Phase phase) {
+        const u64 elapsed = watch.lap();
+        nanos[phase] += elapsed;
+        if (trace::enabled()) {
+            const u64 end = trace::now();
+            trace::record(phaseNames[phase].c_str(), "train", end > elapsed ? end - elapsed : 0, end);
+        }
+    }
+
+    // Time since the previous lap without charging it to a phase
+    u64 split() { return watch.lap(); }
+
+    void clear() {
+        nanos.fill(0);
+        watch.reset();
+    }
+
+    u64 total() const {
+        u64 sum = 0;
+        for (u64 n : nanos)
+            sum += n;
+        return sum;
+    }
+
+    // Splits the wall time of a parallel region between phases in proportion to the time the threads spent
+    // in them, then clears the thread timers
+    void distribute(u64 wallNanos, vector<PhaseTimer>& threadTimers) {
+        array<u64, NUM_PHASES> threadNanos{};
+        u64 threadTotal = 0;
+        for (PhaseTimer& t : threadTimers) {
+            for (usize p = 0; p < NUM_PHASES; p++)
+                threadNanos[p] += t.nanos[p];
+            threadTotal += t.total();
+            t.clear();
+        }
+        if (threadTotal == 0)
+            return;
+        for (usize p = 0; p < NUM_PHASES; p++)
+            nanos[p] += static_cast<u64>(static_cast<double>(wallNanos) * threadNanos[p] / threadTotal);
+    }
+
+    // Table of the time and share of each phase, flops is the work done over the timed span
+    void print(double flops) const {
+        const double totalMs = total() / 1e6;
+        cout << fmt::format("    {:<16}{:>12}{:>9}", "Phase", "Time (ms)", "Share") << endl;
+        for (usize p = 0; p < NUM_PHASES; p++) {
+            if (nanos[p] == 0)
+                continue;
+            const double ms = nanos[p] / 1e6;
+            cout << fmt::format("    {:<16}{:>12.1f}{:>8.1f}%", phaseNames[p], ms, totalMs > 0 ? ms / totalMs * 100 : 0) << endl;
+        }
+        cout << fmt::format("    {:<16}{:>12.1f}", "Total", totalMs) << endl;
+
+        // Only the phases that do the flops count towards the achieved rate
+        const double computeMs = (nanos[FORWARD] + nanos[BACKWARD] + nanos[ACCUMULATE]) / 1e6;
+        cout << fmt::format("    {:.2f} GFLOP/s overall, {:.2f} GFLOP/s in forward, backward and accumulation",
+                            totalMs > 0 ? flops / totalMs * 1e-6 : 0, computeMs > 0 ? flops / computeMs * 1e-6 : 0) << endl;
+    }
+
+  private:
+    Stopwatch<std::chrono::nanoseconds> watch;
+};
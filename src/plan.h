@@ -0,0 +1,444 @@
+#pragma once
+
+#include "network.h"
+#include "kernels.h"
+#include "io.h"
+
+#include <span>
+
+// Kernel a plan step runs, picked from the layer type and shape when the plan is compiled
+enum PlanKernel : i16 {
+    ROW_DOT,         // Dense product with one dot product per output row
+    COLUMN_AXPY,     // Dense product with transposed weights, for short or sparse inputs
+    BLOCK_SPARSE_MV, // BlockSparseMatrix product
+    DIRECT_CONV,     // Convolution without an im2col buffer
+    DIRECT_MAX_POOL,
+    DIRECT_AVG_POOL,
+    NUM_PLAN_KERNELS
+};
+
+inline array<string, NUM_PLAN_KERNELS> planKernelNames = {
+    "ROW_DOT", "COLUMN_AXPY", "BLOCK_SPARSE_MV", "DIRECT_CONV", "DIRECT_MAX_POOL", "DIRECT_AVG_POOL"
+};
+
+// Activation buffers of an ExecutionPlan for up to batchSize samples, each thread running a plan needs its own
+struct PlanWorkspace {
+    AlignedVector<float> buffers;
+    usize batchSize = 1;
+};
+
+struct PlanStep {
+    PlanKernel kernel;
+    Activation activation;
+    usize layer; // Both steps of a FACTORIZED layer refer to the same layer
+    usize inSize;
+    usize outSize;
+
+    kernels::MatrixView weights;
+    const float* biases = nullptr;
+    kernels::WindowShape window{};
+    BlockSparseMatrix sparseWeights;
+
+    // Offsets in PlanWorkspace::buffers, input is NETWORK_INPUT for the first step
+    usize input = 0;
+    usize preActivation = 0;
+    usize activated = 0;
+};
+
+// Immutable forward pass of a Network. Weights are packed into one 64 byte aligned arena in the
+// layout their kernel reads, or used in place from a mapped weights file when it already has that
+// layout. Activation buffers are assigned by liveness so that an inference plan of a plain layer
+// stack only uses two ping-pong buffers
+struct ExecutionPlan {
+    static constexpr usize NETWORK_INPUT = std::numeric_limits<usize>::max();
+    static constexpr usize NOT_KEPT = std::numeric_limits<usize>::max();
+
+    // Dense layers with fewer inputs than this use COLUMN_AXPY, row dot products are too short to vectorize
+    static constexpr usize COLUMN_AXPY_MAX_INPUT = 16;
+
+    PlanMode mode;
+    MathMode mathMode;
+    usize inputSize;
+    usize outputSize;
+
+    vector<PlanStep> steps;
+    AlignedVector<float> arena;
+    usize workspaceSize = 0;
+
+    // Workspace offsets of the preActivation and activated values of each layer, NOT_KEPT for buffers that
+    // an inference plan reuses. Index 0 is the input layer, which is read in place
+    vector<usize> layerPreActivation;
+    vector<usize> layerActivated;
+
+    ExecutionPlan(const Network& net, PlanMode mode = INFERENCE_PLAN, bool sparseInput = false) : mode(mode), mathMode(net.mathMode) {
+        build(net.layers, sparseInput);
+    }
+
+    // Plan over a mapped version 3 weights file, row major weights are read from the mapping without a copy
+    ExecutionPlan(std::shared_ptr<const MappedWeights> weights, PlanMode mode = INFERENCE_PLAN, bool sparseInput = false, MathMode mathMode = EXACT_MATH)
+        : mode(mode), mathMode(mathMode), mapping(std::move(weights)) {
+        vector<Layer> layers;
+        for (usize l = 0; l < mapping->numLayers(); l++)
+            layers.push_back(mapping->shape(l));
+        build(layers, sparseInput);
+    }
+
+    // Copies would point into the arena of the original
+    ExecutionPlan(const ExecutionPlan&) = delete;
+    ExecutionPlan& operator=(const ExecutionPlan&) = delete;
+    ExecutionPlan(ExecutionPlan&&) = default;
+    ExecutionPlan& operator=(ExecutionPlan&&) = default;
+
+    PlanWorkspace workspace(usize batchSize = 1) const {
+        return PlanWorkspace{ AlignedVector<float>(workspaceSize * batchSize), batchSize };
+    }
+
+    // Runs the plan and returns the output, which lives in the workspace until its next use
+    std::span<const float> run(const float* input, PlanWorkspace& ws) const {
+        assert(ws.buffers.size() >= workspaceSize);
+        for (const PlanStep& step : steps)
+            runStep(step, input, nullptr, ws.buffers.data());
+        return output(ws);
+    }
+
+    // Runs count samples laid out one after another in inputs, each step is run for the whole batch before
+    // the next one so its weights are read from memory once. Outputs are read with output(ws, sample)
+    void runBatch(const float* inputs, usize count, PlanWorkspace& ws) const {
+        assert(count <= ws.batchSize && ws.buffers.size() >= workspaceSize * count);
+        float* buffers = ws.buffers.data();
+
+        for (const PlanStep& step : steps) {
+            if (step.kernel == ROW_DOT && step.activation != SOFTMAX && count > 1) {
+                const bool first = step.input == NETWORK_INPUT;
+                const float* in = first ? inputs : buffers + step.input;
+                kernels::dispatch(step.activation, mathMode, [&]<Activation kAct, MathMode kMode>() {
+                    kernels::denseBatch<kAct, kMode>(step.weights, step.biases, in, first ? inputSize : workspaceSize, step.inSize,
+                                                     buffers + step.preActivation, buffers + step.activated, workspaceSize, step.outSize, count);
+                });
+                continue;
+            }
+
+            for (usize b = 0; b < count; b++)
+                runStep(step, inputs + b * inputSize, nullptr, buffers + b * workspaceSize);
+        }
+    }
+
+    std::span<const float> run(const InputLayer& input, PlanWorkspace& ws) const {
+        assert(input.size() == inputSize);
+        return run(input.data(), ws);
+    }
+
+    std::span<const float> run(const SparseInput& input, PlanWorkspace& ws) const {
+        assert(ws.buffers.size() >= workspaceSize);
+        assert(std::all_of(input.indices.begin(), input.indices.end(), [&](u32 idx) { return idx < inputSize; }));
+        if (steps.front().kernel != ROW_DOT && steps.front().kernel != COLUMN_AXPY)
+            exitWithMsg(planKernelNames[steps.front().kernel] + " steps do not support sparse inputs", -1);
+
+        runStep(steps.front(), nullptr, &input, ws.buffers.data());
+        for (usize s = 1; s < steps.size(); s++)
+            runStep(steps[s], nullptr, nullptr, ws.buffers.data());
+        return output(ws);
+    }
+
+    std::span<const float> output(const PlanWorkspace& ws, usize sample = 0) const {
+        return { ws.buffers.data() + sample * workspaceSize + outputOffset, outputSize };
+    }
+
+    // Saved values of a TRAINING_PLAN, l indexes the network's layers
+    std::span<const float> preActivation(usize l, const PlanWorkspace& ws) const {
+        assert(mode == TRAINING_PLAN && l > 0);
+        return { ws.buffers.data() + layerPreActivation[l], stepOf(l).outSize };
+    }
+    std::span<const float> activated(usize l, const PlanWorkspace& ws) const {
+        assert(mode == TRAINING_PLAN && l > 0);
+        return { ws.buffers.data() + layerActivated[l], stepOf(l).outSize };
+    }
+
+    usize weightBytes() const { return arena.size() * sizeof(float); }
+    usize workspaceBytes() const { return workspaceSize * sizeof(float); }
+
+    // One line per step with its kernel and shape
+    void print() const {
+        for (const PlanStep& step : steps)
+            cout << "layer " << step.layer << "  " << planKernelNames[step.kernel] << "  " << step.inSize << " -> "
+                 << step.outSize << "  " << activNames[step.activation] << endl;
+        cout << "weights " << formatNum(weightBytes()) << " bytes, workspace " << formatNum(workspaceBytes()) << " bytes" << endl;
+    }
+
+  private:
+    usize outputOffset = 0;
+
+    // Keeps the mapping the steps read from alive
+    std::shared_ptr<const MappedWeights> mapping;
+
+    void build(const vector<Layer>& layers, bool sparseInput) {
+        inputSize = layers[0].size;
+        outputSize = layers.back().size;
+
+        // Values are the buffers written by steps, numbered in order of definition
+        struct Value {
+            usize size;
+            usize definedAt;
+            usize lastUse;
+            usize offset = 0;
+        };
+        vector<Value> values;
+        vector<usize> inputValue, preValue, outputValue;
+
+        const auto define = [&](usize size) {
+            values.push_back({ size, steps.size(), steps.size() });
+            return values.size() - 1;
+        };
+        const auto use = [&](usize value) {
+            if (value != NETWORK_INPUT)
+                values[value].lastUse = steps.size();
+        };
+
+        // Arena offsets of the weights and biases of each step, the arena can only be pointed into once it has stopped growing
+        vector<std::pair<usize, usize>> weightOffsets, biasOffsets;
+
+        // Rows firstRow onwards of the weights of layer l, or of the given block of a mapped file
+        const auto pack = [&](usize l, weightfile::Block block, usize firstRow, usize rows, usize cols, bool transpose) {
+            if (mapping) {
+                const kernels::MatrixView view = mapping->matrix(l, block);
+                if (view.rows != rows || view.cols != cols)
+                    exitWithMsg("Layer " + std::to_string(l) + " of the weights file has weights of the wrong shape", -1);
+                if (!transpose)
+                    return view;
+            }
+
+            const usize outer = transpose ? cols : rows;
+            const usize stride = alignFloats(transpose ? rows : cols);
+            const usize offset = arena.size();
+            arena.resize(offset + outer * stride);
+            for (usize r = 0; r < rows; r++) {
+                const float* row = mapping ? mapping->matrix(l, block)[r] : layers[l].weights[firstRow + r].data();
+                for (usize c = 0; c < cols; c++)
+                    arena[offset + (transpose ? c * stride + r : r * stride + c)] = row[c];
+            }
+            weightOffsets.emplace_back(steps.size(), offset);
+            return kernels::MatrixView{ nullptr, outer, transpose ? rows : cols, stride };
+        };
+        const auto packBiases = [&](usize l, const vector<float>* zeros = nullptr) -> const float* {
+            if (mapping && !zeros) {
+                const std::span<const float> biases = mapping->array<float>(l, weightfile::BIASES);
+                if (biases.size() != (layers[l].type == CONV2D ? layers[l].channels : layers[l].size))
+                    exitWithMsg("Layer " + std::to_string(l) + " of the weights file has biases of the wrong shape", -1);
+                return biases.data();
+            }
+
+            const vector<float>& biases = zeros ? *zeros : layers[l].biases;
+            const usize offset = arena.size();
+            arena.resize(offset + alignFloats(biases.size()));
+            std::copy(biases.begin(), biases.end(), arena.begin() + offset);
+            biasOffsets.emplace_back(steps.size(), offset);
+            return nullptr;
+        };
+
+        usize current = NETWORK_INPUT;
+        layerPreActivation.assign(layers.size(), NOT_KEPT);
+        layerActivated.assign(layers.size(), NOT_KEPT);
+
+        for (usize l = 1; l < layers.size(); l++) {
+            const Layer& layer = layers[l];
+            const Layer& previous = layers[l - 1];
+            const bool sparseIn = sparseInput && l == 1;
+
+            if (sparseIn && layer.type != DENSE && layer.type != FACTORIZED)
+                exitWithMsg(layerTypeNames[layer.type] + " layers do not support sparse inputs", -1);
+
+            const auto addStep = [&](PlanKernel kernel, Activation activation, usize inSize, usize outSize, bool keep) {
+                PlanStep step;
+                step.kernel = kernel;
+                step.activation = activation;
+                step.layer = l;
+                step.inSize = inSize;
+                step.outSize = outSize;
+
+                use(current);
+                const usize pre = define(outSize);
+                // Inference writes the activation over the pre-activation
+                const usize out = keep ? define(outSize) : pre;
+                inputValue.push_back(current);
+                preValue.push_back(pre);
+                outputValue.push_back(out);
+                steps.push_back(std::move(step));
+                current = out;
+                return pre;
+            };
+
+            // readsInput is false for the up projection of a FACTORIZED layer, which reads the bottleneck
+            const auto denseStep = [&](weightfile::Block block, usize firstRow, usize inSize, usize outSize, Activation activation, const float* biases, bool keep, bool readsInput = true) {
+                const bool columns = (sparseIn && readsInput) || inSize < COLUMN_AXPY_MAX_INPUT;
+                const kernels::MatrixView view = pack(l, block, firstRow, outSize, inSize, columns);
+                const usize pre = addStep(columns ? COLUMN_AXPY : ROW_DOT, activation, inSize, outSize, keep);
+                steps.back().weights = view;
+                steps.back().biases = biases;
+                return pre;
+            };
+
+            const bool keep = mode == TRAINING_PLAN;
+            usize pre;
+            switch (layer.type) {
+            case DENSE:
+                pre = denseStep(weightfile::WEIGHTS, 0, previous.size, layer.size, layer.activation, packBiases(l), keep);
+                break;
+            case FACTORIZED: {
+                // The bottleneck is scratch in both modes, it is cheap to recompute from the layer input
+                const vector<float> zeros(layer.rank);
+                denseStep(weightfile::WEIGHTS, 0, previous.size, layer.rank, NO_ACTIVATION, packBiases(l, &zeros), false);
+                pre = denseStep(weightfile::UP_WEIGHTS, layer.rank, layer.rank, layer.size, layer.activation, packBiases(l), keep, false);
+                break;
+            }
+            case BLOCK_SPARSE: {
+                const float* biases = packBiases(l);
+                pre = addStep(BLOCK_SPARSE_MV, layer.activation, previous.size, layer.size, keep);
+                steps.back().sparseWeights = mapping ? mapping->sparseWeights(l) : layer.sparseWeights;
+                steps.back().biases = biases;
+                break;
+            }
+            case CONV2D: {
+                const kernels::MatrixView view = pack(l, weightfile::WEIGHTS, 0, layer.channels, layer.receptiveField(previous), false);
+                const float* biases = packBiases(l);
+                pre = addStep(DIRECT_CONV, layer.activation, previous.size, layer.size, keep);
+                steps.back().weights = view;
+                steps.back().biases = biases;
+                steps.back().window = layer.window(previous);
+                break;
+            }
+            case MAX_POOL:
+            case AVG_POOL:
+                pre = addStep(layer.type == MAX_POOL ? DIRECT_MAX_POOL : DIRECT_AVG_POOL, layer.activation, previous.size, layer.size, keep);
+                steps.back().window = layer.window(previous);
+                break;
+            default: exitWithMsg("Unsupported layer type: " + layerTypeNames[layer.type], -1);
+            }
+
+            if (keep) {
+                layerPreActivation[l] = pre;
+                layerActivated[l] = current;
+            }
+        }
+
+        // Kept values and the output stay live until the end of the pass
+        for (usize l = 1; l < layers.size(); l++) {
+            if (layerPreActivation[l] != NOT_KEPT)
+                values[layerPreActivation[l]].lastUse = steps.size();
+            if (layerActivated[l] != NOT_KEPT)
+                values[layerActivated[l]].lastUse = steps.size();
+        }
+        values[current].lastUse = steps.size();
+
+        // Greedy slot assignment in order of definition, a slot is reused once its last value is dead.
+        // A step never writes a slot it reads from, since its input is still live while it runs
+        struct Slot {
+            usize capacity;
+            usize freeAfter;
+            vector<usize> values;
+        };
+        vector<Slot> slots;
+        for (usize v = 0; v < values.size(); v++) {
+            Slot* slot = nullptr;
+            for (Slot& s : slots)
+                if (s.freeAfter < values[v].definedAt && (!slot || s.capacity > slot->capacity))
+                    slot = &s;
+            if (!slot) {
+                slots.push_back({ 0, 0, {} });
+                slot = &slots.back();
+            }
+            slot->capacity = std::max(slot->capacity, values[v].size);
+            slot->freeAfter = values[v].lastUse;
+            slot->values.push_back(v);
+        }
+
+        for (const Slot& slot : slots) {
+            for (usize v : slot.values)
+                values[v].offset = workspaceSize;
+            workspaceSize += alignFloats(slot.capacity);
+        }
+
+        const auto offsetOf = [&](usize value) { return value == NETWORK_INPUT ? NETWORK_INPUT : values[value].offset; };
+        for (usize s = 0; s < steps.size(); s++) {
+            steps[s].input = offsetOf(inputValue[s]);
+            steps[s].preActivation = offsetOf(preValue[s]);
+            steps[s].activated = offsetOf(outputValue[s]);
+        }
+        for (usize l = 1; l < layers.size(); l++) {
+            if (layerPreActivation[l] != NOT_KEPT)
+                layerPreActivation[l] = offsetOf(layerPreActivation[l]);
+            if (layerActivated[l] != NOT_KEPT)
+                layerActivated[l] = offsetOf(layerActivated[l]);
+        }
+        outputOffset = offsetOf(current);
+
+        for (const auto& [step, offset] : weightOffsets)
+            steps[step].weights.data = arena.data() + offset;
+        for (const auto& [step, offset] : biasOffsets)
+            steps[step].biases = arena.data() + offset;
+    }
+
+    // Last step of layer l
+    const PlanStep& stepOf(usize l) const {
+        for (usize s = steps.size(); s-- > 0;)
+            if (steps[s].layer == l)
+                return steps[s];
+        exitWithMsg("Layer " + std::to_string(l) + " is not in the plan", -1);
+    }
+
+    // buffers is the workspace region of the sample being run
+    void runStep(const PlanStep& step, const float* networkInput, const SparseInput* sparseInput, float* buffers) const {
+        const float* in = step.input == NETWORK_INPUT ? networkInput : buffers + step.input;
+        float* pre = buffers + step.preActivation;
+        float* out = buffers + step.activated;
+        const float* biases = step.biases;
+
+        // Softmax is not elementwise, it is applied after the kernel has stored the logits
+        const Activation fused = step.activation == SOFTMAX ? NO_ACTIVATION : step.activation;
+
+        kernels::dispatch(fused, mathMode, [&]<Activation kAct, MathMode kMode>() {
+            switch (step.kernel) {
+            case ROW_DOT:
+                if (sparseInput)
+                    kernels::dense<kAct, kMode>(step.weights, biases, *sparseInput, pre, out, step.outSize);
+                else
+                    kernels::dense<kAct, kMode>(step.weights, biases, in, step.inSize, pre, out, step.outSize);
+                break;
+            case COLUMN_AXPY:
+                if (sparseInput)
+                    kernels::denseColumns<kAct, kMode>(step.weights, biases, *sparseInput, pre, out, step.outSize);
+                else
+                    kernels::denseColumns<kAct, kMode>(step.weights, biases, in, step.inSize, pre, out, step.outSize);
+                break;
+            case BLOCK_SPARSE_MV:
+                std::copy(biases, biases + step.outSize, pre);
+                step.sparseWeights.multiplyAdd(in, pre);
+                kernels::activate<kAct, kMode>(pre, out, step.outSize);
+                break;
+            case DIRECT_CONV:
+                kernels::conv2D(step.weights, biases, in, pre, step.window);
+                kernels::activate<kAct, kMode>(pre, out, step.outSize);
+                break;
+            case DIRECT_MAX_POOL:
+            case DIRECT_AVG_POOL:
+                if (step.kernel == DIRECT_MAX_POOL)
+                    kernels::pool<true>(in, pre, step.window);
+                else
+                    kernels::pool<false>(in, pre, step.window);
+                kernels::activate<kAct, kMode>(pre, out, step.outSize);
+                break;
+            default: exitWithMsg("Unsupported plan kernel", -1);
+            }
+        });
+
+        if (step.activation == SOFTMAX) {
+            if (mathMode == FAST_MATH)
+                kernels::softmax<FAST_MATH>(pre, out, step.outSize);
+            else
+                kernels::softmax<EXACT_MATH>(pre, out, step.outSize);
+        }
+    }
+};
+
+inline ExecutionPlan Network::compile(PlanMode mode, bool sparseInput) const {
+    return ExecutionPlan(*this, mode, sparseInput);
+}
@@ -0,0 +1,146 @@
+#pragma once
+
+#include "network.h"
+
+enum PruneGranularity : i16 {
+    UNSTRUCTURED,
+    BLOCK_4X4,
+    BLOCK_8X1
+};
+
+namespace pruning {
+    inline std::pair<usize, usize> blockShape(PruneGranularity granularity) {
+        switch (granularity) {
+        case BLOCK_4X4: return { 4, 4 };
+        case BLOCK_8X1: return { 8, 1 };
+        default: return { 1, 1 };
+        }
+    }
+
+    // Fraction of the weights of a layer that are zero
+    inline float sparsity(const Layer& layer) {
+        if (layer.type == BLOCK_SPARSE) {
+            const BlockSparseMatrix& m = layer.sparseWeights;
+            usize nonzero = 0;
+            for (const float f : m.values)
+                nonzero += f != 0;
+            return 1 - nonzero / static_cast<float>(m.rows * m.cols);
+        }
+
+        usize zero = 0, total = 0;
+        for (const vector<float>& row : layer.weights) {
+            for (const float f : row)
+                zero += f == 0;
+            total += row.size();
+        }
+        return total ? zero / static_cast<float>(total) : 0;
+    }
+
+    // Zeroes the blocks of a dense layer with the lowest sum of absolute weights until
+    // the given fraction of blocks is zero
+    inline void magnitude(Layer& layer, float sparsity, PruneGranularity granularity) {
+        if (layer.type != DENSE || layer.weights.empty() || sparsity <= 0)
+            return;
+
+        const auto [blockRows, blockCols] = blockShape(granularity);
+        const usize rows = layer.weights.size();
+        const usize cols = layer.weights[0].size();
+        const usize numBlockRows = (rows + blockRows - 1) / blockRows;
+        const usize numBlockCols = (cols + blockCols - 1) / blockCols;
+
+        vector<float> scores(numBlockRows * numBlockCols);
+        for (usize r = 0; r < rows; r++)
+            for (usize c = 0; c < cols; c++)
+                scores[r / blockRows * numBlockCols + c / blockCols] += std::abs(layer.weights[r][c]);
+
+        const usize toPrune = std::min<usize>(scores.size(), sparsity * scores.size());
+        if (toPrune == 0)
+            return;
+
+        vector<float> sorted = scores;
+        std::nth_element(sorted.begin(), sorted.begin() + toPrune - 1, sorted.end());
+        const float threshold = sorted[toPrune - 1];
+
+        // Blocks tied with the threshold are only pruned until the target is reached
+        usize belowThreshold = std::count_if(scores.begin(), scores.end(), [&](float s) { return s < threshold; });
+        usize tiesToPrune = toPrune - belowThreshold;
+
+        vector<u8> pruned(scores.size());
+        for (usize b = 0; b < scores.size(); b++) {
+            if (scores[b] < threshold)
+                pruned[b] = true;
+            else if (scores[b] == threshold && tiesToPrune > 0) {
+                pruned[b] = true;
+                tiesToPrune--;
+            }
+        }
+
+        for (usize r = 0; r < rows; r++)
+            for (usize c = 0; c < cols; c++)
+                if (pruned[r / blockRows * numBlockCols + c / blockCols])
+                    layer.weights[r][c] = 0;
+    }
+
+    inline void magnitude(Network& net, float sparsity, PruneGranularity granularity) {
+        for (usize l = 1; l < net.layers.size(); l++)
+            magnitude(net.layers[l], sparsity, granularity);
+    }
+
+    // Converts every dense layer with at least minSparsity zero weights to block sparse storage.
+    // The result is inference only
+    inline void sparsify(Network& net, PruneGranularity granularity, float minSparsity = 0.5f) {
+        const auto [blockRows, blockCols] = blockShape(granularity);
+        for (usize l = 1; l < net.layers.size(); l++) {
+            Layer& layer = net.layers[l];
+            if (layer.type == DENSE && !layer.weights.empty() && sparsity(layer) >= minSparsity)
+                layer.toBlockSparse(blockRows, blockCols);
+        }
+    }
+}
+
+// Gradual magnitude pruning during training. The sparsity follows a cubic ramp from 0 at
+// startEpoch to finalSparsity at endEpoch and pruned weights are kept at zero after every step
+struct Pruner {
+    float finalSparsity;
+    PruneGranularity granularity;
+    usize startEpoch;
+    usize endEpoch;
+
+    MultiVector<u8, 3> masks; // Indexed [layer][currNeuron][prevLayerNeuron], 0 where pruned
+
+    Pruner(float finalSparsity, PruneGranularity granularity = UNSTRUCTURED, usize startEpoch = 0, usize endEpoch = 1)
+        : finalSparsity(finalSparsity), granularity(granularity), startEpoch(startEpoch), endEpoch(endEpoch) {}
+
+    float targetSparsity(usize epoch) const {
+        if (epoch < startEpoch)
+            return 0;
+        if (epoch >= endEpoch)
+            return finalSparsity;
+        const float progress = (epoch - startEpoch) / static_cast<float>(endEpoch - startEpoch);
+        return finalSparsity * (1 - std::pow(1 - progress, 3));
+    }
+
+    // Prunes to the sparsity of the given epoch and records which weights were removed
+    void update(Network& net, usize epoch) {
+        pruning::magnitude(net, targetSparsity(epoch), granularity);
+
+        masks.resize(net.layers.size());
+        for (usize l = 1; l < net.layers.size(); l++) {
+            const MultiVector<float, 2>& weights = net.layers[l].weights;
+            masks[l].resize(weights.size());
+            for (usize i = 0; i < weights.size(); i++) {
+                masks[l][i].resize(weights[i].size());
+                for (usize j = 0; j < weights[i].size(); j++)
+                    masks[l][i][j] = weights[i][j] != 0;
+            }
+        }
+    }
+
+    void apply(Network& net) const {
+        for (usize l = 1; l < masks.size(); l++)
+            for (usize i = 0; i < masks[l].size(); i++)
+                for (usize j = 0; j < masks[l][i].size(); j++)
+                    if (!masks[l][i][j])
+                        net.layers[l].weights[i][j] = 0;
+    }
+};
@@ -0,0 +1,252 @@
+#pragma once
+
+#include "plan.h"
+
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <deque>
+#include <mutex>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+// Frames are a u32 payload length followed by the payload. A request payload is a u64 id and the
+// network's input as floats, the response to it carries the same id and the output. Malformed
+// requests are answered with an id and no output
+namespace protocol {
+    // Reads or writes exactly size bytes, false on EOF or error
+    inline bool readAll(int fd, void* dest, usize size) {
+        char* ptr = static_cast<char*>(dest);
+        while (size > 0) {
+            const auto got = ::read(fd, ptr, size);
+            if (got <= 0)
+                return false;
+            ptr += got;
+            size -= got;
+        }
+        return true;
+    }
+
+    inline bool writeAll(int fd, const void* src, usize size) {
+        const char* ptr = static_cast<const char*>(src);
+        while (size > 0) {
+            const auto sent = ::write(fd, ptr, size);
+            if (sent <= 0)
+                return false;
+            ptr += sent;
+            size -= sent;
+        }
+        return true;
+    }
+
+    // Frames larger than this are treated as a broken stream rather than allocated
+    constexpr u32 MAX_FRAME_BYTES = 64 << 20;
+
+    inline bool readFrame(int fd, vector<char>& payload) {
+        u32 size;
+        if (!readAll(fd, &size, sizeof(size)) || size > MAX_FRAME_BYTES)
+            return false;
+        payload.resize(size);
+        return readAll(fd, payload.data(), size);
+    }
+
+    inline bool writeFrame(int fd, u64 id, std::span<const float> values) {
+        const u32 size = sizeof(u64) + values.size_bytes();
+        vector<char> frame(sizeof(u32) + sizeof(u64));
+        std::memcpy(frame.data(), &size, sizeof(u32));
+        std::memcpy(frame.data() + sizeof(u32), &id, sizeof(u64));
+        const char* bytes = reinterpret_cast<const char*>(values.data());
+        frame.insert(frame.end(), bytes, bytes + values.size_bytes());
+        return writeAll(fd, frame.data(), frame.size());
+    }
+}
+
+struct ServerConfig {
+    usize maxBatch = 32;
+    u64 maxLatencyMicros = 2000; // Longest a request waits for its micro-batch to fill up
+    usize workers = 1;
+};
+
+// Groups requests from any number of streams into micro-batches that a pool of workers runs through
+// ExecutionPlan::runBatch. A batch is started as soon as it is full or its oldest request has waited
+// maxLatencyMicros
+struct InferenceServer {
+    using Clock = std::chrono::steady_clock;
+
+    // Responses for one stream, written by whichever worker ran the request
+    struct Connection {
+        int inFd;
+        int outFd;
+        bool ownsFd;
+        std::mutex writeMut;
+
+        Connection(int inFd, int outFd, bool ownsFd) : inFd(inFd), outFd(outFd), ownsFd(ownsFd) {}
+        ~Connection() {
+            if (ownsFd)
+                ::close(inFd);
+        }
+
+        void respond(u64 id, std::span<const float> output) {
+            std::lock_guard lock(writeMut);
+            // A client that hung up just loses its responses
+            protocol::writeFrame(outFd, id, output);
+        }
+    };
+
+    struct Request {
+        std::shared_ptr<Connection> connection;
+        u64 id;
+        vector<float> input;
+        Clock::time_point arrival;
+    };
+
+    const ExecutionPlan& plan;
+    ServerConfig config;
+
+    std::atomic<u64> requests = 0;
+    std::atomic<u64> batches = 0;
+
+    InferenceServer(const ExecutionPlan& plan, ServerConfig config) : plan(plan), config(config) {
+        assert(config.maxBatch > 0 && config.workers > 0);
+        for (usize t = 0; t < config.workers; t++)
+            workers.emplace_back([this]() { workerLoop(); });
+    }
+
+    InferenceServer(const InferenceServer&) = delete;
+    InferenceServer& operator=(const InferenceServer&) = delete;
+
+    // Answers everything already queued, then stops the workers
+    ~InferenceServer() {
+        drain();
+        {
+            std::lock_guard lock(mut);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (std::thread& worker : workers)
+            worker.join();
+    }
+
+    void submit(std::shared_ptr<Connection> connection, u64 id, vector<float> input) {
+        {
+            std::lock_guard lock(mut);
+            queue.push_back({ std::move(connection), id, std::move(input), Clock::now() });
+            inFlight++;
+        }
+        cv.notify_all();
+    }
+
+    // Blocks until every submitted request has been answered
+    void drain() {
+        std::unique_lock lock(mut);
+        idle.wait(lock, [this]() { return inFlight == 0; });
+    }
+
+    // Serves requests read from inFd until it is closed, responses go to outFd
+    void serveStream(int inFd, int outFd, bool ownsFd = false) {
+        auto connection = std::make_shared<Connection>(inFd, outFd, ownsFd);
+        const usize inputBytes = plan.inputSize * sizeof(float);
+
+        vector<char> payload;
+        while (protocol::readFrame(inFd, payload)) {
+            if (payload.size() < sizeof(u64))
+                break;
+
+            u64 id;
+            std::memcpy(&id, payload.data(), sizeof(u64));
+            if (payload.size() != sizeof(u64) + inputBytes) {
+                connection->respond(id, {});
+                continue;
+            }
+
+            vector<float> input(plan.inputSize);
+            std::memcpy(input.data(), payload.data() + sizeof(u64), inputBytes);
+            submit(connection, id, std::move(input));
+        }
+    }
+
+    // Accepts connections on a Unix domain socket forever, each one is read on its own thread
+    void serveSocket(const string& path) {
+#ifdef _WIN32
+        exitWithMsg("Unix domain sockets are not supported on Windows, serve over stdin instead", -1);
+#else
+        const int listenFd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path))
+            exitWithMsg("Socket path is too long: " + path, -1);
+        std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+        ::unlink(path.c_str());
+        if (listenFd < 0 || ::bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(listenFd, 128) != 0)
+            exitWithMsg("Failed to listen on " + path, -1);
+
+        while (true) {
+            const int fd = ::accept(listenFd, nullptr, nullptr);
+            if (fd < 0)
+                continue;
+            std::thread([this, fd]() { serveStream(fd, fd, true); }).detach();
+        }
+#endif
+    }
+
+    float meanBatchSize() const { return batches ? requests / static_cast<float>(batches) : 0; }
+
+  private:
+    std::mutex mut;
+    std::condition_variable cv;
+    std::condition_variable idle;
+    std::deque<Request> queue;
+    usize inFlight = 0;
+    bool stopping = false;
+
+    vector<std::thread> workers;
+
+    void workerLoop() {
+        PlanWorkspace ws = plan.workspace(config.maxBatch);
+        vector<float> inputs(config.maxBatch * plan.inputSize);
+        vector<Request> batch;
+
+        std::unique_lock lock(mut);
+        while (true) {
+            cv.wait(lock, [this]() { return stopping || !queue.empty(); });
+            if (queue.empty())
+                return;
+
+            // Give the batch until its oldest request's deadline to fill up
+            const Clock::time_point deadline = queue.front().arrival + std::chrono::microseconds(config.maxLatencyMicros);
+            cv.wait_until(lock, deadline, [this]() { return stopping || queue.size() >= config.maxBatch; });
+            if (queue.empty())
+                continue;
+
+            const usize count = std::min(queue.size(), config.maxBatch);
+            batch.clear();
+            for (usize i = 0; i < count; i++) {
+                batch.push_back(std::move(queue.front()));
+                queue.pop_front();
+            }
+            lock.unlock();
+
+            for (usize i = 0; i < count; i++)
+                std::copy(batch[i].input.begin(), batch[i].input.end(), inputs.begin() + i * plan.inputSize);
+            plan.runBatch(inputs.data(), count, ws);
+            for (usize i = 0; i < count; i++)
+                batch[i].connection->respond(batch[i].id, plan.output(ws, i));
+
+            requests += count;
+            batches++;
+            // Connections are closed once their last response is out
+            batch.clear();
+
+            lock.lock();
+            inFlight -= count;
+            if (inFlight == 0)
+                idle.notify_all();
+        }
+    }
+};
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "types.h"
+
+// Block compressed sparse row matrix, only blocks with a nonzero weight are stored
+struct BlockSparseMatrix {
+    usize rows = 0;
+    usize cols = 0;
+    usize blockRows = 1;
+    usize blockCols = 1;
+
+    vector<u32> rowPtr;   // Index of the first block of each block row, numBlockRows() + 1 entries
+    vector<u32> blockIdx; // Block column of each stored block
+    vector<float> values; // blockRows * blockCols row major values per stored block
+
+    BlockSparseMatrix() = default;
+
+    BlockSparseMatrix(const MultiVector<float, 2>& dense, usize blockRows, usize blockCols) {
+        assert(!dense.empty());
+        this->rows = dense.size();
+        this->cols = dense[0].size();
+        this->blockRows = blockRows;
+        this->blockCols = blockCols;
+
+        rowPtr.push_back(0);
+        for (usize br = 0; br < numBlockRows(); br++) {
+            for (usize bc = 0; bc < numBlockCols(); bc++) {
+                bool nonzero = false;
+                for (usize r = br * blockRows; r < std::min(rows, (br + 1) * blockRows); r++)
+                    for (usize c = bc * blockCols; c < std::min(cols, (bc + 1) * blockCols); c++)
+                        nonzero |= dense[r][c] != 0;
+
+                if (!nonzero)
+                    continue;
+
+                // Blocks on the edges are zero padded
+                blockIdx.push_back(bc);
+                for (usize r = br * blockRows; r < (br + 1) * blockRows; r++)
+                    for (usize c = bc * blockCols; c < (bc + 1) * blockCols; c++)
+                        values.push_back(r < rows && c < cols ? dense[r][c] : 0);
+            }
+            rowPtr.push_back(blockIdx.size());
+        }
+    }
+
+    usize numBlockRows() const { return (rows + blockRows - 1) / blockRows; }
+    usize numBlockCols() const { return (cols + blockCols - 1) / blockCols; }
+    usize numBlocks() const { return blockIdx.size(); }
+
+    MultiVector<float, 2> toDense() const {
+        MultiVector<float, 2> dense(rows, vector<float>(cols));
+        for (usize br = 0; br < numBlockRows(); br++) {
+            for (usize k = rowPtr[br]; k < rowPtr[br + 1]; k++) {
+                const float* block = &values[k * blockRows * blockCols];
+                for (usize r = 0; r < blockRows && br * blockRows + r < rows; r++)
+                    for (usize c = 0; c < blockCols && blockIdx[k] * blockCols + c < cols; c++)
+                        dense[br * blockRows + r][blockIdx[k] * blockCols + c] = block[r * blockCols + c];
+            }
+        }
+        return dense;
+    }
+
+    // out[r] += sum over c of W[r][c] * in[c]
+    void multiplyAdd(const float* in, float* out) const {
+        if (blockRows == 4 && blockCols == 4)
+            multiplyAddImpl<4, 4>(in, out);
+        else if (blockRows == 8 && blockCols == 1)
+            multiplyAddImpl<8, 1>(in, out);
+        else if (blockRows == 1 && blockCols == 1)
+            multiplyAddImpl<1, 1>(in, out);
+        else
+            multiplyAddImpl<0, 0>(in, out);
+    }
+
+   private:
+    // Block dimensions are compile time constants for the common shapes, 0 falls back to the runtime ones
+    template<usize kBR, usize kBC>
+    void multiplyAddImpl(const float* in, float* out) const {
+        const usize bR = kBR ? kBR : blockRows;
+        const usize bC = kBC ? kBC : blockCols;
+
+        for (usize br = 0; br < numBlockRows(); br++) {
+            const usize r0 = br * bR;
+            const bool fullRows = r0 + bR <= rows;
+
+            for (usize k = rowPtr[br]; k < rowPtr[br + 1]; k++) {
+                const usize c0 = blockIdx[k] * bC;
+                const float* block = &values[k * bR * bC];
+
+                if (fullRows && c0 + bC <= cols) {
+                    for (usize r = 0; r < bR; r++) {
+                        float sum = 0;
+                        for (usize c = 0; c < bC; c++)
+                            sum += block[r * bC + c] * in[c0 + c];
+                        out[r0 + r] += sum;
+                    }
+                }
+                else {
+                    for (usize r = 0; r < bR && r0 + r < rows; r++)
+                        for (usize c = 0; c < bC && c0 + c < cols; c++)
+                            out[r0 + r] += block[r * bC + c] * in[c0 + c];
+                }
+            }
+        }
+    }
+};
@@ -0,0 +1,136 @@
+#pragma once
+
+#include "kernels.h"
+#include "io.h"
+
+#include <tuple>
+
+// Shape of one layer of a StaticNetwork
+template<usize kSize, Activation kAct>
+struct StaticLayer {
+    static constexpr usize size = kSize;
+    static constexpr Activation activation = kAct;
+};
+
+// Dense layer whose sizes and activation are compile time constants, buffers are stored inline
+template<usize kIn, usize kOut, Activation kAct>
+struct StaticDense {
+    static constexpr usize inputSize = kIn;
+    static constexpr usize size = kOut;
+    static constexpr Activation activation = kAct;
+
+    // Indexed [currNeuron][prevLayerNeuron] like Layer::weights
+    MultiArray<float, kOut, kIn> weights;
+    array<float, kOut> biases;
+
+    array<float, kOut> preActivation;
+    array<float, kOut> activated;
+
+    template<MathMode mode>
+    void forward(const float* in) {
+        kernels::dense<elementwise(), mode>(weights, biases.data(), in, kIn, preActivation.data(), activated.data(), kOut);
+        if constexpr (kAct == SOFTMAX)
+            kernels::softmax<mode>(preActivation.data(), activated.data(), kOut);
+    }
+
+    template<MathMode mode>
+    void forward(const SparseInput& in) {
+        kernels::dense<elementwise(), mode>(weights, biases.data(), in, preActivation.data(), activated.data(), kOut);
+        if constexpr (kAct == SOFTMAX)
+            kernels::softmax<mode>(preActivation.data(), activated.data(), kOut);
+    }
+
+  private:
+    // Softmax is applied after the kernel has stored the logits
+    static constexpr Activation elementwise() { return kAct == SOFTMAX ? NO_ACTIVATION : kAct; }
+};
+
+namespace internal {
+    // Chains StaticLayer shapes into a tuple of StaticDense layers, each taking the previous size as input
+    template<usize kIn, typename... Ls>
+    struct StaticLayersImpl {
+        using Type = std::tuple<>;
+    };
+
+    template<usize kIn, typename L, typename... Ls>
+    struct StaticLayersImpl<kIn, L, Ls...> {
+        using Type = decltype(std::tuple_cat(
+            std::declval<std::tuple<StaticDense<kIn, L::size, L::activation>>>(),
+            std::declval<typename StaticLayersImpl<L::size, Ls...>::Type>()
+        ));
+    };
+}
+
+// Inference only counterpart of Network for a fixed dense topology, e.g.
+// StaticNetwork<768, StaticLayer<256, SCRELU>, StaticLayer<1, NO_ACTIVATION>>.
+// Every loop bound is a constant and nothing is heap allocated, large models should be
+// given static storage or a unique_ptr rather than live on the stack
+template<usize kInput, typename... Layers>
+struct StaticNetwork {
+    static_assert(sizeof...(Layers) > 0, "StaticNetwork needs at least an output layer");
+
+    static constexpr usize inputSize = kInput;
+    static constexpr usize numLayers = sizeof...(Layers);
+    static constexpr usize outputSize = std::tuple_element_t<numLayers - 1, std::tuple<Layers...>>::size;
+
+    typename internal::StaticLayersImpl<kInput, Layers...>::Type layers;
+
+    template<MathMode mode = EXACT_MATH>
+    const array<float, outputSize>& forward(const array<float, kInput>& input) {
+        std::get<0>(layers).template forward<mode>(input.data());
+        forwardFrom<1, mode>();
+        return output();
+    }
+
+    template<MathMode mode = EXACT_MATH>
+    const array<float, outputSize>& forward(const SparseInput& input) {
+        assert(std::all_of(input.indices.begin(), input.indices.end(), [](u32 idx) { return idx < kInput; }));
+        std::get<0>(layers).template forward<mode>(input);
+        forwardFrom<1, mode>();
+        return output();
+    }
+
+    const array<float, outputSize>& output() const {
+        return std::get<numLayers - 1>(layers).activated;
+    }
+
+    // Copies the weights of a dynamic network with exactly this topology
+    void load(const Network& net) {
+        if (net.layers.size() != numLayers + 1 || net.layers[0].size != kInput)
+            exitWithMsg("Network does not match the StaticNetwork topology", -1);
+
+        loadFrom<0>(net);
+    }
+
+    // Reads a file written by saveWeights
+    void load(const string& path) {
+        load(loadWeights(path));
+    }
+
+  private:
+    template<usize kIdx, MathMode mode>
+    void forwardFrom() {
+        if constexpr (kIdx < numLayers) {
+            std::get<kIdx>(layers).template forward<mode>(std::get<kIdx - 1>(layers).activated.data());
+            forwardFrom<kIdx + 1, mode>();
+        }
+    }
+
+    template<usize kIdx>
+    void loadFrom(const Network& net) {
+        if constexpr (kIdx < numLayers) {
+            auto& layer = std::get<kIdx>(layers);
+            const Layer& from = net.layers[kIdx + 1];
+
+            if (from.type != DENSE || from.size != layer.size || from.activation != layer.activation)
+                exitWithMsg("Layer " + std::to_string(kIdx + 1) + " does not match the StaticNetwork topology, expected a "
+                            + std::to_string(layer.size) + " neuron DENSE " + activNames[layer.activation] + " layer", -1);
+
+            for (usize i = 0; i < layer.size; i++)
+                std::copy(from.weights[i].begin(), from.weights[i].end(), layer.weights[i].begin());
+            std::copy(from.biases.begin(), from.biases.end(), layer.biases.begin());
+
+            loadFrom<kIdx + 1>(net);
+        }
+    }
+};
@@ -31,6 +31,19 @@ class Stopwatch {
         return std::chrono::duration_cast<Precision>(std::chrono::high_resolution_clock::now() - startTime).count() - pausedTime;
     }
 
+    // elapsed() followed by reset() with a single clock read
+    u64 lap() {
+        const auto now = std::chrono::high_resolution_clock::now();
+        u64 pausedTime = this->pausedTime;
+        if (paused)
+            pausedTime += std::chrono::duration_cast<Precision>(now - pauseTime).count();
+        const u64 elapsed = std::chrono::duration_cast<Precision>(now - startTime).count() - pausedTime;
+        startTime = now;
+        this->pausedTime = 0;
+        paused = false;
+        return elapsed;
+    }
+
     void pause() {
         paused    = true;
         pauseTime = std::chrono::high_resolution_clock::now();
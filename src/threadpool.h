@@ -0,0 +1,346 @@
+#pragma once
+
+#include "types.h"
+
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <atomic>
+#include <future>
+#include <latch>
+#include <thread>
+#include <deque>
+#include <mutex>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Persistent threads that run submitted tasks. Every worker has its own deque: it pushes tasks it submits and
+// pops them from the back, and idle workers steal from the front of the others, so tasks of uneven cost even
+// out without a shared queue. Tasks submitted from outside the pool are spread over the deques round robin
+struct ThreadPool {
+    using Task = std::function<void()>;
+
+    // 0 threads for one per hardware thread. pinThreads binds worker i to CPU i
+    explicit ThreadPool(usize threads = 0, bool pinThreads = false) {
+        if (threads == 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+
+        vector<vector<u32>> workerCpus(threads);
+        if (pinThreads)
+            for (usize i = 0; i < threads; i++)
+                workerCpus[i] = { static_cast<u32>(i % std::max(1u, std::thread::hardware_concurrency())) };
+        start(workerCpus);
+    }
+
+    // One worker per entry, each allowed to run on the listed CPUs only, or anywhere if the list is empty
+    explicit ThreadPool(const vector<vector<u32>>& workerCpus) { start(workerCpus); }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Runs everything already submitted, then stops the workers
+    ~ThreadPool() {
+        {
+            std::lock_guard lock(sleepMut);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& worker : workers)
+            worker.join();
+    }
+
+    usize size() const { return workers.size(); }
+
+    // Index of the worker of this pool running the caller, -1 on any other thread
+    i64 currentWorker() const {
+        const WorkerId& id = threadWorker();
+        return id.pool == this ? static_cast<i64>(id.index) : -1;
+    }
+
+    // Runs task on any worker. An exception it throws is kept instead of ending the worker and is rethrown by
+    // the next call to submit()
+    void submit(Task task) {
+        std::exception_ptr error;
+        {
+            std::lock_guard lock(sleepMut);
+            std::swap(error, taskError);
+        }
+        if (error)
+            std::rethrow_exception(error);
+        enqueue(std::move(task));
+    }
+
+    // Runs task on the given worker, other workers do not steal it
+    void submitTo(usize worker, Task task) {
+        {
+            std::lock_guard lock(sleepMut);
+            pinnedCount[worker]++;
+        }
+        {
+            std::lock_guard lock(queues[worker]->mut);
+            queues[worker]->pinned.push_back(std::move(task));
+        }
+        // Every worker is woken since only one of them can run it
+        wake.notify_all();
+    }
+
+    // Calls func(worker) once on every worker and returns when all are done, such as to allocate per worker
+    // buffers on the thread that uses them so their pages are placed on its NUMA node. Rethrows the first
+    // exception of any of the calls
+    template<typename F>
+    void runOnEach(F&& func) {
+        struct Group {
+            std::atomic<usize> pending;
+            std::mutex mut;
+            std::condition_variable done;
+            std::exception_ptr error;
+        } group;
+        group.pending = workers.size();
+
+        for (usize w = 0; w < workers.size(); w++)
+            submitTo(w, [&, w]() {
+                std::exception_ptr error;
+                try {
+                    func(w);
+                }
+                catch (...) {
+                    error = std::current_exception();
+                }
+
+                // Counted down under the mutex for the same reason as in parallelFor()
+                std::lock_guard lock(group.mut);
+                if (error && !group.error)
+                    group.error = error;
+                if (group.pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    group.done.notify_all();
+            });
+
+        const i64 self = currentWorker();
+        if (self >= 0) {
+            while (group.pending.load(std::memory_order_acquire) > 0)
+                if (!runOne(self))
+                    std::this_thread::yield();
+        }
+        else {
+            std::unique_lock lock(group.mut);
+            group.done.wait(lock, [&]() { return group.pending.load(std::memory_order_acquire) == 0; });
+        }
+
+        std::lock_guard lock(group.mut);
+        if (group.error)
+            std::rethrow_exception(group.error);
+    }
+
+    // Runs func on the pool, the future holds its result or exception
+    template<typename F>
+    auto async(F&& func) -> std::future<std::invoke_result_t<F>> {
+        using Result = std::invoke_result_t<F>;
+        auto task = std::make_shared<std::packaged_task<Result()>>(std::forward<F>(func));
+        std::future<Result> result = task->get_future();
+        enqueue([task]() { (*task)(); });
+        return result;
+    }
+
+    // Calls body(i, worker) for every i in [begin, end) as tasks of grain indices each, where worker is the index
+    // of the worker running it, so per worker state can be indexed without locks. Returns when all are done and
+    // rethrows the first exception of any of them. A worker that waits runs other tasks meanwhile, so nested
+    // calls cannot deadlock
+    template<typename F>
+    void parallelFor(usize begin, usize end, F&& body, usize grain = 1) {
+        if (end <= begin)
+            return;
+        grain = std::max<usize>(grain, 1);
+
+        struct Group {
+            std::atomic<usize> pending;
+            std::mutex mut;
+            std::condition_variable done;
+            std::exception_ptr error;
+        } group;
+        group.pending = (end - begin + grain - 1) / grain;
+
+        for (usize lo = begin; lo < end; lo += grain) {
+            const usize hi = std::min(end, lo + grain);
+            enqueue([&, lo, hi]() {
+                std::exception_ptr error;
+                try {
+                    const usize worker = static_cast<usize>(currentWorker());
+                    for (usize i = lo; i < hi; i++)
+                        body(i, worker);
+                }
+                catch (...) {
+                    error = std::current_exception();
+                }
+
+                // Counted down under the mutex, which the waiter takes before it returns and destroys group,
+                // so group is not touched once the count reaches 0 and the mutex is released
+                std::lock_guard lock(group.mut);
+                if (error && !group.error)
+                    group.error = error;
+                if (group.pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    group.done.notify_all();
+            });
+        }
+
+        const i64 self = currentWorker();
+        if (self >= 0) {
+            while (group.pending.load(std::memory_order_acquire) > 0)
+                if (!runOne(self))
+                    std::this_thread::yield();
+        }
+        else {
+            std::unique_lock lock(group.mut);
+            group.done.wait(lock, [&]() { return group.pending.load(std::memory_order_acquire) == 0; });
+        }
+
+        // The last task may still hold the mutex after counting down
+        std::lock_guard lock(group.mut);
+        if (group.error)
+            std::rethrow_exception(group.error);
+    }
+
+  private:
+    struct alignas(64) Queue {
+        std::mutex mut;
+        std::deque<Task> tasks;
+        std::deque<Task> pinned; // Only run by the owning worker
+    };
+
+    struct WorkerId {
+        const ThreadPool* pool = nullptr;
+        usize index = 0;
+    };
+
+    // Pool and index of the calling thread if it is a worker
+    static WorkerId& threadWorker() {
+        thread_local WorkerId id;
+        return id;
+    }
+
+    vector<std::unique_ptr<Queue>> queues;
+    vector<std::thread> workers;
+    std::atomic<usize> nextQueue = 0;
+
+    std::mutex sleepMut;
+    std::condition_variable wake;
+    usize queued = 0;           // Stealable tasks in all deques, guarded by sleepMut
+    vector<usize> pinnedCount;  // Pinned tasks of each worker, guarded by sleepMut
+    bool stopping = false;
+    std::exception_ptr taskError; // First uncaught exception of a submitted task, guarded by sleepMut
+
+    // Pushes task to the deque of the calling worker, or of the next worker round robin from outside the pool
+    void enqueue(Task task) {
+        const i64 self = currentWorker();
+        Queue& queue = *queues[self >= 0 ? self : nextQueue.fetch_add(1, std::memory_order_relaxed) % queues.size()];
+        // Counted first so the count never drops below the tasks in the deques
+        {
+            std::lock_guard lock(sleepMut);
+            queued++;
+        }
+        {
+            std::lock_guard lock(queue.mut);
+            queue.tasks.push_back(std::move(task));
+        }
+        wake.notify_one();
+    }
+
+    void start(const vector<vector<u32>>& workerCpus) {
+        pinnedCount.resize(workerCpus.size());
+        for (usize i = 0; i < workerCpus.size(); i++)
+            queues.push_back(std::make_unique<Queue>());
+        for (usize i = 0; i < workerCpus.size(); i++) {
+            workers.emplace_back([this, i]() { workerLoop(i); });
+            if (!workerCpus[i].empty())
+                pin(workers.back(), workerCpus[i]);
+        }
+    }
+
+    // Runs a task pinned to the worker, else pops the newest task of its own deque or steals the oldest of another one
+    bool runOne(usize self) {
+        Task task;
+        {
+            Queue& own = *queues[self];
+            std::lock_guard lock(own.mut);
+            if (!own.pinned.empty()) {
+                task = std::move(own.pinned.front());
+                own.pinned.pop_front();
+            }
+        }
+        if (task) {
+            {
+                std::lock_guard lock(sleepMut);
+                pinnedCount[self]--;
+            }
+            run(task);
+            return true;
+        }
+
+        for (usize k = 0; k < queues.size() && !task; k++) {
+            Queue& queue = *queues[(self + k) % queues.size()];
+            std::lock_guard lock(queue.mut);
+            if (queue.tasks.empty())
+                continue;
+            if (k == 0) {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            }
+            else {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+        }
+        if (!task)
+            return false;
+
+        {
+            std::lock_guard lock(sleepMut);
+            queued--;
+        }
+        run(task);
+        return true;
+    }
+
+    // Keeps the first exception that escapes a task, the tasks of parallelFor(), runOnEach() and async() catch their own
+    void run(Task& task) {
+        try {
+            task();
+        }
+        catch (...) {
+            std::lock_guard lock(sleepMut);
+            if (!taskError)
+                taskError = std::current_exception();
+        }
+    }
+
+    void workerLoop(usize index) {
+        threadWorker() = { this, index };
+        while (true) {
+            if (runOne(index))
+                continue;
+
+            std::unique_lock lock(sleepMut);
+            wake.wait(lock, [&]() { return stopping || queued > 0 || pinnedCount[index] > 0; });
+            if (stopping && queued == 0 && pinnedCount[index] == 0)
+                return;
+        }
+    }
+
+    static void pin(std::thread& thread, const vector<u32>& cpus) {
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (u32 cpu : cpus)
+            CPU_SET(cpu, &set);
+        pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#endif
+    }
+};
+
+// Pool used where none is given, one worker per hardware thread
+inline ThreadPool& defaultThreadPool() {
+    static ThreadPool pool;
+    return pool;
+}
@@ -0,0 +1,203 @@
+#pragma once
+
+#include "types.h"
+
+#include <chrono>
+#include <atomic>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// Opt in timeline of what every thread was doing, written as Chrome trace event JSON for chrome://tracing
+// or ui.perfetto.dev. trace::start() begins recording, Scope objects and PhaseTimer laps add events while it
+// runs and trace::write() saves them once trace::stop() was called. When tracing is off an event costs a
+// relaxed atomic load
+namespace trace {
+    struct Event {
+        const char* name;     // Must outlive the trace, usually a string literal
+        const char* category;
+        u64 begin;            // Nanoseconds since start()
+        u64 end;
+    };
+
+    // Ring of the newest events of one thread. Only the owning thread writes, so pushing needs no lock
+    struct ThreadBuffer {
+        vector<Event> events;
+        std::atomic<u64> head = 0; // Events ever pushed, the slot of the next one is head & (size - 1)
+        usize tid;
+        string name;
+
+        ThreadBuffer(usize capacity, usize tid) : events(capacity), tid(tid) {}
+
+        void push(const Event& event) {
+            const u64 h = head.load(std::memory_order_relaxed);
+            events[h & (events.size() - 1)] = event;
+            head.store(h + 1, std::memory_order_release);
+        }
+    };
+
+    namespace internal {
+        struct ThreadState;
+
+        struct Tracer {
+            std::atomic<bool> enabled = false;
+            std::atomic<u64> generation = 0; // Bumped by start() so threads register a fresh buffer
+            std::chrono::steady_clock::time_point origin;
+            usize capacity = 0;
+
+            // Only taken when a thread records its first event of a run or exits, by start() and by write()
+            std::mutex mut;
+            vector<std::unique_ptr<ThreadBuffer>> buffers;
+            vector<ThreadState*> threads; // Every thread that has recorded an event and not exited
+        };
+
+        inline Tracer& tracer() {
+            static Tracer t;
+            return t;
+        }
+
+        // Buffer of a thread in the current run. busy is set while the thread may write to its buffer, so
+        // start() can tell when no thread is still writing to a buffer of an earlier run and free them
+        struct ThreadState {
+            std::atomic<bool> busy = false;
+            ThreadBuffer* buffer = nullptr;
+            u64 generation = ~u64(0);
+
+            ThreadState() {
+                std::lock_guard lock(tracer().mut);
+                tracer().threads.push_back(this);
+            }
+
+            ~ThreadState() {
+                std::lock_guard lock(tracer().mut);
+                std::erase(tracer().threads, this);
+            }
+        };
+
+        // Calls f with the calling thread's buffer of the current run
+        template<typename F>
+        inline void withThreadBuffer(F&& f) {
+            thread_local ThreadState state;
+            Tracer& t = tracer();
+
+            // busy is set before the generation is read, and start() bumps the generation before it reads
+            // busy, so either start() waits for f or this sees the new generation
+            while (true) {
+                state.busy.store(true, std::memory_order_seq_cst);
+                if (state.generation == t.generation.load(std::memory_order_seq_cst))
+                    break;
+
+                // Not busy while waiting for the lock, which start() holds while it waits for busy threads
+                state.busy.store(false, std::memory_order_release);
+                std::lock_guard lock(t.mut);
+                t.buffers.push_back(std::make_unique<ThreadBuffer>(t.capacity, t.buffers.size()));
+                state.buffer = t.buffers.back().get();
+                state.generation = t.generation.load(std::memory_order_relaxed);
+            }
+
+            f(*state.buffer);
+            state.busy.store(false, std::memory_order_release);
+        }
+    }
+
+    inline bool enabled() { return internal::tracer().enabled.load(std::memory_order_relaxed); }
+
+    inline u64 now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - internal::tracer().origin).count();
+    }
+
+    // Discards the events of any previous run. Each thread keeps its newest eventsPerThread events,
+    // rounded up to a power of two
+    inline void start(usize eventsPerThread = 1 << 16) {
+        internal::Tracer& t = internal::tracer();
+        std::lock_guard lock(t.mut);
+        t.enabled.store(false, std::memory_order_relaxed);
+        const vector<std::unique_ptr<ThreadBuffer>> previous = std::move(t.buffers);
+        t.buffers.clear();
+
+        t.capacity = 1;
+        while (t.capacity < eventsPerThread)
+            t.capacity *= 2;
+        t.origin = std::chrono::steady_clock::now();
+        t.generation.fetch_add(1, std::memory_order_seq_cst);
+
+        // Threads still finishing an event in a buffer of the previous run, which is freed afterwards
+        for (const internal::ThreadState* thread : t.threads)
+            while (thread->busy.load(std::memory_order_seq_cst))
+                std::this_thread::yield();
+
+        t.enabled.store(true, std::memory_order_release);
+    }
+
+    inline void stop() { internal::tracer().enabled.store(false, std::memory_order_release); }
+
+    inline void record(const char* name, const char* category, u64 begin, u64 end) {
+        if (enabled())
+            internal::withThreadBuffer([&](ThreadBuffer& buffer) { buffer.push({ name, category, begin, end }); });
+    }
+
+    // Label of the calling thread in the timeline
+    inline void setThreadName(const string& name) {
+        if (enabled())
+            internal::withThreadBuffer([&](ThreadBuffer& buffer) { buffer.name = name; });
+    }
+
+    // Records the lifetime of the scope as one event
+    struct Scope {
+        const char* name;
+        const char* category;
+        u64 begin;
+        bool active;
+
+        explicit Scope(const char* name, const char* category = "") : name(name), category(category), active(enabled()) {
+            if (active)
+                begin = now();
+        }
+
+        ~Scope() {
+            if (active)
+                record(name, category, begin, now());
+        }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    };
+
+    // Writes the events of the last run, call after stop(). Returns false if the file could not be written
+    inline bool write(const string& path) {
+        internal::Tracer& t = internal::tracer();
+        std::lock_guard lock(t.mut);
+
+        std::ofstream file(path);
+        if (!file)
+            return false;
+
+        // Complete ("X") events with microsecond timestamps, one per line
+        file << std::fixed << std::setprecision(3);
+        file << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n";
+        bool first = true;
+        const auto separator = [&]() -> const char* {
+            const bool wasFirst = first;
+            first = false;
+            return wasFirst ? "" : ",\n";
+        };
+
+        for (const auto& buffer : t.buffers) {
+            if (!buffer->name.empty())
+                file << separator() << "{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": 1, \"tid\": " << buffer->tid
+                     << ", \"args\": {\"name\": \"" << buffer->name << "\"}}";
+
+            const u64 head = buffer->head.load(std::memory_order_acquire);
+            const u64 size = buffer->events.size();
+            for (u64 i = head > size ? head - size : 0; i < head; i++) {
+                const Event& e = buffer->events[i & (size - 1)];
+                file << separator() << "{\"ph\": \"X\", \"name\": \"" << e.name << "\", \"cat\": \"" << e.category
+                     << "\", \"pid\": 1, \"tid\": " << buffer->tid << ", \"ts\": " << e.begin / 1000.0 << ", \"dur\": " << (e.end - e.begin) / 1000.0 << "}";
+            }
+        }
+        file << "\n]}\n";
+        return static_cast<bool>(file);
+    }
+}
@@ -8,7 +8,9 @@
 #include <string>
 #include <vector>
 #include <array>
+#include <cmath>
 
+#include "fastmath.h"
 
 #define exitWithMsg(msg, code) \
     { \
@@ -46,6 +48,14 @@ using InputLayer = vector<float>;
 using Target = vector<float>;
 using Gradient = vector<float>;
 
+// Active feature indices of a mostly-zero input, with optional values (all 1 when values is empty)
+struct SparseInput {
+    vector<u32> indices;
+    vector<float> values;
+
+    float value(usize idx) const { return values.empty() ? 1.0f : values[idx]; }
+};
+
 enum Activation : i16 {
     TANH,
     RELU,
@@ -66,30 +76,49 @@ inline array<string, NUM_ACTIVATIONS> activNames = {
     "SIGMOID", "SOFTMAX", "FSIGMOID", "SOFTPLUS", "GAUSSIAN", "NONE"
 };
 
+enum LayerType : i16 {
+    DENSE,
+    BLOCK_SPARSE,
+    FACTORIZED,
+    CONV2D,
+    MAX_POOL,
+    AVG_POOL,
+    NUM_LAYER_TYPES
+};
+
+inline array<string, NUM_LAYER_TYPES> layerTypeNames = {
+    "DENSE", "BLOCK_SPARSE", "FACTORIZED", "CONV2D", "MAX_POOL", "AVG_POOL"
+};
+
+enum MathMode : i16 {
+    EXACT_MATH,
+    FAST_MATH // Polynomial approximations from fastmath.h for exp based activations
+};
+
 namespace activations {
-    inline float tanh(float x) { return (std::pow(std::numbers::e, x) - std::pow(std::numbers::e, -x)) / (std::pow(std::numbers::e, x) + std::pow(std::numbers::e, -x)); }
+    inline float tanh(float x) { return std::tanh(x); }
     inline float ReLU(float x) { return std::max<float>(x, 0); }
     inline float CReLU(float x) { return std::clamp<float>(x, 0, 1); }
-    inline float SCReLU(float x) { return std::pow<float>(CReLU(x), 2); }
-    inline float SQReLU(float x) { return std::pow<float>(ReLU(x), 2); }
-    inline float sigmoid(float x) { return 1 / (1 + std::pow(std::numbers::e, -x)); }
+    inline float SCReLU(float x) { return CReLU(x) * CReLU(x); }
+    inline float SQReLU(float x) { return ReLU(x) * ReLU(x); }
+    inline float sigmoid(float x) { return 1 / (1 + std::exp(-x)); }
     inline float fsigmoid(float x) { return x / (1 + std::abs(x)); }
-    inline float softplus(float x) { return std::log(1 + std::pow(std::numbers::e, x)); }
-    inline float gaussian(float x) { return std::pow(std::numbers::e, -(x * x)); }
-
-
-    inline float dtanh(float x) { return 1 - std::pow(tanh(x), 2); }
-    inline float dReLU(float x) { return x == 0 ? 0 : 1; }
-    inline float dCReLU(float x) { return (x == 0 || x == 1) ? 0 : 1; }
-    inline float dSCReLU(float x) { return (x == 0 || x == 1) ? 0 : 2 * x; }
-    inline float dSQReLU(float x) { return x == 0 ? 0 : 2 * x; }
-    inline float dsigmoid(float x) { return sigmoid(x) * (1 - sigmoid(x)); }
-    inline float dfsigmoid(float x) { return x == 0 ? 1 : (x > 0 ? 1 / std::pow(1 + x, 2) : (1 / std::pow(1 - x, 2))); }
-    inline float dsoftplus(float x) { return sigmoid(x); }
-    inline float dgaussian(float x) { return -2 * x * std::pow(std::numbers::e, -(x * x)); }
+    inline float softplus(float x) { return std::max(x, 0.0f) + std::log1p(std::exp(-std::abs(x))); }
+    inline float gaussian(float x) { return std::exp(-(x * x)); }
+
+    // Derivatives take the pre-activation x and the activated value a, whichever is cheaper is used
+    inline float dtanh(float, float a) { return 1 - a * a; }
+    inline float dReLU(float x, float) { return x > 0 ? 1 : 0; }
+    inline float dCReLU(float x, float) { return (x > 0 && x < 1) ? 1 : 0; }
+    inline float dSCReLU(float x, float) { return (x > 0 && x < 1) ? 2 * x : 0; }
+    inline float dSQReLU(float x, float) { return x > 0 ? 2 * x : 0; }
+    inline float dsigmoid(float, float a) { return a * (1 - a); }
+    inline float dfsigmoid(float, float a) { return (1 - std::abs(a)) * (1 - std::abs(a)); }
+    inline float dsoftplus(float x, float) { return sigmoid(x); }
+    inline float dgaussian(float x, float a) { return -2 * x * a; }
 
     // Performs a softmax on the given vector
-    inline vector<float> softmax(vector<float> values) {
+    inline vector<float> softmax(vector<float> values, MathMode mode = EXACT_MATH) {
         assert(!values.empty());
         // Find the max value
         float maxIn = values[0];
@@ -99,7 +128,7 @@ namespace activations {
         // Compute exponentials and sum
         float sum = 0;
         for (auto& score : values) {
-            score = std::exp(score - maxIn);
+            score = mode == FAST_MATH ? fastmath::exp(score - maxIn) : std::exp(score - maxIn);
             sum += score;
         }
 
@@ -129,44 +158,62 @@ namespace activations {
         return grad;
     }
 
-    inline vector<float> activate(Activation act, const vector<float>& vec) {
+    // Applies func to every element in its own loop so that it can be vectorized
+    template<typename F>
+    inline void apply(const vector<float>& in, vector<float>& out, F&& func) {
+        const float* src = in.data();
+        float* dst = out.data();
+        for (usize i = 0; i < in.size(); ++i)
+            dst[i] = func(src[i]);
+    }
+
+    inline vector<float> activate(Activation act, const vector<float>& vec, MathMode mode = EXACT_MATH) {
+        if (act == SOFTMAX)
+            return softmax(vec, mode);
+
         vector<float> out(vec.size());
+        const bool fast = mode == FAST_MATH;
 
         switch (act) {
-        case SOFTMAX: return softmax(vec);
+        case TANH:
+            if (fast) apply(vec, out, [](float x) { return fastmath::tanh(x); });
+            else      apply(vec, out, [](float x) { return tanh(x); });
+            break;
+        case SIGMOID:
+            if (fast) apply(vec, out, [](float x) { return fastmath::sigmoid(x); });
+            else      apply(vec, out, [](float x) { return sigmoid(x); });
+            break;
+        case SOFTPLUS:
+            if (fast) apply(vec, out, [](float x) { return fastmath::softplus(x); });
+            else      apply(vec, out, [](float x) { return softplus(x); });
+            break;
+        case GAUSSIAN:
+            if (fast) apply(vec, out, [](float x) { return fastmath::gaussian(x); });
+            else      apply(vec, out, [](float x) { return gaussian(x); });
+            break;
+        case RELU:     apply(vec, out, [](float x) { return ReLU(x); }); break;
+        case CRELU:    apply(vec, out, [](float x) { return CReLU(x); }); break;
+        case SCRELU:   apply(vec, out, [](float x) { return SCReLU(x); }); break;
+        case SQRELU:   apply(vec, out, [](float x) { return SQReLU(x); }); break;
+        case FSIGMOID: apply(vec, out, [](float x) { return fsigmoid(x); }); break;
+        case NO_ACTIVATION: out = vec; break;
         default: break;
         }
-
-        for (usize i = 0; i < vec.size(); ++i) {
-            switch (act) {
-            case TANH:     out[i] = tanh(vec[i]); break;
-            case RELU:     out[i] = ReLU(vec[i]); break;
-            case CRELU:    out[i] = CReLU(vec[i]); break;
-            case SCRELU:   out[i] = SCReLU(vec[i]); break;
-            case SQRELU:   out[i] = SQReLU(vec[i]); break;
-            case SIGMOID:  out[i] = sigmoid(vec[i]); break;
-            case FSIGMOID: out[i] = fsigmoid(vec[i]); break;
-            case SOFTPLUS: out[i] = softplus(vec[i]); break;
-            case GAUSSIAN: out[i] = gaussian(vec[i]); break;
-            case NO_ACTIVATION:     out[i] = vec[i]; break;
-            default: break;
-            }
-        }
         return out;
     }
 
-    inline float derivActivate(Activation act, float f) {
+    inline float derivActivate(Activation act, float x, float a, MathMode mode = EXACT_MATH) {
         switch (act) {
-        case TANH:     return dtanh(f);
-        case RELU:     return dReLU(f);
-        case CRELU:    return dCReLU(f);
-        case SCRELU:   return dSCReLU(f);
-        case SQRELU:   return dSQReLU(f);
-        case SIGMOID:  return dsigmoid(f);
-        case FSIGMOID: return dfsigmoid(f);
-        case SOFTPLUS: return dsoftplus(f);
-        case GAUSSIAN: return dgaussian(f);
-        case NO_ACTIVATION:     return f;
+        case TANH:     return dtanh(x, a);
+        case RELU:     return dReLU(x, a);
+        case CRELU:    return dCReLU(x, a);
+        case SCRELU:   return dSCReLU(x, a);
+        case SQRELU:   return dSQReLU(x, a);
+        case SIGMOID:  return dsigmoid(x, a);
+        case FSIGMOID: return dfsigmoid(x, a);
+        case SOFTPLUS: return mode == FAST_MATH ? fastmath::sigmoid(x) : dsoftplus(x, a);
+        case GAUSSIAN: return dgaussian(x, a);
+        case NO_ACTIVATION:     return 1;
         default: exitWithMsg("Unsupported activation on non-output layer: " + activNames[act], -1);
         }
     }
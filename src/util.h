@@ -4,7 +4,10 @@
 
 #include <algorithm>
 #include <sstream>
+#include <ostream>
+#include <istream>
 #include <cmath>
+#include <new>
 
 #ifdef _WIN32
 #define NOMINMAX
@@ -36,6 +39,91 @@ inline void deepFill(vector<T>& arr, const U& value) {
 	}
 }
 
+// Copy of a possibly ragged nested vector with every element set to zero
+template<typename T>
+inline T zerosLike(T arr) {
+	deepFill(arr, 0);
+	return arr;
+}
+
+// Allocator for buffers that have to start on a cache line, such as packed weights
+template<typename T, usize kAlign = 64>
+struct AlignedAllocator {
+	using value_type = T;
+
+	template<typename U>
+	struct rebind {
+		using other = AlignedAllocator<U, kAlign>;
+	};
+
+	AlignedAllocator() = default;
+	template<typename U>
+	AlignedAllocator(const AlignedAllocator<U, kAlign>&) {}
+
+	T* allocate(usize n) { return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(kAlign))); }
+	void deallocate(T* ptr, usize) { ::operator delete(ptr, std::align_val_t(kAlign)); }
+
+	template<typename U>
+	bool operator==(const AlignedAllocator<U, kAlign>&) const { return true; }
+};
+
+template<typename T>
+using AlignedVector = vector<T, AlignedAllocator<T>>;
+
+// Rounds a number of floats up to a whole number of 64 byte cache lines
+constexpr usize alignFloats(usize count) { return (count + 15) / 16 * 16; }
+
+// Raw binary (de)serialization of plain values and nested vectors. Vectors are read into
+// buffers that already have their shape, which has to match what was written
+namespace serialization {
+	template<typename T>
+	inline void write(std::ostream& out, const T& val) {
+		static_assert(std::is_trivially_copyable_v<T>);
+		out.write(reinterpret_cast<const char*>(&val), sizeof(T));
+	}
+
+	template<typename T>
+	inline void write(std::ostream& out, const vector<T>& vec) {
+		write(out, static_cast<u64>(vec.size()));
+		if constexpr (std::is_trivially_copyable_v<T>)
+			out.write(reinterpret_cast<const char*>(vec.data()), vec.size() * sizeof(T));
+		else
+			for (const T& element : vec)
+				write(out, element);
+	}
+
+	inline void write(std::ostream& out, const string& str) {
+		write(out, static_cast<u64>(str.size()));
+		out.write(str.data(), str.size());
+	}
+
+	template<typename T>
+	inline void read(std::istream& in, T& val) {
+		static_assert(std::is_trivially_copyable_v<T>);
+		in.read(reinterpret_cast<char*>(&val), sizeof(T));
+	}
+
+	template<typename T>
+	inline void read(std::istream& in, vector<T>& vec) {
+		u64 size = 0;
+		read(in, size);
+		if (!in || size != vec.size())
+			exitWithMsg("Serialized data does not match the expected shape", -1);
+		if constexpr (std::is_trivially_copyable_v<T>)
+			in.read(reinterpret_cast<char*>(vec.data()), vec.size() * sizeof(T));
+		else
+			for (T& element : vec)
+				read(in, element);
+	}
+
+	inline void read(std::istream& in, string& str) {
+		u64 size = 0;
+		read(in, size);
+		str.resize(size);
+		in.read(str.data(), size);
+	}
+}
+
 // Formats a number with commas
 inline string formatNum(i64 v) {
 	auto s = std::to_string(v);
@@ -51,6 +139,21 @@ inline string formatNum(i64 v) {
 	return s;
 }
 
+// Formats a byte count with a binary unit, e.g. 1.50 GiB
+inline string formatBytes(u64 bytes) {
+	const char* units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+	double value = bytes;
+	usize unit = 0;
+	while (value >= 1024 && unit + 1 < std::size(units)) {
+		value /= 1024;
+		unit++;
+	}
+	std::ostringstream out;
+	out.precision(unit ? 2 : 0);
+	out << std::fixed << value << " " << units[unit];
+	return out.str();
+}
+
 // Formats a time
 inline string formatTime(u64 timeInMS) {
 	long long seconds = timeInMS / 1000;
@@ -0,0 +1,409 @@
+// Microbenchmarks: bench [--json path] [--baseline path] [--threshold percent] [--filter text] [--min-time-ms n] [--threads n] [--perf]
+// Each benchmark is timed over several samples of at least min-time-ms and reports the median. With a
+// baseline written by an earlier --json run, benchmarks that got slower by more than threshold percent
+// are listed and the exit code is 1. --perf adds hardware counters per item where perf_event_open allows them
+
+#include "learner.h"
+#include "perfcounters.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <map>
+
+namespace {
+    using Clock = std::chrono::steady_clock;
+
+    // Work done per iteration, items is what the reported time is divided by (e.g. batches per learn call)
+    struct Work {
+        double flops = 0;
+        double bytes = 0;
+        double items = 1;
+    };
+
+    struct Result {
+        string name;
+        u64 iterations;
+        double nsPerItem;
+        double gflops;
+        double gbps;
+        PerfSample counters; // Per item
+    };
+
+    struct Options {
+        string jsonPath;
+        string baselinePath;
+        string filter;
+        double threshold = 10;
+        double minTimeMs = 50;
+        usize threads = 1;
+        bool perf = false;
+    };
+
+    constexpr usize SAMPLES = 5;
+
+    // Keeps the compiler from discarding the benchmarked work
+    volatile float sink;
+
+    // Fills every weight of a network from a fixed seed so runs are comparable
+    void fillDeterministic(Network& net) {
+        std::mt19937 rng(42);
+        std::uniform_real_distribution<float> dist(-0.1f, 0.1f);
+        for (usize l = 1; l < net.layers.size(); l++) {
+            for (vector<float>& row : net.layers[l].weights)
+                for (float& w : row)
+                    w = dist(rng);
+            for (float& b : net.layers[l].biases)
+                b = dist(rng);
+        }
+    }
+
+    InputLayer randomInput(usize size, u32 seed) {
+        std::mt19937 rng(seed);
+        std::uniform_real_distribution<float> dist(0, 1);
+        InputLayer input(size);
+        for (float& x : input)
+            x = dist(rng);
+        return input;
+    }
+
+    usize parameterCount(const Network& net, usize from = 1) {
+        usize count = 0;
+        for (usize l = from; l < net.layers.size(); l++) {
+            for (const vector<float>& row : net.layers[l].weights)
+                count += row.size();
+            count += net.layers[l].biases.size();
+        }
+        return count;
+    }
+
+    // Cycles through a fixed set of random samples, the test set is empty
+    struct SyntheticDataLoader : DataLoader {
+        vector<DataPoint> samples;
+        usize position = 0;
+
+        SyntheticDataLoader(usize inputSize, usize outputSize, usize numSamples, u64 batchSize) : DataLoader(batchSize, 1, 0) {
+            this->numSamples = numSamples;
+            for (usize i = 0; i < numSamples; i++) {
+                Target target(outputSize);
+                target[i % outputSize] = 1;
+                samples.emplace_back(randomInput(inputSize, i), target);
+            }
+        }
+
+        void loadBatch(usize batchSize, usize batchIdx) override {
+            data[batchIdx].clear();
+            for (usize i = 0; i < batchSize; i++)
+                data[batchIdx].push_back(samples[position++ % samples.size()]);
+        }
+
+        void loadTestSet() override { data[currBatch].clear(); }
+        bool hasNext() const override { return false; }
+        DataPoint next() override { return samples[0]; }
+    };
+
+    struct Bench {
+        Options options;
+        vector<Result> results;
+        std::unique_ptr<PerfCounters> counters;
+
+        explicit Bench(const Options& options) : options(options) {
+            // Opened before any ThreadPool is created so that its workers are counted
+            if (options.perf)
+                counters = std::make_unique<PerfCounters>();
+        }
+
+        // Runs body until a sample lasts minTimeMs, then reports the median of SAMPLES samples
+        void run(const string& name, Work work, const std::function<void()>& body) {
+            if (!options.filter.empty() && name.find(options.filter) == string::npos)
+                return;
+
+            const auto seconds = [&](u64 iterations) {
+                const Clock::time_point start = Clock::now();
+                for (u64 i = 0; i < iterations; i++)
+                    body();
+                return std::chrono::duration<double>(Clock::now() - start).count();
+            };
+
+            // Also serves as the warmup
+            u64 iterations = 1;
+            while (seconds(iterations) * 1000 < options.minTimeMs && iterations < (u64(1) << 32))
+                iterations *= 2;
+
+            const PerfSample countersBefore = counters ? counters->read() : PerfSample{};
+            array<double, SAMPLES> samples;
+            for (double& s : samples)
+                s = seconds(iterations) / iterations;
+            const PerfSample counted = counters ? (counters->read() - countersBefore) / (SAMPLES * iterations * work.items) : PerfSample{};
+            std::sort(samples.begin(), samples.end());
+            const double perIter = samples[SAMPLES / 2];
+
+            const Result result{ name, iterations, perIter * 1e9 / work.items, work.flops / perIter * 1e-9, work.bytes / perIter * 1e-9, counted };
+            results.push_back(result);
+            printf("%-40s %14.1f ns %10.2f GFLOP/s %10.2f GB/s\n", name.c_str(), result.nsPerItem, result.gflops, result.gbps);
+            if (counters)
+                printf("%-40s %s\n", "", counted.summary(work.flops / work.items).c_str());
+            fflush(stdout);
+        }
+    };
+
+    void benchForward(Bench& bench) {
+        for (const auto& [in, out] : { std::pair<usize, usize>{ 64, 64 }, { 256, 256 }, { 784, 128 }, { 1024, 1024 } }) {
+            for (const Activation act : { RELU, SIGMOID }) {
+                Network net(in, out, act);
+                net.init();
+                fillDeterministic(net);
+                net.load(randomInput(in, 1));
+
+                const Work work{ 2.0 * in * out, 4.0 * (in * out + in + 2 * out) };
+                bench.run(fmt::format("forward/dense/{}x{}/{}", in, out, activNames[act]), work, [&]() {
+                    net.layers[1].forward(net.layers[0], net.mathMode);
+                    sink = net.layers[1].activated[0];
+                });
+            }
+        }
+
+        Network net(3 * 32 * 32, 10, NO_ACTIVATION);
+        net.setInputShape(3, 32, 32).addLayer(Layer::conv2D(16, 3, RELU, 1, 1));
+        net.init();
+        fillDeterministic(net);
+        net.load(randomInput(3 * 32 * 32, 1));
+
+        const Layer& conv = net.layers[1];
+        const Work work{ 2.0 * conv.size * conv.receptiveField(net.layers[0]), 4.0 * (conv.columns.size() + net.layers[0].size + conv.size) };
+        bench.run("forward/conv2d/3x32x32/16x3x3", work, [&]() {
+            net.layers[1].forward(net.layers[0], net.mathMode);
+            sink = net.layers[1].activated[0];
+        });
+    }
+
+    Network trainingNetwork() {
+        Network net(784, 10, SOFTMAX);
+        net.addLayer(256, RELU).addLayer(128, RELU);
+        net.init();
+        fillDeterministic(net);
+        return net;
+    }
+
+    void benchForwardPass(Bench& bench) {
+        Network net = trainingNetwork();
+        net.load(randomInput(784, 1));
+
+        const double params = parameterCount(net);
+        bench.run("forwardPass/784-256-128-10", { 2 * params, 4 * params }, [&]() {
+            net.forwardPass();
+            sink = net.output()[0];
+        });
+    }
+
+    void benchBackward(Bench& bench) {
+        Network net = trainingNetwork();
+        SyntheticDataLoader loader(784, 10, 1, 1);
+        optimizers::SGD optimizer(net);
+        Learner learner(net, loader, optimizer, CROSS_ENTROPY);
+
+        net.load(loader.samples[0].input);
+        net.forwardPass();
+
+        // The first layer has no previous gradient to propagate to
+        const double params = parameterCount(net, 2);
+        bench.run("backward/784-256-128-10", { 2 * params, 4 * params }, [&]() {
+            const vector<Gradient> grads = learner.backward(net, loader.samples[0].target);
+            sink = grads[1][0];
+        });
+    }
+
+    void benchReduction(Bench& bench) {
+        const Network net = trainingNetwork();
+        const usize threads = std::max<usize>(bench.options.threads, 4);
+
+        MultiVector<float, 3> weightGradAccum;
+        MultiVector<float, 2> biasGradAccum;
+        for (usize l = 1; l < net.layers.size(); l++) {
+            weightGradAccum.push_back(zerosLike(net.layers[l].weights));
+            biasGradAccum.push_back(zerosLike(net.layers[l].biases));
+        }
+        const MultiVector<float, 4> threadWeightGradAccum(threads, weightGradAccum);
+        const MultiVector<float, 3> threadBiasGradAccum(threads, biasGradAccum);
+
+        const double params = parameterCount(net);
+        bench.run(fmt::format("reduce/{}-threads", threads), { threads * params, 4 * (threads + 2) * params }, [&]() {
+            Learner::reduceGradients(threadWeightGradAccum, threadBiasGradAccum, weightGradAccum, biasGradAccum);
+            sink = weightGradAccum[0][0][0];
+        });
+    }
+
+    // flopsPerParam and floatsPerParam estimate the arithmetic and the floats read plus written per parameter
+    void benchOptimizer(Bench& bench, const string& name, double flopsPerParam, double floatsPerParam,
+                        const std::function<std::unique_ptr<optimizers::Optimizer>(Network&)>& make) {
+        Network net = trainingNetwork();
+        const std::unique_ptr<optimizers::Optimizer> optimizer = make(net);
+        std::mt19937 rng(7);
+        std::uniform_real_distribution<float> dist(-1e-3f, 1e-3f);
+        for (auto& layer : optimizer->weightGradients)
+            for (vector<float>& row : layer)
+                for (float& g : row)
+                    g = dist(rng);
+
+        const double params = parameterCount(net);
+        bench.run("step/" + name, { flopsPerParam * params, 4 * floatsPerParam * params }, [&]() {
+            optimizer->step(1e-4f);
+            sink = net.layers[1].weights[0][0];
+        });
+    }
+
+    // Writes a binary PGM, one of the formats stb_image reads
+    void writePgm(const string& path, usize width, usize height) {
+        std::ofstream file(path, std::ios::binary);
+        file << "P5\n" << width << " " << height << "\n255\n";
+        for (usize i = 0; i < width * height; i++)
+            file.put(static_cast<char>((i * 31) % 256));
+    }
+
+    void benchImageLoading(Bench& bench) {
+        const std::filesystem::path dir = std::filesystem::temp_directory_path();
+        for (const usize side : { 28, 256 }) {
+            const string path = (dir / fmt::format("neuro_bench_{}.pgm", side)).string();
+            writePgm(path, side, side);
+
+            bench.run(fmt::format("loadGreyscaleImage/{}x{}", side, side), { 0, double(side * side * (1 + sizeof(float))) }, [&]() {
+                const InputLayer image = loadGreyscaleImage(path, side, side);
+                sink = image[0];
+            });
+            std::filesystem::remove(path);
+        }
+    }
+
+    void benchTraining(Bench& bench) {
+        constexpr usize BATCH_SIZE = 64;
+        constexpr usize BATCHES = 16;
+
+        Network net = trainingNetwork();
+        SyntheticDataLoader loader(784, 10, BATCH_SIZE * BATCHES, BATCH_SIZE);
+        optimizers::Adam optimizer(net);
+        Learner learner(net, loader, optimizer, CROSS_ENTROPY);
+        lrSchedules::ConstantLR lr(1e-4f);
+
+        // Forward, backward and the weight gradient are about 6 flops per weight and sample
+        const double params = parameterCount(net);
+        const Work work{ 6 * params * BATCH_SIZE * BATCHES, 0, BATCHES };
+
+        // learn reports progress on cout
+        std::ostringstream discard;
+        std::streambuf* const coutBuf = cout.rdbuf(discard.rdbuf());
+        bench.run(fmt::format("train/784-256-128-10/batch-{}/{}-threads", BATCH_SIZE, bench.options.threads), work, [&]() {
+            learner.learn(lr, 1, bench.options.threads);
+            discard.str({});
+        });
+        cout.rdbuf(coutBuf);
+    }
+
+    // Reads the name and ns_per_item of each benchmark in a file written by writeJson
+    std::map<string, double> readBaseline(const string& path) {
+        std::ifstream file(path);
+        if (!file)
+            exitWithMsg("Baseline not found: " + path, -1);
+
+        std::map<string, double> baseline;
+        const string nameKey = "\"name\": \"";
+        const string timeKey = "\"ns_per_item\": ";
+        string line;
+        while (std::getline(file, line)) {
+            const usize name = line.find(nameKey);
+            const usize time = line.find(timeKey);
+            if (name == string::npos || time == string::npos)
+                continue;
+            const usize nameStart = name + nameKey.size();
+            baseline[line.substr(nameStart, line.find('"', nameStart) - nameStart)] = std::stod(line.substr(time + timeKey.size()));
+        }
+        return baseline;
+    }
+
+    // One benchmark per line so that baselines can be read back without a JSON parser
+    void writeJson(const string& path, const Options& options, const vector<Result>& results) {
+        std::ofstream file(path);
+        if (!file)
+            exitWithMsg("Failed to write " + path, -1);
+
+        file << "{\n";
+        file << fmt::format("  \"threads\": {},\n", options.threads);
+        file << fmt::format("  \"min_time_ms\": {},\n", options.minTimeMs);
+        file << "  \"benchmarks\": [\n";
+        for (usize i = 0; i < results.size(); i++) {
+            const Result& r = results[i];
+            string counters;
+            for (usize c = 0; c < NUM_PERF_COUNTERS; c++)
+                if (r.counters.valid[c])
+                    counters += fmt::format(", \"{}\": {:.2f}", perfCounterNames[c], r.counters.values[c]);
+            file << fmt::format("    {{\"name\": \"{}\", \"iterations\": {}, \"ns_per_item\": {:.3f}, \"gflops\": {:.4f}, \"gbps\": {:.4f}{}}}{}\n",
+                                r.name, r.iterations, r.nsPerItem, r.gflops, r.gbps, counters, i + 1 < results.size() ? "," : "");
+        }
+        file << "  ]\n}\n";
+    }
+
+    // Returns the number of benchmarks that are slower than the baseline by more than the threshold
+    usize compare(const std::map<string, double>& baseline, const vector<Result>& results, double threshold) {
+        usize regressions = 0;
+        printf("\n%-40s %14s %14s %9s\n", "Compared to baseline", "baseline ns", "current ns", "change");
+        for (const Result& r : results) {
+            const auto it = baseline.find(r.name);
+            if (it == baseline.end()) {
+                printf("%-40s %14s %14.1f %9s\n", r.name.c_str(), "-", r.nsPerItem, "new");
+                continue;
+            }
+            const double change = (r.nsPerItem / it->second - 1) * 100;
+            const bool regressed = change > threshold;
+            regressions += regressed;
+            printf("%-40s %14.1f %14.1f %+8.1f%%%s\n", r.name.c_str(), it->second, r.nsPerItem, change, regressed ? "  REGRESSION" : "");
+        }
+        return regressions;
+    }
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        const string arg = argv[i];
+        const auto value = [&]() -> string {
+            if (i + 1 >= argc)
+                exitWithMsg("Missing value for " + arg, -1);
+            return argv[++i];
+        };
+
+        if (arg == "--json")
+            options.jsonPath = value();
+        else if (arg == "--baseline")
+            options.baselinePath = value();
+        else if (arg == "--threshold")
+            options.threshold = std::stod(value());
+        else if (arg == "--filter")
+            options.filter = value();
+        else if (arg == "--min-time-ms")
+            options.minTimeMs = std::stod(value());
+        else if (arg == "--threads")
+            options.threads = std::stoull(value());
+        else if (arg == "--perf")
+            options.perf = true;
+        else
+            exitWithMsg("Unknown argument " + arg, -1);
+    }
+
+    Bench bench(options);
+    benchForward(bench);
+    benchForwardPass(bench);
+    benchBackward(bench);
+    benchReduction(bench);
+    benchOptimizer(bench, "sgd", 4, 5, [](Network& net) { return std::make_unique<optimizers::SGD>(net); });
+    benchOptimizer(bench, "rmsprop", 8, 5, [](Network& net) { return std::make_unique<optimizers::RMSprop>(net); });
+    benchOptimizer(bench, "adam", 16, 7, [](Network& net) { return std::make_unique<optimizers::Adam>(net); });
+    benchImageLoading(bench);
+    benchTraining(bench);
+
+    if (!options.jsonPath.empty())
+        writeJson(options.jsonPath, options, bench.results);
+
+    if (!options.baselinePath.empty() && compare(readBaseline(options.baselinePath), bench.results, options.threshold) > 0)
+        return 1;
+    return 0;
+}
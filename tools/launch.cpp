@@ -0,0 +1,137 @@
+// Starts the ranks of a data parallel run: launch -n <ranks> [--transport shm|tcp] [--port n] [--addrs host:port,...]
+//                                                 [--first-rank n] [--log-dir dir] -- <command> [args...]
+// Every rank runs command with NEURO_RANK, NEURO_WORLD_SIZE, NEURO_TRANSPORT and NEURO_SHM_NAME or NEURO_ADDRS
+// set, see Communicator::fromEnvironment. Rank 0 writes to the console and the others to rank<r>.log in the
+// log dir. With tcp the ranks default to consecutive ports on localhost. For several hosts run launch on each
+// with --transport tcp, the same --addrs listing every rank and --first-rank set to the first rank it starts
+
+#include "distributed.h"
+
+#include <csignal>
+#include <cstdio>
+
+#ifndef _WIN32
+#include <sys/wait.h>
+#endif
+
+int main(int argc, char** argv) {
+#ifdef _WIN32
+    exitWithMsg("launch is not supported on Windows", -1);
+#else
+    usize localRanks = 0;
+    usize firstRank = 0;
+    u16 port = 29500;
+    string transport = "shm";
+    string addrs;
+    string logDir = ".";
+    vector<char*> command;
+
+    for (int i = 1; i < argc; i++) {
+        const string arg = argv[i];
+        const auto value = [&]() -> string {
+            if (i + 1 >= argc)
+                exitWithMsg("Missing value for " + arg, -1);
+            return argv[++i];
+        };
+
+        if (arg == "--") {
+            command.assign(argv + i + 1, argv + argc);
+            break;
+        }
+        else if (arg == "-n")
+            localRanks = std::stoull(value());
+        else if (arg == "--transport")
+            transport = value();
+        else if (arg == "--port")
+            port = std::stoi(value());
+        else if (arg == "--addrs")
+            addrs = value();
+        else if (arg == "--first-rank")
+            firstRank = std::stoull(value());
+        else if (arg == "--log-dir")
+            logDir = value();
+        else
+            exitWithMsg("Unknown argument " + arg, -1);
+    }
+
+    if (localRanks == 0 || command.empty())
+        exitWithMsg("Usage: launch -n <ranks> [--transport shm|tcp] [--port n] [--addrs host:port,...] [--first-rank n] [--log-dir dir] -- <command> [args...]", -1);
+    command.push_back(nullptr);
+
+    usize worldSize = firstRank + localRanks;
+    const string shmName = fmt::format("neuro-{}", ::getpid());
+    if (transport == "tcp") {
+        if (addrs.empty()) {
+            for (usize r = 0; r < worldSize; r++)
+                addrs += fmt::format("{}127.0.0.1:{}", r ? "," : "", port + r);
+        }
+        worldSize = std::count(addrs.begin(), addrs.end(), ',') + 1;
+        if (firstRank + localRanks > worldSize)
+            exitWithMsg(fmt::format("--addrs lists {} ranks, fewer than the {} to start from rank {}", worldSize, localRanks, firstRank), -1);
+    }
+    else if (transport == "shm") {
+        if (firstRank != 0)
+            exitWithMsg("Shared memory ranks must all run on one host, use --transport tcp for several", -1);
+    }
+    else
+        exitWithMsg("Unknown transport " + transport + ", expected shm or tcp", -1);
+
+    vector<pid_t> children;
+    for (usize r = firstRank; r < firstRank + localRanks; r++) {
+        const pid_t pid = ::fork();
+        if (pid < 0)
+            exitWithMsg("Failed to start rank " + std::to_string(r), -1);
+        if (pid > 0) {
+            children.push_back(pid);
+            continue;
+        }
+
+        ::setenv("NEURO_RANK", std::to_string(r).c_str(), 1);
+        ::setenv("NEURO_WORLD_SIZE", std::to_string(worldSize).c_str(), 1);
+        ::setenv("NEURO_TRANSPORT", transport.c_str(), 1);
+        if (transport == "shm")
+            ::setenv("NEURO_SHM_NAME", shmName.c_str(), 1);
+        else
+            ::setenv("NEURO_ADDRS", addrs.c_str(), 1);
+
+        if (r != 0) {
+            const string logPath = fmt::format("{}/rank{}.log", logDir, r);
+            const int fd = ::open(logPath.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+            if (fd < 0)
+                exitWithMsg("Failed to open " + logPath, -1);
+            ::dup2(fd, STDOUT_FILENO);
+            ::dup2(fd, STDERR_FILENO);
+            ::close(fd);
+        }
+
+        ::execvp(command[0], command.data());
+        exitWithMsg(string("Failed to run ") + command[0], -1);
+    }
+
+    // A rank that fails leaves the others waiting on it, so they are stopped
+    int exitCode = 0;
+    for (usize remaining = children.size(); remaining > 0; remaining--) {
+        int status;
+        const pid_t pid = ::wait(&status);
+        if (pid < 0)
+            break;
+
+        const auto child = std::find(children.begin(), children.end(), pid);
+        const usize r = firstRank + (child - children.begin());
+        if (child != children.end())
+            *child = 0;
+        const bool failed = !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+        if (failed && exitCode == 0) {
+            exitCode = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            cout << "Rank " << r << " failed with status " << exitCode << ", stopping the others" << endl;
+            for (pid_t other : children)
+                if (other > 0)
+                    ::kill(other, SIGTERM);
+        }
+    }
+
+    if (transport == "shm")
+        ::shm_unlink(("/" + shmName).c_str());
+    return exitCode;
+#endif
+}
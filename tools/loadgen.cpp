@@ -0,0 +1,88 @@
+// Load generator for serve: loadgen <socket> <inputs> [--requests n] [--concurrency n]
+// Each of the concurrent clients sends a request and waits for its response before sending the next
+
+#include "server.h"
+
+#include <random>
+
+int main(int argc, char** argv) {
+#ifdef _WIN32
+    exitWithMsg("loadgen needs Unix domain sockets", -1);
+#else
+    if (argc < 3)
+        exitWithMsg("Usage: loadgen <socket> <inputs> [--requests n] [--concurrency n]", -1);
+
+    const string socketPath = argv[1];
+    const usize inputSize = std::stoull(argv[2]);
+    usize numRequests = 10000;
+    usize concurrency = 16;
+
+    for (int i = 3; i + 1 < argc; i += 2) {
+        const string arg = argv[i];
+        if (arg == "--requests")
+            numRequests = std::stoull(argv[i + 1]);
+        else if (arg == "--concurrency")
+            concurrency = std::stoull(argv[i + 1]);
+        else
+            exitWithMsg("Unknown argument " + arg, -1);
+    }
+
+    vector<vector<double>> latencies(concurrency);
+    std::atomic<usize> failures = 0;
+
+    const auto start = std::chrono::steady_clock::now();
+
+    vector<std::thread> clients;
+    for (usize c = 0; c < concurrency; c++) {
+        clients.emplace_back([&, c]() {
+            const int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            sockaddr_un addr{};
+            addr.sun_family = AF_UNIX;
+            std::memcpy(addr.sun_path, socketPath.c_str(), std::min(socketPath.size() + 1, sizeof(addr.sun_path) - 1));
+            if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+                cerr << "Failed to connect to " << socketPath << endl;
+                failures += numRequests / concurrency;
+                return;
+            }
+
+            std::mt19937 rng(c);
+            std::uniform_real_distribution<float> dist(0, 1);
+            vector<float> input(inputSize);
+            vector<char> payload;
+
+            for (usize r = c; r < numRequests; r += concurrency) {
+                for (float& x : input)
+                    x = dist(rng);
+
+                const auto sent = std::chrono::steady_clock::now();
+                if (!protocol::writeFrame(fd, r, input) || !protocol::readFrame(fd, payload)) {
+                    failures++;
+                    break;
+                }
+                u64 id;
+                std::memcpy(&id, payload.data(), sizeof(u64));
+                if (id != r || payload.size() == sizeof(u64))
+                    failures++;
+
+                latencies[c].push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - sent).count());
+            }
+            ::close(fd);
+        });
+    }
+    for (std::thread& client : clients)
+        client.join();
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    vector<double> all;
+    for (const vector<double>& l : latencies)
+        all.insert(all.end(), l.begin(), l.end());
+    std::sort(all.begin(), all.end());
+    if (all.empty())
+        exitWithMsg("No requests completed", -1);
+
+    const auto percentile = [&](double p) { return all[std::min(all.size() - 1, static_cast<usize>(p * all.size()))]; };
+    cout << formatNum(all.size()) << " requests in " << seconds << "s, " << all.size() / seconds << " requests/s, " << failures << " failures" << endl;
+    cout << "latency us  p50 " << percentile(0.5) << "  p90 " << percentile(0.9) << "  p99 " << percentile(0.99) << "  max " << all.back() << endl;
+#endif
+}
@@ -0,0 +1,80 @@
+// Inference server: serve <weights> [--socket path] [--max-batch n] [--max-latency-us n] [--workers n] [--fast-math]
+// Serves over stdin and stdout unless a socket path is given, see protocol in server.h
+
+#include "server.h"
+
+#include <csignal>
+#include <cstdio>
+
+int main(int argc, char** argv) {
+    if (argc < 2)
+        exitWithMsg("Usage: serve <weights> [--socket path] [--max-batch n] [--max-latency-us n] [--workers n] [--fast-math]", -1);
+
+    const string weightsPath = argv[1];
+    string socketPath;
+    ServerConfig config;
+    MathMode mathMode = EXACT_MATH;
+
+    for (int i = 2; i < argc; i++) {
+        const string arg = argv[i];
+        const auto value = [&]() -> string {
+            if (i + 1 >= argc)
+                exitWithMsg("Missing value for " + arg, -1);
+            return argv[++i];
+        };
+
+        if (arg == "--socket")
+            socketPath = value();
+        else if (arg == "--max-batch")
+            config.maxBatch = std::stoull(value());
+        else if (arg == "--max-latency-us")
+            config.maxLatencyMicros = std::stoull(value());
+        else if (arg == "--workers")
+            config.workers = std::stoull(value());
+        else if (arg == "--fast-math")
+            mathMode = FAST_MATH;
+        else
+            exitWithMsg("Unknown argument " + arg, -1);
+    }
+
+    // Version 3 files are mapped and shared with every other server on the host, older ones are loaded
+    u64 magic = 0;
+    u32 version = 0;
+    {
+        std::ifstream file(weightsPath, std::ios::binary);
+        if (!file)
+            exitWithMsg("File not found " + weightsPath, -1);
+        file.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+        file.read(reinterpret_cast<char*>(&version), sizeof(version));
+    }
+
+    std::unique_ptr<ExecutionPlan> plan;
+    if (magic == WEIGHTS_MAGIC && version == 3)
+        plan = std::make_unique<ExecutionPlan>(std::make_shared<const MappedWeights>(weightsPath), INFERENCE_PLAN, false, mathMode);
+    else {
+        Network net = loadWeights(weightsPath);
+        net.mathMode = mathMode;
+        plan = std::make_unique<ExecutionPlan>(net);
+    }
+
+    cerr << "Serving " << plan->inputSize << " inputs -> " << plan->outputSize << " outputs, max batch " << config.maxBatch
+         << ", max latency " << config.maxLatencyMicros << "us, " << config.workers << " workers" << endl;
+
+    InferenceServer server(*plan, config);
+
+    if (!socketPath.empty()) {
+#ifndef _WIN32
+        std::signal(SIGPIPE, SIG_IGN);
+#endif
+        server.serveSocket(socketPath);
+    }
+    else {
+#ifdef _WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        server.serveStream(0, 1);
+        server.drain();
+        cerr << "Answered " << server.requests << " requests in " << server.batches << " batches, mean batch size " << server.meanBatchSize() << endl;
+    }
+}